@@ -0,0 +1,167 @@
+#!/bin/bash
+# bench_netem.sh
+# Reproduces the README test matrix on one Linux box: sender, router and
+# receiver each get a network namespace, joined by veth pairs; the router
+# shapes both directions with netem (delay, loss) and tbf (rate).
+# Every case is run REPS times on a generated file, checked with cmp, and
+# written to $OUT/results.csv and $OUT/results.json.
+# Usage: sudo ./bench_netem.sh
+# Env:   SIZE=bytes (104857600)  REPS=n (1)  OUT=dir (./bench_out)
+#        SND_ARGS / RCV_ARGS   extra sender/receiver options
+#        CASES="1 2 3"         which cases to run  MTUS="1500 9001"
+#        DEDUP_CHECK=0         skip the closing dedup + compress run
+# Needs: root, iproute2 (ip, tc), sch_netem and sch_tbf, gcc.
+# Delay is split evenly over both directions; loss and rate apply to the
+# data direction (router -> receiver) only, as on the EC2 router.
+
+set -euo pipefail
+
+SIZE=${SIZE:-104857600}
+REPS=${REPS:-1}
+OUT=${OUT:-./bench_out}
+SND_ARGS=${SND_ARGS:-}
+RCV_ARGS=${RCV_ARGS:-}
+CASES=${CASES:-"1 2 3"}
+MTUS=${MTUS:-"1500 9001"}
+PORT=9000
+SRC=$(cd "$(dirname "$0")" && pwd)
+
+# case -> rate RTT loss, as in the README table
+case_rate() { case $1 in 1|2) echo 100mbit;; 3) echo 80mbit;; esac; }
+case_rtt()  { case $1 in 1) echo 10;; 2|3) echo 200;; esac; }
+case_loss() { case $1 in 1) echo 1;; 2) echo 20;; 3) echo 0;; esac; }
+
+NS_S=cftp_snd NS_R=cftp_rtr NS_C=cftp_rcv
+
+cleanup(){
+    for ns in $NS_S $NS_R $NS_C; do ip netns del $ns 2>/dev/null || true; done
+}
+
+setup(){            # setup MTU
+    local mtu=$1
+    cleanup
+    for ns in $NS_S $NS_R $NS_C; do ip netns add $ns; ip -n $ns link set lo up; done
+    ip link add v_s type veth peer name v_rs
+    ip link add v_c type veth peer name v_rc
+    ip link set v_s netns $NS_S;  ip link set v_rs netns $NS_R
+    ip link set v_c netns $NS_C;  ip link set v_rc netns $NS_R
+    ip -n $NS_S addr add 10.77.1.2/24 dev v_s
+    ip -n $NS_R addr add 10.77.1.1/24 dev v_rs
+    ip -n $NS_R addr add 10.77.2.1/24 dev v_rc
+    ip -n $NS_C addr add 10.77.2.2/24 dev v_c
+    for pair in "$NS_S v_s" "$NS_R v_rs" "$NS_R v_rc" "$NS_C v_c"; do
+        set -- $pair
+        ip -n $1 link set $2 mtu "$mtu" up
+        # veth offloads would hand netem 64 KiB super-packets
+        ip netns exec $1 ethtool -K $2 tso off gso off gro off >/dev/null 2>&1 || true
+    done
+    ip -n $NS_S route add default via 10.77.1.1
+    ip -n $NS_C route add default via 10.77.2.1
+    ip netns exec $NS_R sysctl -qw net.ipv4.ip_forward=1
+    ip netns exec $NS_R tc qdisc add dev v_rs root netem delay 0ms 2>/dev/null ||
+        { echo "bench_netem.sh: netem qdisc unavailable (modprobe sch_netem)" >&2; exit 2; }
+}
+
+shape(){            # shape RATE RTT_MS LOSS_PCT
+    local rate=$1 half=$(( $2 / 2 )) loss=$3
+    local burst=$(( ${rate%mbit} * 1000000 / 8 / 250 ))      # 4 ms worth, at least 2 jumbo frames
+    [ $burst -lt 20000 ] && burst=20000
+    # data direction: delay + loss, then the rate limit below it
+    ip netns exec $NS_R tc qdisc del dev v_rc root 2>/dev/null || true
+    ip netns exec $NS_R tc qdisc add dev v_rc root handle 1: netem delay ${half}ms loss ${loss}% limit 100000
+    ip netns exec $NS_R tc qdisc add dev v_rc parent 1:1 handle 10: tbf rate $rate burst $burst latency 100ms
+    # ACK direction: delay only
+    ip netns exec $NS_R tc qdisc replace dev v_rs root netem delay ${half}ms limit 100000
+}
+
+# timed CPUFILE OUTFILE LOGFILE cmd...: runs cmd with stdout/stderr to the
+# files and its user and sys CPU seconds to CPUFILE
+timed(){
+    local tf=$1 out=$2 log=$3; shift 3
+    local TIMEFORMAT='%U %S'
+    { time "$@" > "$out" 2> "$log" ; } 2> "$tf"
+}
+
+[ "$(id -u)" = 0 ] || { echo "bench_netem.sh: must run as root" >&2; exit 2; }
+mkdir -p "$OUT"
+OUT=$(cd "$OUT" && pwd)
+WORK=$(mktemp -d)
+trap 'cleanup; rm -rf "$WORK"' EXIT
+
+gcc -O2 -std=gnu11 -Wall -Wextra -pthread -o "$WORK/udp_sender"   "$SRC/udp_sender.c"
+gcc -O2 -std=gnu11 -Wall -Wextra -pthread -o "$WORK/udp_receiver" "$SRC/udp_receiver.c"
+head -c "$SIZE" /dev/urandom > "$WORK/in.bin"
+
+CSV=$OUT/results.csv
+JSON=$OUT/results.json
+echo "case,mtu,rate,rtt_ms,loss_pct,rep,bytes,seconds,mbps,retransmits,snd_cpu_s,rcv_cpu_s,ok" > "$CSV"
+echo "[" > "$JSON"
+first=1
+
+for mtu in $MTUS; do
+    setup "$mtu"
+    for c in $CASES; do
+        rate=$(case_rate $c) rtt=$(case_rtt $c) loss=$(case_loss $c)
+        shape $rate $rtt $loss
+        for rep in $(seq 1 "$REPS"); do
+            tag="c${c}_m${mtu}_r${rep}"
+            rm -f "$WORK/out.bin"
+            timed "$WORK/$tag.rcv.cpu" "$WORK/$tag.rcv.out" "$WORK/$tag.rcv.log" \
+                timeout 1800 ip netns exec $NS_C "$WORK/udp_receiver" "$WORK/out.bin" --port $PORT $RCV_ARGS &
+            rpid=$!
+            sleep 0.5
+            ok=1
+            timed "$WORK/$tag.snd.cpu" "$WORK/$tag.snd.out" "$WORK/$tag.snd.log" \
+                timeout 1800 ip netns exec $NS_S "$WORK/udp_sender" 10.77.2.2 "$WORK/in.bin" \
+                --port $PORT --mtu "$mtu" $SND_ARGS || ok=0
+            wait $rpid || ok=0
+            cmp -s "$WORK/in.bin" "$WORK/out.bin" || ok=0
+            cp "$WORK/$tag".*.log "$OUT/" 2>/dev/null || true
+
+            line=$(grep '^Sender:' "$WORK/$tag.snd.out" || true)
+            secs=$(sed -n 's/.* in \([0-9.]*\) s.*/\1/p' <<< "$line")
+            mbps=$(sed -n 's/.*avg \([0-9.]*\) Mb\/s.*/\1/p' <<< "$line")
+            retx=$(sed -n 's/.*, \([0-9]*\) retransmits.*/\1/p' <<< "$line")
+            scpu=$(awk '{ printf "%.3f", $1 + $2 }' "$WORK/$tag.snd.cpu" 2>/dev/null || true)
+            rcpu=$(awk '{ printf "%.3f", $1 + $2 }' "$WORK/$tag.rcv.cpu" 2>/dev/null || true)
+            : "${secs:=0}" "${mbps:=0}" "${retx:=0}" "${scpu:=0}" "${rcpu:=0}"
+            [ "$ok" = 1 ] && okj=true || okj=false
+
+            echo "$c,$mtu,$rate,$rtt,$loss,$rep,$SIZE,$secs,$mbps,$retx,$scpu,$rcpu,$ok" >> "$CSV"
+            [ $first = 1 ] || echo "," >> "$JSON"
+            first=0
+            printf '  {"case": %s, "mtu": %s, "rate": "%s", "rtt_ms": %s, "loss_pct": %s, "rep": %s, "bytes": %s, "seconds": %s, "mbps": %s, "retransmits": %s, "snd_cpu_s": %s, "rcv_cpu_s": %s, "ok": %s}' \
+                $c $mtu $rate $rtt $loss $rep $SIZE $secs $mbps $retx $scpu $rcpu $okj >> "$JSON"
+            printf 'case %s mtu %-4s %-7s rtt %3sms loss %2s%%: %8s Mb/s  retx %-8s cpu %s/%s s  %s\n' \
+                $c $mtu $rate $rtt $loss $mbps $retx $scpu $rcpu "$([ $ok = 1 ] && echo ok || echo FAILED)"
+        done
+    done
+done
+printf '\n]\n' >> "$JSON"
+
+# Regression: an edited copy sent with --dedup 1 --compress 1 against a filled
+# store (dedup pre-acks most chunks before the compression workers start).
+if [ "${DEDUP_CHECK:-1}" = 1 ]; then
+    mtu=${MTUS%% *}
+    setup "$mtu"
+    shape $(case_rate 1) $(case_rtt 1) $(case_loss 1)
+    cp "$WORK/in.bin" "$WORK/edit.bin"
+    printf 'edit' | dd of="$WORK/edit.bin" bs=1 seek=$(( SIZE / 2 )) conv=notrunc status=none
+    mkdir -p "$WORK/store"
+    ok=1
+    for f in in.bin edit.bin; do
+        rm -f "$WORK/out.bin"
+        args="--dedup 1"; [ $f = edit.bin ] && args="--dedup 1 --compress 1"
+        timeout 1800 ip netns exec $NS_C "$WORK/udp_receiver" "$WORK/out.bin" --port $PORT \
+            --store "$WORK/store" > "$WORK/dedup.rcv.out" 2> "$WORK/dedup.rcv.log" &
+        rpid=$!
+        sleep 0.5
+        timeout 1800 ip netns exec $NS_S "$WORK/udp_sender" 10.77.2.2 "$WORK/$f" \
+            --port $PORT --mtu "$mtu" $args > "$WORK/dedup.snd.out" 2> "$WORK/dedup.snd.log" || ok=0
+        wait $rpid || ok=0
+        cmp -s "$WORK/$f" "$WORK/out.bin" || ok=0
+    done
+    cp "$WORK"/dedup.*.log "$OUT/" 2>/dev/null || true
+    echo "dedup + compress, edited copy: $([ $ok = 1 ] && echo ok || echo FAILED)"
+fi
+echo "Results: $CSV $JSON"
@@ -0,0 +1,257 @@
+// blake3.h
+// Compact portable BLAKE3 (hash mode, 32-byte output) plus the CFTP tree hash
+// built on top of it. The tree hash is what the sender and receiver exchange at
+// END: the file is cut into HASH_BLOCK-sized leaves that can be hashed in any
+// order, so the receiver can fold in each leaf as soon as its bytes land.
+//
+//   leaf[i] = BLAKE3(0x00 || block i)
+//   node    = BLAKE3(0x01 || left || right)   (odd node is promoted unchanged)
+//   root    = top node (a one-leaf file's root is its leaf digest)
+//
+// Node m of level l+1 covers nodes 2m and 2m+1 of level l, so both sides can
+// walk the tree top-down to find the leaves that differ (Merkle repair).
+
+#ifndef CFTP_BLAKE3_H
+#define CFTP_BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BLAKE3_OUT_LEN   32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+enum { B3_CHUNK_START = 1, B3_CHUNK_END = 2, B3_PARENT = 4, B3_ROOT = 8 };
+
+static const uint32_t B3_IV[8] = {
+    0x6A09E667u, 0xBB67AE85u, 0x3C6EF372u, 0xA54FF53Au,
+    0x510E527Fu, 0x9B05688Cu, 0x1F83D9ABu, 0x5BE0CD19u
+};
+static const uint8_t B3_PERM[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+static inline uint32_t b3_rotr(uint32_t w, int c){ return (w >> c) | (w << (32 - c)); }
+
+static inline uint32_t b3_load32(const uint8_t* p){
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#define B3_G(a,b,c,d,x,y) do { \
+    s[a] = s[a] + s[b] + (x); s[d] = b3_rotr(s[d] ^ s[a], 16); \
+    s[c] = s[c] + s[d];       s[b] = b3_rotr(s[b] ^ s[c], 12); \
+    s[a] = s[a] + s[b] + (y); s[d] = b3_rotr(s[d] ^ s[a], 8);  \
+    s[c] = s[c] + s[d];       s[b] = b3_rotr(s[b] ^ s[c], 7);  \
+} while (0)
+
+// One compression; writes the 8-word chaining value to out.
+static void b3_compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+                        uint8_t block_len, uint64_t counter, uint8_t flags, uint32_t out[8]){
+    uint32_t m[16], t[16], s[16];
+    for (int i=0; i<16; ++i) m[i] = b3_load32(block + 4*i);
+    for (int i=0; i<8; ++i) s[i] = cv[i];
+    s[8] = B3_IV[0]; s[9] = B3_IV[1]; s[10] = B3_IV[2]; s[11] = B3_IV[3];
+    s[12] = (uint32_t)counter; s[13] = (uint32_t)(counter >> 32);
+    s[14] = block_len; s[15] = flags;
+    for (int r=0; r<7; ++r){
+        B3_G(0, 4,  8, 12, m[0],  m[1]);
+        B3_G(1, 5,  9, 13, m[2],  m[3]);
+        B3_G(2, 6, 10, 14, m[4],  m[5]);
+        B3_G(3, 7, 11, 15, m[6],  m[7]);
+        B3_G(0, 5, 10, 15, m[8],  m[9]);
+        B3_G(1, 6, 11, 12, m[10], m[11]);
+        B3_G(2, 7,  8, 13, m[12], m[13]);
+        B3_G(3, 4,  9, 14, m[14], m[15]);
+        if (r < 6){
+            for (int i=0; i<16; ++i) t[i] = m[B3_PERM[i]];
+            memcpy(m, t, sizeof(m));
+        }
+    }
+    for (int i=0; i<8; ++i) out[i] = s[i] ^ s[i+8];
+}
+
+// Pending output node: compressed either as a chaining value or as the root.
+typedef struct {
+    uint32_t cv[8];
+    uint8_t  block[BLAKE3_BLOCK_LEN];
+    uint8_t  block_len;
+    uint64_t counter;
+    uint8_t  flags;
+} b3_output_t;
+
+typedef struct {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t  buf[BLAKE3_BLOCK_LEN];
+    uint8_t  buf_len;
+    uint8_t  blocks_compressed;
+} b3_chunk_t;
+
+typedef struct {
+    b3_chunk_t chunk;
+    uint32_t   stack[54][8];   // one CV per level; 2^54 chunks is plenty
+    uint8_t    stack_len;
+} blake3_hasher;
+
+static void b3_chunk_init(b3_chunk_t* c, uint64_t counter){
+    memcpy(c->cv, B3_IV, sizeof(c->cv));
+    c->chunk_counter = counter;
+    c->buf_len = 0;
+    c->blocks_compressed = 0;
+    memset(c->buf, 0, sizeof(c->buf));
+}
+
+static size_t b3_chunk_len(const b3_chunk_t* c){
+    return (size_t)BLAKE3_BLOCK_LEN * c->blocks_compressed + c->buf_len;
+}
+
+static void b3_chunk_update(b3_chunk_t* c, const uint8_t* in, size_t n){
+    while (n){
+        if (c->buf_len == BLAKE3_BLOCK_LEN){
+            b3_compress(c->cv, c->buf, BLAKE3_BLOCK_LEN, c->chunk_counter,
+                        c->blocks_compressed ? 0 : B3_CHUNK_START, c->cv);
+            c->blocks_compressed++;
+            c->buf_len = 0;
+            memset(c->buf, 0, sizeof(c->buf));
+        }
+        size_t take = BLAKE3_BLOCK_LEN - c->buf_len;
+        if (take > n) take = n;
+        memcpy(c->buf + c->buf_len, in, take);
+        c->buf_len += (uint8_t)take;
+        in += take; n -= take;
+    }
+}
+
+static b3_output_t b3_chunk_output(const b3_chunk_t* c){
+    b3_output_t o;
+    memcpy(o.cv, c->cv, sizeof(o.cv));
+    memcpy(o.block, c->buf, sizeof(o.block));
+    o.block_len = c->buf_len;
+    o.counter = c->chunk_counter;
+    o.flags = (uint8_t)((c->blocks_compressed ? 0 : B3_CHUNK_START) | B3_CHUNK_END);
+    return o;
+}
+
+static b3_output_t b3_parent_output(const uint32_t l[8], const uint32_t r[8]){
+    b3_output_t o;
+    memcpy(o.cv, B3_IV, sizeof(o.cv));
+    for (int i=0; i<8; ++i){
+        for (int k=0; k<4; ++k){
+            o.block[4*i + k]      = (uint8_t)(l[i] >> (8*k));
+            o.block[32 + 4*i + k] = (uint8_t)(r[i] >> (8*k));
+        }
+    }
+    o.block_len = BLAKE3_BLOCK_LEN;
+    o.counter = 0;
+    o.flags = B3_PARENT;
+    return o;
+}
+
+static void b3_output_cv(const b3_output_t* o, uint32_t out[8]){
+    b3_compress(o->cv, o->block, o->block_len, o->counter, o->flags, out);
+}
+
+static void blake3_init(blake3_hasher* h){
+    b3_chunk_init(&h->chunk, 0);
+    h->stack_len = 0;
+}
+
+static void blake3_update(blake3_hasher* h, const void* data, size_t n){
+    const uint8_t* in = (const uint8_t*)data;
+    while (n){
+        if (b3_chunk_len(&h->chunk) == BLAKE3_CHUNK_LEN){
+            uint32_t cv[8];
+            b3_output_t o = b3_chunk_output(&h->chunk);
+            b3_output_cv(&o, cv);
+            uint64_t total = h->chunk.chunk_counter + 1;
+            // merge completed subtrees: one merge per trailing zero bit
+            while ((total & 1) == 0){
+                b3_output_t p = b3_parent_output(h->stack[--h->stack_len], cv);
+                b3_output_cv(&p, cv);
+                total >>= 1;
+            }
+            memcpy(h->stack[h->stack_len++], cv, sizeof(cv));
+            b3_chunk_init(&h->chunk, h->chunk.chunk_counter + 1);
+        }
+        size_t take = BLAKE3_CHUNK_LEN - b3_chunk_len(&h->chunk);
+        if (take > n) take = n;
+        b3_chunk_update(&h->chunk, in, take);
+        in += take; n -= take;
+    }
+}
+
+static void blake3_final(const blake3_hasher* h, uint8_t out[BLAKE3_OUT_LEN]){
+    b3_output_t o = b3_chunk_output(&h->chunk);
+    for (int i = h->stack_len; i > 0; --i){
+        uint32_t cv[8];
+        b3_output_cv(&o, cv);
+        o = b3_parent_output(h->stack[i-1], cv);
+    }
+    uint32_t w[8];
+    b3_compress(o.cv, o.block, o.block_len, 0, (uint8_t)(o.flags | B3_ROOT), w);
+    for (int i=0; i<8; ++i)
+        for (int k=0; k<4; ++k) out[4*i + k] = (uint8_t)(w[i] >> (8*k));
+}
+
+// ---- CFTP tree hash -------------------------------------------------------
+
+#define HASH_BLOCK (256u * 1024u)   // leaf size; fixed by FEAT_TREE_HASH
+
+static inline uint32_t tree_leaves(uint64_t total){
+    return (uint32_t)((total + HASH_BLOCK - 1) / HASH_BLOCK);
+}
+
+static void tree_leaf(const uint8_t* data, size_t n, uint8_t out[BLAKE3_OUT_LEN]){
+    static const uint8_t tag = 0x00;
+    blake3_hasher h; blake3_init(&h);
+    blake3_update(&h, &tag, 1);
+    blake3_update(&h, data, n);
+    blake3_final(&h, out);
+}
+
+static void tree_node(const uint8_t l[BLAKE3_OUT_LEN], const uint8_t r[BLAKE3_OUT_LEN],
+                      uint8_t out[BLAKE3_OUT_LEN]){
+    static const uint8_t tag = 0x01;
+    blake3_hasher h; blake3_init(&h);
+    blake3_update(&h, &tag, 1);
+    blake3_update(&h, l, BLAKE3_OUT_LEN);
+    blake3_update(&h, r, BLAKE3_OUT_LEN);
+    blake3_final(&h, out);
+}
+
+// Level sizes/offsets of the tree over n leaves (n >= 1). Level 0 = leaves,
+// level nlev-1 = root. All levels live back to back in one digest array.
+typedef struct {
+    uint32_t nlev;
+    uint32_t cnt[34];
+    uint64_t off[34];     // index (in digests) of each level's first node
+    uint64_t total;       // digests in the whole tree
+} tree_shape_t;
+
+static void tree_shape(uint32_t n, tree_shape_t* t){
+    t->nlev = 0; t->total = 0;
+    for (;;){
+        t->cnt[t->nlev] = n;
+        t->off[t->nlev] = t->total;
+        t->total += n; t->nlev++;
+        if (n == 1) break;
+        n = (n + 1) / 2;
+    }
+}
+
+static inline uint8_t* tree_at(uint8_t* nodes, const tree_shape_t* t, uint32_t lev, uint32_t i){
+    return nodes + (size_t)(t->off[lev] + i) * BLAKE3_OUT_LEN;
+}
+
+// Fills every level above the leaves (level 0 must already be filled).
+static void tree_build(uint8_t* nodes, const tree_shape_t* t){
+    for (uint32_t l=1; l<t->nlev; ++l){
+        for (uint32_t m=0; m<t->cnt[l]; ++m){
+            uint32_t i = 2*m;
+            if (i + 1 < t->cnt[l-1]) tree_node(tree_at(nodes, t, l-1, i), tree_at(nodes, t, l-1, i+1),
+                                               tree_at(nodes, t, l, m));
+            else memcpy(tree_at(nodes, t, l, m), tree_at(nodes, t, l-1, i), BLAKE3_OUT_LEN);
+        }
+    }
+}
+
+#endif // CFTP_BLAKE3_H
@@ -0,0 +1,248 @@
+// cftp_bench.c
+// Microbenchmarks for the per-packet work in the send and receive loops:
+// header encode/decode, the receiver's have-map update and SACK mask, the
+// sender's ACK/SACK application and its retransmit scan, and the payload copy
+// into the mmap. The ACK/SACK kernels call the helpers both binaries use
+// (sack.h); only the driving loops, which stand in for the socket, live here.
+// Build: gcc -O2 -std=gnu11 -Wall -Wextra -o cftp_bench cftp_bench.c
+// Usage: ./cftp_bench [--segs N] [--payload B] [--reps N] [--filter NAME] [--seed N]
+// Notes: each case runs --reps times and the fastest run is reported, as
+//        ns per packet and TSC cycles per payload byte (--payload bytes per
+//        segment). Arrival orders come from a model of the sender: a window of
+//        --win segments, each send lost per the loss pattern, and a lost
+//        segment resent one window later (the RTO). rx_sack replays that
+//        order into the have-map and produces the ACK stream tx_sack and
+//        tx_scan apply. tx_scan is tx_sack plus the per-ACK retransmit scan
+//        over the window; the difference is the scan. The place target is
+//        populated up front, so page faults are not counted.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include "cftp_proto.h"
+#include "sack.h"
+#include "segmap.h"
+
+typedef struct { uint32_t cum; uint64_t mask; } ack_t;
+
+enum { LOSS_NONE, LOSS_RAND1, LOSS_RAND5, LOSS_BURST, LOSS_COUNT };
+static const char* loss_name[LOSS_COUNT] = { "none", "rand1%", "rand5%", "burst" };
+static const uint32_t wins[] = { 64, 256, 1024 };
+
+static uint64_t rng;
+static inline uint64_t xrand(void){
+    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+    return rng;
+}
+static inline int chance(double p){ return (double)(xrand() >> 11) / 9007199254740992.0 < p; }
+
+static uint32_t segs = 100000, payload = 1465, reps = 5;
+static const char* filter;
+static volatile uint64_t sink;
+
+static inline double now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, const char* win, const char* loss, uint64_t pkts, double ns, uint64_t ticks){
+    printf("%-10s %5s %-7s %10lu %10.2f %10.4f\n", name, win, loss, (unsigned long)pkts,
+           ns / (double)pkts, (double)ticks / ((double)pkts * payload));
+}
+
+#define BENCH(name, win, loss, pkts, setup, ...) do { \
+        if (filter && !strstr(name, filter)) break; \
+        double best = 0; uint64_t best_t = 0; \
+        for (uint32_t r_=0; r_<reps; ++r_){ \
+            setup; \
+            double t0 = now_ns(); uint64_t c0 = __rdtsc(); \
+            __VA_ARGS__; \
+            uint64_t c1 = __rdtsc(); double t1 = now_ns(); \
+            if (!r_ || t1 - t0 < best){ best = t1 - t0; best_t = c1 - c0; } \
+        } \
+        report(name, win, loss, pkts, best, best_t); \
+    } while (0)
+
+// Delivered seqs for one window/loss case; returns the count.
+static uint32_t* gen_arrivals(uint32_t win, int loss, uint64_t* n_out){
+    uint64_t cap = (uint64_t)segs * 2 + 1024, n = 0, qh = 0, qt = 0;
+    uint32_t* arr = malloc(cap * sizeof(*arr));
+    struct { uint64_t due; uint32_t seq; }* q = malloc(cap * sizeof(*q));
+    if (!arr || !q){ perror("malloc"); exit(1); }
+    int bad = 0;
+    uint32_t next = 1;
+    for (uint64_t t = 0; next <= segs || qh < qt; ++t){
+        uint32_t s;
+        if (qh < qt && (q[qh].due <= t || next > segs)) s = q[qh++].seq;
+        else s = next++;
+        int lost = 0;
+        switch (loss){
+            case LOSS_RAND1: lost = chance(0.01); break;
+            case LOSS_RAND5: lost = chance(0.05); break;
+            case LOSS_BURST: bad = bad ? !chance(0.10) : chance(0.002); lost = bad; break;
+        }
+        if (lost){
+            if (qt == cap){ perror("loss queue"); exit(1); }
+            q[qt].due = t + win; q[qt++].seq = s;
+            continue;
+        }
+        if (n == cap){ cap *= 2; arr = realloc(arr, cap * sizeof(*arr)); if (!arr){ perror("realloc"); exit(1); } }
+        arr[n++] = s;
+    }
+    free(q);
+    *n_out = n;
+    return arr;
+}
+
+static void bench_hdr(void){
+    uint64_t n = segs;
+    uint8_t* bufs = malloc((size_t)n * 16);
+    if (!bufs){ perror("malloc"); exit(1); }
+    BENCH("hdr_encode", "-", "-", n, (void)0, {
+        for (uint64_t i=0; i<n; ++i){
+            uint8_t* b = bufs + i * 16;
+            pkt_hdr_t h = { .type = PKT_DATA, .seq = htonl((uint32_t)i + 1), .len = htons((uint16_t)payload) };
+            memcpy(b, &h, sizeof(h));
+            uint64_t m = htonll(i * 0x9e3779b97f4a7c15ULL);
+            memcpy(b + sizeof(h), &m, sizeof(m));
+        }
+        __asm__ volatile("" ::: "memory");
+    });
+    BENCH("hdr_decode", "-", "-", n, (void)0, {
+        uint64_t acc = 0;
+        for (uint64_t i=0; i<n; ++i){
+            const uint8_t* b = bufs + i * 16;
+            const pkt_hdr_t* h = (const pkt_hdr_t*)b;
+            uint64_t m;
+            memcpy(&m, b + sizeof(*h), sizeof(m));
+            acc += h->type == PKT_DATA ? ntohl(h->seq) + ntohs(h->len) + ntohll(m) : 0;
+        }
+        sink = acc;
+    });
+    free(bufs);
+}
+
+// Receiver: dup check, have-map, cum_ack advance, SACK mask (udp_receiver.c DATA path).
+static void rx_sack(segmap_t* have, const uint32_t* arr, uint64_t n, ack_t* acks){
+    uint32_t cum_ack = 0;
+    uint64_t dup = 0;
+    for (uint64_t i=0; i<n; ++i){
+        uint32_t seq = arr[i];
+        if (segmap_get(have, seq)) dup++;
+        else {
+            segmap_set(have, seq);
+            cum_ack = sack_advance(have, cum_ack, segs);
+        }
+        acks[i].cum = cum_ack;
+        acks[i].mask = sack_bits(have, cum_ack);
+    }
+    sink = dup;
+}
+
+// Sender: ACK <= cum, fresh SACK bits, base slide (udp_sender.c step 2), and
+// with scan set the timed-out-gap scan of step 3.
+static void tx_sack(segmap_t* acked, const ack_t* acks, uint64_t n, uint32_t win,
+                    int* tx_cnt, double* sent_ts, uint32_t rmask, int scan){
+    uint32_t base = 1, next_to_send = 1;
+    int in_flight = 0;
+    uint64_t retx = 0;
+    double t = 0, rto = (double)win * 4;
+    for (uint64_t i=0; i<n; ++i){
+        t += 1;
+        while (next_to_send <= segs && next_to_send < base + win){
+            tx_cnt[next_to_send & rmask] = 1;
+            sent_ts[next_to_send & rmask] = t;
+            in_flight++; next_to_send++;
+        }
+        sack_apply(acked, &base, acks[i].cum, acks[i].mask, segs, next_to_send,
+                   tx_cnt, sent_ts, rmask, &in_flight, t, NULL);
+        if (!scan) continue;
+        for (uint32_t s = base; (s = sack_next_due(acked, s, next_to_send, sent_ts, rmask, t, rto)) < next_to_send; ++s){
+            tx_cnt[s & rmask]++; sent_ts[s & rmask] = t; retx++;
+        }
+    }
+    sink = retx + (uint64_t)in_flight;
+}
+
+// Receiver: payload copy at the layout offset, in arrival order.
+static void place(uint8_t* dst, const uint8_t* src, const seg_layout_t* L, const uint32_t* arr, uint64_t n){
+    for (uint64_t i=0; i<n; ++i){
+        uint32_t len;
+        uint64_t off = layout_seg(L, arr[i], &len);
+        memcpy(dst + off, src + (arr[i] & 63) * 64, len);
+    }
+    __asm__ volatile("" ::: "memory");
+}
+
+int main(int argc, char** argv){
+    uint64_t seed = 1;
+    for (int i=1; i<argc; ++i){
+        if (!strcmp(argv[i], "--segs") && i+1<argc) segs = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--payload") && i+1<argc) payload = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--reps") && i+1<argc) reps = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--filter") && i+1<argc) filter = argv[++i];
+        else if (!strcmp(argv[i], "--seed") && i+1<argc) seed = (uint64_t)atoll(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [--segs N] [--payload B] [--reps N] [--filter NAME] [--seed N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (segs < 1 || payload < 1 || payload > 65000 || reps < 1){ fprintf(stderr, "bad parameters\n"); return 2; }
+
+    seg_layout_t L;
+    layout_init(&L, (uint64_t)segs * payload, payload, 0);
+    uint8_t* src = malloc(payload + 64 * 64);
+    uint8_t* dst = mmap(NULL, L.total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (!src || dst == MAP_FAILED){ perror("alloc"); return 1; }
+    memset(src, 0xa5, payload + 64 * 64);
+
+    printf("segs=%u payload=%u reps=%u\n", segs, payload, reps);
+    printf("%-10s %5s %-7s %10s %10s %10s\n", "bench", "win", "loss", "pkts", "ns/pkt", "cyc/byte");
+    bench_hdr();
+
+    uint32_t rmask = 1;
+    while (rmask < wins[sizeof(wins)/sizeof(wins[0]) - 1] * 2) rmask <<= 1;
+    int* tx_cnt = calloc(rmask, sizeof(*tx_cnt));
+    double* sent_ts = calloc(rmask, sizeof(*sent_ts));
+    if (!tx_cnt || !sent_ts){ perror("calloc"); return 1; }
+    rmask--;
+
+    for (size_t w=0; w<sizeof(wins)/sizeof(wins[0]); ++w){
+        for (int loss=0; loss<LOSS_COUNT; ++loss){
+            char ws[16];
+            snprintf(ws, sizeof(ws), "%u", wins[w]);
+            rng = seed * 0x9e3779b97f4a7c15ULL + (uint64_t)w * 131 + (uint64_t)loss + 1;
+            uint64_t n;
+            uint32_t* arr = gen_arrivals(wins[w], loss, &n);
+            ack_t* acks = malloc(n * sizeof(*acks));
+            if (!acks){ perror("malloc"); return 1; }
+            segmap_t m;
+
+            // the receiver's ACK stream feeds the sender cases
+            if (segmap_init(&m, (uint64_t)segs + 1)){ perror("segmap"); return 1; }
+            rx_sack(&m, arr, n, acks);
+            BENCH("rx_sack", ws, loss_name[loss], n,
+                  { segmap_free(&m); if (segmap_init(&m, (uint64_t)segs + 1)) { perror("segmap"); return 1; } },
+                  rx_sack(&m, arr, n, acks));
+            BENCH("tx_sack", ws, loss_name[loss], n,
+                  { segmap_free(&m); if (segmap_init(&m, (uint64_t)segs + 1)) { perror("segmap"); return 1; } },
+                  tx_sack(&m, acks, n, wins[w], tx_cnt, sent_ts, rmask, 0));
+            BENCH("tx_scan", ws, loss_name[loss], n,
+                  { segmap_free(&m); if (segmap_init(&m, (uint64_t)segs + 1)) { perror("segmap"); return 1; } },
+                  tx_sack(&m, acks, n, wins[w], tx_cnt, sent_ts, rmask, 1));
+            BENCH("place", ws, loss_name[loss], n, (void)0, place(dst, src, &L, arr, n));
+            segmap_free(&m);
+            free(acks);
+            free(arr);
+        }
+    }
+    munmap(dst, L.total);
+    free(src); free(tx_cnt); free(sent_ts);
+    return 0;
+}
@@ -0,0 +1,355 @@
+// cftp_proto.h
+// Wire format and segment layout shared by udp_sender.c and udp_receiver.c.
+// Both sides must compute identical (seq -> offset,len) mappings, so the
+// layout logic lives here instead of being duplicated per binary.
+
+#ifndef CFTP_PROTO_H
+#define CFTP_PROTO_H
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "segmap.h"
+
+enum { PKT_DATA=0x01, PKT_START=0x02, PKT_END=0x03, PKT_PROBE=0x04,
+       PKT_TREE_REQ=0x05, PKT_TREE_RSP=0x06, PKT_REPAIR=0x07,
+       PKT_RESUME_REQ=0x08, PKT_RESUME_MAP=0x09, PKT_ZERO=0x0A,
+       PKT_DELTA_REQ=0x0B, PKT_DELTA_SIG=0x0C, PKT_COPY=0x0D,
+       PKT_DEDUP_QUERY=0x0E, PKT_DEDUP_HAVE=0x0F, PKT_ACK=0x10, PKT_MANIFEST=0x11 };
+
+// PKT_PROBE: seq = probe id, len = padding bytes that follow. The receiver
+// answers with a bare PKT_PROBE header carrying the same seq (len 0), at any
+// time, so the sender can size payloads before START.
+
+#pragma pack(push,1)
+typedef struct {
+    uint8_t  type;   // PKT_*
+    uint32_t seq;    // network order on wire (for DATA/END); for ACK we keep it 0
+    uint16_t len;    // payload len for DATA; sizeof(ack payload) for ACK; nw order
+} pkt_hdr_t; // 7 bytes
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t cum_ack;    // highest contiguous DATA seq received
+    uint64_t sack_mask;  // bits for next 64 seqs after cum_ack (bit0 = cum_ack+1)
+} ack_payload_t;
+#pragma pack(pop)
+
+// Feature bits. The sender requests them in START, the receiver echoes the
+// subset it accepts in the START-ACK; only echoed features may be used.
+#define FEAT_CRC32C    (1u << 0)  // DATA: CRC32C of the payload (nw order) follows the header
+#define FEAT_TREE_HASH (1u << 1)  // END/END-ACK carry the whole-file tree hash root (blake3.h)
+#define FEAT_RESUME    (1u << 2)  // receiver may already hold segments (RESUME_REQ/RESUME_MAP)
+#define FEAT_COMPRESS  (1u << 3)  // DATA: per-chunk LZ4 (lz4blk.h), cz word after the CRC
+#define FEAT_SPARSE    (1u << 4)  // all-zero seq ranges travel as PKT_ZERO records
+#define FEAT_DELTA     (1u << 5)  // receiver has an older copy; seq ranges found in it travel as PKT_COPY
+#define FEAT_DEDUP     (1u << 6)  // receiver fills chunks it has in its store (DEDUP_QUERY/DEDUP_HAVE)
+#define FEAT_MULTI     (1u << 7)  // a directory tree as one stream of files (PKT_MANIFEST)
+#define FEAT_STREAM    (1u << 8)  // input of unknown length; END carries the final size
+#define FEAT_ALL       (FEAT_CRC32C | FEAT_TREE_HASH | FEAT_RESUME | FEAT_COMPRESS | \
+                        FEAT_SPARSE | FEAT_DELTA | FEAT_DEDUP | FEAT_MULTI | \
+                        FEAT_STREAM) // every feature this build understands
+
+#define DATA_CRC_LEN 4          // bytes between header and payload with FEAT_CRC32C
+#define CZ_HDR_LEN   4          // FEAT_COMPRESS: uint32 cz word (nw order) before the payload
+#define CZ_RAW       (1u << 31) // cz word: chunk sent uncompressed
+#define CZ_CHUNK     (64u * 1024u)  // START chunk with FEAT_COMPRESS; divides HASH_BLOCK
+
+// START payload. The sender is authoritative for the layout: the receiver
+// sizes its buffers from `payload` and ignores its own --mtu. A bare uint64_t
+// file size is still accepted (legacy senders); the receiver's --mtu applies then.
+#pragma pack(push,1)
+typedef struct {
+    uint64_t file_size;  // total bytes, nw order
+    uint32_t chunk;      // logical chunk size (power of two), 0 = flat layout; nw order
+    uint16_t payload;    // max DATA payload the sender will emit; nw order
+    uint32_t features;   // FEAT_* requested; nw order
+    uint64_t src_id;     // identity of the source file version (resume guard); nw order
+} start_payload_t;
+#pragma pack(pop)
+
+// START-ACK payload. Legacy receivers answer with a plain ack_payload_t,
+// which the sender treats as "no features accepted".
+#pragma pack(push,1)
+typedef struct {
+    ack_payload_t ack;
+    uint32_t features;   // FEAT_* accepted; nw order
+    uint32_t have_segs;  // FEAT_RESUME: segments already on disk at the receiver; nw order
+} start_ack_payload_t;
+#pragma pack(pop)
+
+// END-ACK payload with FEAT_TREE_HASH: the receiver's own root, so both sides
+// can report the outcome. The END itself carries the sender's 32-byte root.
+#pragma pack(push,1)
+typedef struct {
+    ack_payload_t ack;
+    uint8_t root[32];
+} end_ack_payload_t;
+#pragma pack(pop)
+
+// Merkle repair (FEAT_TREE_HASH, after a root mismatch at END).
+// PKT_TREE_REQ: receiver asks for `count` sender digests of tree level `level`
+//               starting at node `first` (levels as in blake3.h, 0 = leaves).
+// PKT_TREE_RSP: the request echoed, followed by count*32 digest bytes.
+// PKT_REPAIR  : seq = batch number, payload = uint32 leaf indices (nw order)
+//               whose segments the sender must send again; len 0 closes the
+//               list. The sender echoes each batch header (len 0).
+#pragma pack(push,1)
+typedef struct {
+    uint8_t  level;
+    uint32_t first;      // nw order
+    uint16_t count;      // nw order
+} tree_req_t;
+#pragma pack(pop)
+
+// Resume (FEAT_RESUME, START-ACK reported have_segs > 0).
+// PKT_RESUME_REQ: seq = first seq the sender wants described, len 0.
+// PKT_RESUME_MAP: seq echoes the request; payload = uint32 next (nw order,
+//                 first seq not covered) + RLE runs (see rle_encode) from seq.
+
+// Zero ranges (FEAT_SPARSE).
+// PKT_ZERO: sender -> receiver: seq = first seq, payload = uint32 count (nw
+//           order); every byte of seqs [seq, seq+count) is zero. With
+//           FEAT_COMPRESS the range covers whole chunks. The receiver answers
+//           with a bare PKT_ZERO echoing seq (len 0) once applied; until then
+//           the sender may still send any of those seqs as DATA.
+
+// Delta transfer (FEAT_DELTA, see delta.h). The receiver's previous version of
+// the file (the basis) is cut into nblocks whole blocks of block_len bytes.
+// PKT_DELTA_REQ: seq = first block index the sender wants signatures for, len 0.
+// PKT_DELTA_SIG: seq echoes the request; payload = delta_sig_hdr_t followed by
+//                as many delta_sig_t (blocks seq, seq+1, ...) as fit.
+// PKT_COPY     : sender -> receiver: seq = first seq, payload = copy_payload_t;
+//                seqs [seq, seq+count) are the basis bytes starting at src.
+//                Chunk-aligned and echoed exactly like PKT_ZERO.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t block_len;  // nw order
+    uint32_t nblocks;    // nw order
+} delta_sig_hdr_t;
+
+typedef struct {
+    uint32_t weak;       // delta_weak() of the block; nw order
+    uint64_t strong;     // delta_strong() of the block; nw order
+} delta_sig_t;
+
+typedef struct {
+    uint32_t count;      // nw order
+    uint64_t src;        // basis byte offset; nw order
+} copy_payload_t;
+#pragma pack(pop)
+
+// Chunk store dedup (FEAT_DEDUP, see dedup.h). The sender cuts the file into
+// content-defined chunks and lists them before sending any DATA.
+// PKT_DEDUP_QUERY: seq = index of the first chunk listed; payload =
+//                  dedup_query_hdr_t + one dedup_ent_t per chunk, back to back.
+// PKT_DEDUP_HAVE : seq echoes the query; payload = one bit per listed chunk
+//                  (LSB first), set if the receiver filled it from its store.
+// Both sides then treat the seqs lying wholly inside runs of filled chunks
+// (dedup_cover) as delivered.
+#pragma pack(push,1)
+typedef struct {
+    uint64_t off;        // file offset of the first chunk listed; nw order
+    uint32_t nchunks;    // chunks in the whole file; nw order
+} dedup_query_hdr_t;
+
+typedef struct {
+    uint32_t len;        // nw order
+    uint8_t  fp[32];     // BLAKE3-256 of the chunk
+} dedup_ent_t;
+#pragma pack(pop)
+
+// Multi-file session (FEAT_MULTI). START's file_size is the size of one
+// stream holding every file: files up to MULTI_PACK_MAX bytes are packed back
+// to back, larger ones take whole MULTI_ALIGN pages of their own so both
+// sides can map them in place. The manifest says where each file lives and is pushed
+// before any DATA.
+// PKT_MANIFEST: seq = index of the first entry listed; payload = uint32 entry
+//               count of the whole manifest (nw order), then per entry a
+//               manifest_ent_t followed by plen path bytes (relative,
+//               '/'-separated). The receiver echoes a bare PKT_MANIFEST (len
+//               0); the echo of the batch that completes the manifest is only
+//               sent once every file exists.
+#define MULTI_PACK_MAX (64u * 1024u)
+#define MULTI_ALIGN    4096u
+#define MULTI_MAX_ENT  (1u << 24)
+
+#pragma pack(push,1)
+typedef struct {
+    uint64_t off;        // stream offset; nw order
+    uint64_t size;       // nw order
+    uint32_t mode;       // st_mode: type and permission bits; nw order
+    uint16_t plen;       // nw order
+} manifest_ent_t;
+#pragma pack(pop)
+
+// Streaming session (FEAT_STREAM, only combined with FEAT_CRC32C). START's
+// file_size and chunk are 0; DATA seq s carries stream bytes
+// [(s-1)*payload, s*payload) and only the last one may be short. PKT_END
+// has seq = last seq + 1 and an 8-byte payload: the final size (nw order);
+// once everything is delivered the receiver acks it with cum_ack = that seq.
+// Segments more than STREAM_RING past cum_ack are dropped by the receiver.
+#define STREAM_RING 1024u
+
+#define PAYLOAD_LIMIT (65507 - (int)sizeof(pkt_hdr_t))  // largest UDP/IPv4 DATA payload
+
+static inline uint64_t htonll(uint64_t v){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return (((uint64_t)htonl(v & 0xffffffffULL)) << 32) | htonl((uint32_t)(v >> 32));
+#else
+    return v;
+#endif
+}
+static inline uint64_t ntohll(uint64_t v){ return htonll(v); }
+
+#define CHUNK_MIN 1024u
+#define CHUNK_MAX (1u << 20)
+
+// Segment layout.
+//   chunk == 0       : flat, seg i covers [(i-1)*payload, +payload)
+//   chunk <= payload : flat with stride = largest multiple of chunk <= payload,
+//                      so every DATA payload starts on a chunk boundary
+//   chunk >  payload : each chunk is split into seg_per_chunk sub-segments of
+//                      sub_len bytes (last one shorter); chunk boundaries
+//                      never fall inside a segment
+typedef struct {
+    uint64_t total;         // file size
+    uint32_t payload;       // negotiated max DATA payload
+    uint32_t chunk;         // 0 = flat
+    uint32_t stride;        // flat modes: bytes per segment
+    uint32_t seg_per_chunk; // split mode: segments per chunk (0 otherwise)
+    uint32_t sub_len;       // split mode: bytes per sub-segment
+    uint32_t total_segs;
+} seg_layout_t;
+
+static inline int chunk_valid(uint32_t chunk){
+    return chunk == 0 ||
+           (chunk >= CHUNK_MIN && chunk <= CHUNK_MAX && (chunk & (chunk - 1)) == 0);
+}
+
+// Returns 0 on success, -1 if the parameters cannot describe a layout.
+static inline int layout_init(seg_layout_t* L, uint64_t total, uint32_t payload, uint32_t chunk){
+    if (payload == 0 || !chunk_valid(chunk)) return -1;
+    L->total = total; L->payload = payload; L->chunk = chunk;
+    L->stride = 0; L->seg_per_chunk = 0; L->sub_len = 0;
+
+    if (chunk == 0 || chunk <= payload){
+        L->stride = chunk ? (payload / chunk) * chunk : payload;
+        L->total_segs = (uint32_t)((total + L->stride - 1) / L->stride);
+        return 0;
+    }
+    uint32_t k   = (chunk + payload - 1) / payload;
+    uint32_t sub = (chunk + k - 1) / k;
+    if (((sub + 63) & ~63u) <= payload) sub = (sub + 63) & ~63u;  // cache-line aligned sub-offsets
+    L->seg_per_chunk = k;
+    L->sub_len = sub;
+    uint64_t full = total / chunk, rem = total % chunk;
+    L->total_segs = (uint32_t)(full * k + (rem + sub - 1) / sub);
+    return 0;
+}
+
+// Byte offset and length of DATA seq (1-based). Caller guarantees 1 <= seq <= total_segs.
+static inline uint64_t layout_seg(const seg_layout_t* L, uint32_t seq, uint32_t* len){
+    uint64_t idx = (uint64_t)(seq - 1), off, lim;
+    if (!L->seg_per_chunk){
+        off = idx * L->stride;
+        lim = L->stride;
+    } else {
+        uint64_t c = idx / L->seg_per_chunk, s = idx % L->seg_per_chunk;
+        off = c * L->chunk + s * L->sub_len;
+        lim = L->chunk - s * L->sub_len;
+        if (lim > L->sub_len) lim = L->sub_len;
+    }
+    if (lim > L->total - off) lim = L->total - off;
+    *len = (uint32_t)lim;
+    return off;
+}
+
+// Seq (1-based) of the segment holding byte off. Caller guarantees off < total.
+static inline uint32_t layout_seq_at(const seg_layout_t* L, uint64_t off){
+    if (!L->seg_per_chunk) return (uint32_t)(off / L->stride) + 1;
+    uint64_t c = off / L->chunk, s = (off % L->chunk) / L->sub_len;
+    return (uint32_t)(c * L->seg_per_chunk + s) + 1;
+}
+
+// FEAT_COMPRESS. The layout is split mode with chunk == CZ_CHUNK and each chunk
+// travels as one stored blob: an LZ4 block, or the raw bytes (CZ_RAW). The cz
+// word = stored length | CZ_RAW flag, and is the same in every DATA of the
+// chunk. Stored bytes fill the chunk's seqs from its first one, sub_len per
+// seq. Seqs past the stored length are never sent. Both sides count them as
+// done once the chunk's cz word is known. The receiver stages stored bytes at
+// the chunk's own offset and decodes them in place when the chunk is complete.
+static inline uint32_t cz_chunks(const seg_layout_t* L){
+    return (uint32_t)((L->total + L->chunk - 1) / L->chunk);
+}
+static inline uint32_t cz_raw_len(const seg_layout_t* L, uint32_t c){
+    uint64_t off = (uint64_t)c * L->chunk;
+    return (uint32_t)(L->total - off < L->chunk ? L->total - off : L->chunk);
+}
+static inline uint32_t cz_first_seq(const seg_layout_t* L, uint32_t c){
+    return c * L->seg_per_chunk + 1;
+}
+static inline uint32_t cz_last_seq(const seg_layout_t* L, uint32_t c){
+    uint32_t last = (c + 1) * L->seg_per_chunk;
+    return last < L->total_segs ? last : L->total_segs;
+}
+static inline uint32_t cz_used_segs(const seg_layout_t* L, uint32_t stored){
+    return (stored + L->sub_len - 1) / L->sub_len;
+}
+
+// Run-length coding of a per-seq segmap (bit set = present): LEB128
+// varint run lengths alternating missing/present, starting with a (possibly
+// empty) missing run. Used on the wire (RESUME_MAP) and in the resume sidecar.
+static inline size_t varint_put(uint8_t* p, uint32_t v){
+    size_t n = 0;
+    while (v >= 0x80){ p[n++] = (uint8_t)(v | 0x80); v >>= 7; }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static inline size_t varint_get(const uint8_t* p, size_t avail, uint32_t* v){
+    uint32_t r = 0;
+    for (size_t n=0; n<avail && n<5; ++n){
+        r |= (uint32_t)(p[n] & 0x7f) << (7*n);
+        if (!(p[n] & 0x80)){ *v = r; return n + 1; }
+    }
+    return 0;
+}
+
+// Encodes map[from..to] as whole runs while they fit in cap bytes.
+// Returns bytes written; *next = first seq not described.
+static inline size_t rle_encode(const segmap_t* map, uint32_t from, uint32_t to,
+                                uint8_t* out, size_t cap, uint32_t* next){
+    size_t used = 0;
+    uint32_t s = from;
+    int want = 0;                        // current run: 0 = missing, 1 = present
+    while (s <= to && cap - used >= 5){
+        uint32_t e = (uint32_t)segmap_next(map, s, to, !want);
+        used += varint_put(out + used, e - s);
+        s = e; want = !want;
+    }
+    *next = s;
+    return used;
+}
+
+// Applies runs starting at seq from (present runs set their bits), never
+// past limit. Returns the first seq after the runs, or 0 if malformed.
+static inline uint32_t rle_decode(const uint8_t* in, size_t n, uint32_t from,
+                                  uint32_t limit, segmap_t* map){
+    uint32_t s = from, run;
+    int want = 0;
+    size_t used = 0, k;
+    while (used < n){
+        if (!(k = varint_get(in + used, n - used, &run))) return 0;
+        used += k;
+        if ((uint64_t)s + run > (uint64_t)limit + 1) return 0;
+        if (want) segmap_set_range(map, s, (uint64_t)s + run);
+        s += run; want = !want;
+    }
+    return s;
+}
+
+#endif // CFTP_PROTO_H
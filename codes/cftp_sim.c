@@ -0,0 +1,420 @@
+// cftp_sim.c
+// Discrete-event simulator: runs the real sender and receiver against each
+// other over a modeled link on a virtual clock, so a 1 GB transfer at 200 ms
+// RTT takes seconds of CPU instead of minutes of waiting.
+// Build: gcc -O2 -std=gnu11 -pthread -include sim.h -Dmain=cftp_sender_main -c udp_sender.c -o sim_sender.o
+//        gcc -O2 -std=gnu11 -pthread -include sim.h -Dmain=cftp_receiver_main -c udp_receiver.c -o sim_receiver.o
+//        gcc -O2 -std=gnu11 -Wall -Wextra -pthread -o cftp_sim cftp_sim.c sim_sender.o sim_receiver.o
+// Usage: ./cftp_sim [--rate MBPS] [--rtt MS] [--loss PCT] [--ack_loss PCT] [--queue_kb KB]
+//                   [--link_mtu M] [--seed N] -- <input> [sender options] -- <output> [receiver options]
+// Notes: sim.h redirects the binaries' CLOCK_MONOTONIC and socket calls here.
+//        Each program runs in its own thread, but only one at a time: when the
+//        running one blocks in recv, the clock jumps to the next packet arrival
+//        or receive timeout. The sender is 10.0.0.1, the receiver 10.0.0.2.
+//        The link is modeled per direction: serialisation at --rate (with
+//        28 bytes of IP/UDP header), --rtt/2 propagation delay, random loss,
+//        and a --queue_kb tail-drop queue in front of it. Datagrams larger
+//        than --link_mtu fail with EMSGSIZE, as with DF set.
+//        Computation takes no virtual time, so results show the protocol's
+//        behaviour on the link, not CPU limits. The binaries print their
+//        usual stats (in virtual seconds); the link stats follow.
+
+#define _GNU_SOURCE
+#define CFTP_SIM_IMPL
+#include "sim.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+int cftp_sender_main(int argc, char** argv);
+int cftp_receiver_main(int argc, char** argv);
+
+#define SIM_FD_BASE 1000000
+#define SIM_MAX_SOCK 16
+#define SIM_HDR 28
+
+enum { EP_SND, EP_RCV };
+enum { ST_NEW, ST_RUN, ST_BLOCKED, ST_DONE };
+
+typedef struct spkt {
+    struct spkt* next;
+    double at;
+    uint64_t id;
+    uint32_t src_ip, dst_ip;
+    uint16_t src_port, dst_port;
+    size_t len;
+    uint8_t data[];
+} spkt_t;
+
+typedef struct {
+    int used, ep;
+    uint32_t ip, peer_ip;
+    uint16_t port, peer_port;
+    double rcvtimeo;
+    spkt_t *head, *tail;
+} vsock_t;
+
+typedef struct {
+    double rate_bps, delay, loss, qbytes;
+    double busy;                  // when the link is next idle
+    uint64_t pkts, bytes, lost, qdrop;
+} link_t;
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cv[2], done_cv;
+    int state[2], rc[2], over, deadlock;
+    double deadline[2];
+    int wait_fd[2];
+    double T;
+    uint64_t ids, rng;
+    int mtu;
+    link_t link[2];               // indexed by the sending endpoint
+    vsock_t sock[SIM_MAX_SOCK];
+    spkt_t** heap;
+    size_t hn, hcap;
+} S = { .mu = PTHREAD_MUTEX_INITIALIZER, .cv = { PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER },
+        .done_cv = PTHREAD_COND_INITIALIZER, .rng = 1, .mtu = 65535 };
+
+static __thread int sim_ep = -1;
+
+static const uint32_t ep_ip[2] = { 0x0a000001, 0x0a000002 };
+
+static double sim_rand(void){
+    uint64_t z = (S.rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return (double)((z ^ (z >> 31)) >> 11) / 9007199254740992.0;
+}
+
+static double wall_now(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// ---- event heap: packets in flight, ordered by (arrival, id) ----
+static int pkt_before(const spkt_t* a, const spkt_t* b){
+    return a->at < b->at || (a->at == b->at && a->id < b->id);
+}
+
+static void heap_push(spkt_t* p){
+    if (S.hn == S.hcap){
+        S.hcap = S.hcap ? 2*S.hcap : 1024;
+        S.heap = realloc(S.heap, S.hcap * sizeof(*S.heap));
+        if (!S.heap){ perror("realloc"); exit(1); }
+    }
+    size_t i = S.hn++;
+    while (i && pkt_before(p, S.heap[(i-1)/2])){ S.heap[i] = S.heap[(i-1)/2]; i = (i-1)/2; }
+    S.heap[i] = p;
+}
+
+static spkt_t* heap_pop(void){
+    spkt_t* top = S.heap[0];
+    spkt_t* last = S.heap[--S.hn];
+    size_t i = 0;
+    for (;;){
+        size_t c = 2*i + 1;
+        if (c >= S.hn) break;
+        if (c + 1 < S.hn && pkt_before(S.heap[c+1], S.heap[c])) c++;
+        if (!pkt_before(S.heap[c], last)) break;
+        S.heap[i] = S.heap[c]; i = c;
+    }
+    if (S.hn) S.heap[i] = last;
+    return top;
+}
+
+static vsock_t* vsock_of(int fd){
+    int k = fd - SIM_FD_BASE;
+    if (k < 0 || k >= SIM_MAX_SOCK || !S.sock[k].used){ errno = EBADF; return NULL; }
+    return &S.sock[k];
+}
+
+// Moves every packet that has arrived by T into its socket's queue.
+static void deliver_due(void){
+    while (S.hn && S.heap[0]->at <= S.T){
+        spkt_t* p = heap_pop();
+        vsock_t* s = NULL;
+        for (int k=0; k<SIM_MAX_SOCK && !s; ++k)
+            if (S.sock[k].used && S.sock[k].ip == p->dst_ip && S.sock[k].port == p->dst_port) s = &S.sock[k];
+        if (!s){ free(p); continue; }          // port unreachable
+        p->next = NULL;
+        if (s->tail) s->tail->next = p; else s->head = p;
+        s->tail = p;
+    }
+}
+
+static int ep_ready(int ep){
+    if (S.state[ep] == ST_NEW) return 1;
+    if (S.state[ep] != ST_BLOCKED) return 0;
+    vsock_t* s = vsock_of(S.wait_fd[ep]);
+    return (s && s->head) || S.deadline[ep] <= S.T;
+}
+
+// Called with the lock held by the endpoint that is about to block or has
+// finished: hands the baton to whichever endpoint can run next, advancing
+// the clock as far as needed.
+static void sim_schedule(void){
+    for (;;){
+        deliver_due();
+        for (int ep=0; ep<2; ++ep){
+            if (!ep_ready(ep)) continue;
+            S.state[ep] = ST_RUN;
+            pthread_cond_signal(&S.cv[ep]);
+            return;
+        }
+        if (S.state[EP_SND] == ST_DONE && S.state[EP_RCV] == ST_DONE){
+            S.over = 1; pthread_cond_signal(&S.done_cv); return;
+        }
+        double next = INFINITY;
+        if (S.hn) next = S.heap[0]->at;
+        for (int ep=0; ep<2; ++ep)
+            if (S.state[ep] == ST_BLOCKED && S.deadline[ep] < next) next = S.deadline[ep];
+        if (next == INFINITY){
+            S.over = S.deadlock = 1; pthread_cond_signal(&S.done_cv); return;
+        }
+        S.T = next;
+    }
+}
+
+// ---- the calls sim.h redirects ----
+int sim_clock_gettime(clockid_t clk, struct timespec* ts){
+    if (clk != CLOCK_MONOTONIC || sim_ep < 0) return clock_gettime(clk, ts);
+    pthread_mutex_lock(&S.mu);
+    double t = S.T;
+    pthread_mutex_unlock(&S.mu);
+    ts->tv_sec = (time_t)t;
+    ts->tv_nsec = (long)((t - (double)ts->tv_sec) * 1e9);
+    return 0;
+}
+
+int sim_socket(int domain, int type, int proto){
+    (void)domain; (void)type; (void)proto;
+    pthread_mutex_lock(&S.mu);
+    for (int k=0; k<SIM_MAX_SOCK; ++k){
+        if (S.sock[k].used) continue;
+        memset(&S.sock[k], 0, sizeof(S.sock[k]));
+        S.sock[k].used = 1;
+        S.sock[k].ep = sim_ep < 0 ? 0 : sim_ep;
+        S.sock[k].ip = ep_ip[S.sock[k].ep];
+        S.sock[k].port = (uint16_t)(40000 + k);
+        pthread_mutex_unlock(&S.mu);
+        return SIM_FD_BASE + k;
+    }
+    pthread_mutex_unlock(&S.mu);
+    errno = EMFILE;
+    return -1;
+}
+
+int sim_setsockopt(int fd, int level, int name, const void* val, socklen_t len){
+    vsock_t* s = vsock_of(fd);
+    if (!s) return -1;
+    if (level == SOL_SOCKET && name == SO_RCVTIMEO && len >= sizeof(struct timeval)){
+        const struct timeval* tv = val;
+        s->rcvtimeo = tv->tv_sec + tv->tv_usec/1e6;
+    }
+    return 0;                     // everything else is accepted and ignored
+}
+
+int sim_bind(int fd, const struct sockaddr* a, socklen_t len){
+    vsock_t* s = vsock_of(fd);
+    if (!s) return -1;
+    if (len >= sizeof(struct sockaddr_in)) s->port = ntohs(((const struct sockaddr_in*)a)->sin_port);
+    return 0;
+}
+
+int sim_connect(int fd, const struct sockaddr* a, socklen_t len){
+    vsock_t* s = vsock_of(fd);
+    if (!s) return -1;
+    if (len < sizeof(struct sockaddr_in)){ errno = EINVAL; return -1; }
+    const struct sockaddr_in* in = (const struct sockaddr_in*)a;
+    s->peer_ip = ntohl(in->sin_addr.s_addr);
+    s->peer_port = ntohs(in->sin_port);
+    return 0;
+}
+
+static ssize_t sim_xmit(int fd, const struct iovec* iov, size_t iovlen, const struct sockaddr* to){
+    size_t len = 0;
+    for (size_t k=0; k<iovlen; ++k) len += iov[k].iov_len;
+    pthread_mutex_lock(&S.mu);
+    vsock_t* s = vsock_of(fd);
+    if (!s){ pthread_mutex_unlock(&S.mu); return -1; }
+    if (len + SIM_HDR > (size_t)S.mtu){ pthread_mutex_unlock(&S.mu); errno = EMSGSIZE; return -1; }
+    uint32_t dip = s->peer_ip; uint16_t dport = s->peer_port;
+    if (to){
+        const struct sockaddr_in* in = (const struct sockaddr_in*)to;
+        dip = ntohl(in->sin_addr.s_addr); dport = ntohs(in->sin_port);
+    }
+    if (!dport){ pthread_mutex_unlock(&S.mu); errno = EDESTADDRREQ; return -1; }
+
+    link_t* l = &S.link[s->ep];
+    double depart = S.T;
+    if (l->rate_bps > 0){
+        if (l->busy < S.T) l->busy = S.T;
+        if ((l->busy - S.T) * l->rate_bps / 8.0 + len > l->qbytes){
+            l->qdrop++; pthread_mutex_unlock(&S.mu); return (ssize_t)len;
+        }
+        l->busy += (double)(len + SIM_HDR) * 8.0 / l->rate_bps;
+        depart = l->busy;
+    }
+    if (l->loss > 0 && sim_rand() < l->loss){ l->lost++; pthread_mutex_unlock(&S.mu); return (ssize_t)len; }
+    l->pkts++; l->bytes += len;
+
+    spkt_t* p = malloc(sizeof(*p) + len);
+    if (!p){ pthread_mutex_unlock(&S.mu); errno = ENOBUFS; return -1; }
+    p->at = depart + l->delay; p->id = S.ids++; p->len = len;
+    p->src_ip = s->ip; p->src_port = s->port; p->dst_ip = dip; p->dst_port = dport;
+    for (size_t k=0, at=0; k<iovlen; at += iov[k].iov_len, ++k) memcpy(p->data + at, iov[k].iov_base, iov[k].iov_len);
+    heap_push(p);
+    pthread_mutex_unlock(&S.mu);
+    return (ssize_t)len;
+}
+
+ssize_t sim_send(int fd, const void* b, size_t n, int flags){
+    (void)flags;
+    struct iovec v = { (void*)b, n };
+    return sim_xmit(fd, &v, 1, NULL);
+}
+
+ssize_t sim_sendto(int fd, const void* b, size_t n, int flags, const struct sockaddr* to, socklen_t tolen){
+    (void)flags;
+    struct iovec v = { (void*)b, n };
+    return sim_xmit(fd, &v, 1, tolen >= sizeof(struct sockaddr_in) ? to : NULL);
+}
+
+ssize_t sim_sendmsg(int fd, const struct msghdr* m, int flags){
+    (void)flags;
+    return sim_xmit(fd, m->msg_iov, m->msg_iovlen,
+                    m->msg_namelen >= sizeof(struct sockaddr_in) ? m->msg_name : NULL);
+}
+
+ssize_t sim_recvfrom(int fd, void* b, size_t n, int flags, struct sockaddr* from, socklen_t* fromlen){
+    (void)flags;
+    pthread_mutex_lock(&S.mu);
+    vsock_t* s = vsock_of(fd);
+    if (!s){ pthread_mutex_unlock(&S.mu); return -1; }
+    int ep = sim_ep;
+    deliver_due();
+    if (!s->head){
+        S.state[ep] = ST_BLOCKED;
+        S.wait_fd[ep] = fd;
+        S.deadline[ep] = s->rcvtimeo > 0 ? S.T + s->rcvtimeo : INFINITY;
+        sim_schedule();
+        while (S.state[ep] != ST_RUN) pthread_cond_wait(&S.cv[ep], &S.mu);
+    }
+    spkt_t* p = s->head;
+    if (!p){ pthread_mutex_unlock(&S.mu); errno = EAGAIN; return -1; }
+    s->head = p->next;
+    if (!s->head) s->tail = NULL;
+    pthread_mutex_unlock(&S.mu);
+
+    size_t got = p->len < n ? p->len : n;
+    memcpy(b, p->data, got);
+    if (from && fromlen){
+        struct sockaddr_in in = { .sin_family = AF_INET, .sin_port = htons(p->src_port) };
+        in.sin_addr.s_addr = htonl(p->src_ip);
+        socklen_t c = *fromlen < sizeof(in) ? *fromlen : (socklen_t)sizeof(in);
+        memcpy(from, &in, c);
+        *fromlen = sizeof(in);
+    }
+    free(p);
+    return (ssize_t)got;
+}
+
+ssize_t sim_recv(int fd, void* b, size_t n, int flags){
+    return sim_recvfrom(fd, b, n, flags, NULL, NULL);
+}
+
+// ---- endpoints ----
+typedef struct { int ep, argc; char** argv; } ep_arg_t;
+
+static void* ep_thread(void* arg){
+    ep_arg_t* a = arg;
+    sim_ep = a->ep;
+    pthread_mutex_lock(&S.mu);
+    while (S.state[a->ep] != ST_RUN) pthread_cond_wait(&S.cv[a->ep], &S.mu);
+    pthread_mutex_unlock(&S.mu);
+    int rc = a->ep == EP_SND ? cftp_sender_main(a->argc, a->argv) : cftp_receiver_main(a->argc, a->argv);
+    fflush(NULL);
+    pthread_mutex_lock(&S.mu);
+    S.rc[a->ep] = rc;
+    S.state[a->ep] = ST_DONE;
+    sim_schedule();
+    pthread_mutex_unlock(&S.mu);
+    return NULL;
+}
+
+static void usage(const char* p){
+    fprintf(stderr, "Usage: %s [--rate MBPS] [--rtt MS] [--loss PCT] [--ack_loss PCT] [--queue_kb KB]"
+                    " [--link_mtu M] [--seed N] -- <input> [sender options] -- <output> [receiver options]\n", p);
+    exit(2);
+}
+
+int main(int argc, char** argv){
+    double rate = 100, rtt = 200, loss = 0, ack_loss = 0, queue_kb = 1024;
+    int i = 1;
+    for (; i < argc && strcmp(argv[i], "--"); ++i){
+        if (i + 1 >= argc) usage(argv[0]);
+        if (!strcmp(argv[i], "--rate")) rate = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--rtt")) rtt = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--loss")) loss = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--ack_loss")) ack_loss = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--queue_kb")) queue_kb = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--link_mtu")) S.mtu = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed")) S.rng = strtoull(argv[++i], NULL, 0);
+        else usage(argv[0]);
+    }
+    // split the rest at the second "--" into the two command lines
+    int s0 = i + 1, r0 = s0;
+    while (r0 < argc && strcmp(argv[r0], "--")) r0++;
+    if (s0 >= argc || r0 + 1 >= argc) usage(argv[0]);
+
+    char* sargv[argc + 2]; int sargc = 0;
+    char* rargv[argc + 2]; int rargc = 0;
+    sargv[sargc++] = "udp_sender"; sargv[sargc++] = "10.0.0.2";
+    for (int k = s0; k < r0; ++k) sargv[sargc++] = argv[k];
+    sargv[sargc] = NULL;
+    rargv[rargc++] = "udp_receiver";
+    for (int k = r0 + 1; k < argc; ++k) rargv[rargc++] = argv[k];
+    rargv[rargc] = NULL;
+
+    for (int d=0; d<2; ++d){
+        S.link[d].rate_bps = rate * 1e6;
+        S.link[d].delay = rtt / 2000.0;
+        S.link[d].qbytes = queue_kb * 1024.0;
+    }
+    S.link[EP_SND].loss = loss / 100.0;
+    S.link[EP_RCV].loss = ack_loss / 100.0;
+
+    // the receiver runs first so it is listening when the sender starts
+    ep_arg_t ea[2] = { { EP_SND, sargc, sargv }, { EP_RCV, rargc, rargv } };
+    pthread_t th[2];
+    double w0 = wall_now();
+    pthread_mutex_lock(&S.mu);
+    S.state[EP_RCV] = ST_RUN;
+    S.state[EP_SND] = ST_NEW;
+    for (int ep=0; ep<2; ++ep)
+        if (pthread_create(&th[ep], NULL, ep_thread, &ea[ep])){ perror("pthread_create"); exit(1); }
+    while (!S.over) pthread_cond_wait(&S.done_cv, &S.mu);
+    double vt = S.T;
+    pthread_mutex_unlock(&S.mu);
+    fflush(NULL);
+
+    if (S.deadlock) fprintf(stderr, "Sim: deadlock at %.3f s: %s\n", vt,
+                            S.state[EP_SND] == ST_DONE ? "receiver still waiting" : "sender still waiting");
+    for (int d=0; d<2; ++d){
+        link_t* l = &S.link[d];
+        printf("Sim: %s link: %lu pkts, %.1f MB, %lu lost, %lu queue drops\n", d == EP_SND ? "data" : "ack ",
+               (unsigned long)l->pkts, l->bytes / 1e6, (unsigned long)l->lost, (unsigned long)l->qdrop);
+    }
+    printf("Sim: %.3f s virtual in %.3f s wall\n", vt, wall_now() - w0);
+    fflush(stdout);
+    // a deadlocked endpoint is still parked in recv; don't wait for it
+    _exit(S.deadlock ? 3 : (S.rc[EP_SND] || S.rc[EP_RCV]) ? 1 : 0);
+}
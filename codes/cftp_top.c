@@ -0,0 +1,120 @@
+// cftp_top.c
+// Live view of running transfers started with --shm 1: maps their stats pages
+// (/dev/shm/cftp-*, see shmstats.h) read-only and prints one line per
+// transfer every interval. Reading a page costs no syscall, only a
+// sequence-locked copy, so the interval can be as short as wanted.
+// Build: gcc -O2 -std=gnu11 -Wall -Wextra -o cftp-top cftp_top.c
+// Usage: ./cftp-top [--interval MS] [--once] [pid ...]
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CFTP_SHM_READER
+#include "shmstats.h"
+
+#define MAX_PAGES 256
+
+typedef struct {
+    char name[256];
+    const shm_page_t* p;
+    uint64_t prev[SHM_NFIELDS];
+    int have_prev, seen;
+} view_t;
+
+static view_t views[MAX_PAGES];
+static int nviews;
+
+static int wanted(uint32_t pid, int npid, char** pids){
+    if (!npid) return 1;
+    for (int i=0; i<npid; ++i) if ((uint32_t)atoi(pids[i]) == pid) return 1;
+    return 0;
+}
+
+// Maps pages that appeared since the last scan and drops those removed.
+static void rescan(void){
+    for (int i=0; i<nviews; ++i) views[i].seen = 0;
+    DIR* d = opendir(SHM_DIR);
+    if (!d){ perror(SHM_DIR); exit(1); }
+    struct dirent* de;
+    while ((de = readdir(d))){
+        if (strncmp(de->d_name, SHM_PREFIX, strlen(SHM_PREFIX))) continue;
+        int i = 0;
+        while (i < nviews && strcmp(views[i].name, de->d_name)) i++;
+        if (i < nviews){ views[i].seen = 1; continue; }
+        if (nviews == MAX_PAGES) continue;
+        char path[512];
+        snprintf(path, sizeof(path), SHM_DIR "/%s", de->d_name);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) continue;
+        void* p = mmap(NULL, sizeof(shm_page_t), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) continue;
+        view_t* v = &views[nviews++];
+        memset(v, 0, sizeof(*v));
+        snprintf(v->name, sizeof(v->name), "%s", de->d_name);
+        v->p = p; v->seen = 1;
+    }
+    closedir(d);
+    for (int i=0; i<nviews; ){
+        if (views[i].seen){ ++i; continue; }
+        munmap((void*)views[i].p, sizeof(shm_page_t));
+        views[i] = views[--nviews];
+    }
+}
+
+static void show(int npid, char** pids, int clear){
+    if (clear) printf("\033[H\033[J");
+    printf("%-7s %-4s %6s %10s %10s %10s %10s %8s %6s %6s %8s %7s  %s\n",
+           "PID", "ROLE", "DONE%", "MB", "Mb/s", "PKTS_TX", "PKTS_RX", "RETX", "INFLT", "CWND", "SRTT_ms", "QDROP", "STATE");
+    for (int i=0; i<nviews; ++i){
+        view_t* vw = &views[i];
+        const shm_page_t* p = vw->p;
+        uint64_t v[SHM_NFIELDS];
+        if (!wanted(p->pid, npid, pids) || shm_snapshot(p, v) != 0) continue;
+        double rate = 0;
+        if (vw->have_prev && v[SHM_TIME_NS] > vw->prev[SHM_TIME_NS])
+            rate = (double)(v[SHM_BYTES_ACKED] - vw->prev[SHM_BYTES_ACKED]) * 8.0 * 1e3 /
+                   (double)(v[SHM_TIME_NS] - vw->prev[SHM_TIME_NS]);
+        else if (v[SHM_TIME_NS] > p->start_ns)
+            rate = (double)v[SHM_BYTES_ACKED] * 8.0 * 1e3 / (double)(v[SHM_TIME_NS] - p->start_ns);
+        memcpy(vw->prev, v, sizeof(v));
+        vw->have_prev = 1;
+        const char* state = v[SHM_DONE] ? "done" : (kill((pid_t)p->pid, 0) != 0 && errno == ESRCH) ? "gone" : "running";
+        char pct[16] = "-";
+        if (v[SHM_BYTES_TOTAL]) snprintf(pct, sizeof(pct), "%.1f", 100.0 * (double)v[SHM_BYTES_ACKED] / (double)v[SHM_BYTES_TOTAL]);
+        printf("%-7u %-4s %6s %10.1f %10.2f %10lu %10lu %8lu %6lu %6lu %8.2f %7lu  %s\n",
+               p->pid, p->role == SHM_SENDER ? "snd" : "rcv", pct, (double)v[SHM_BYTES_ACKED] / 1e6, rate,
+               (unsigned long)v[SHM_PKTS_SENT], (unsigned long)v[SHM_PKTS_RECV], (unsigned long)v[SHM_RETX],
+               (unsigned long)v[SHM_IN_FLIGHT], (unsigned long)v[SHM_CWND], (double)v[SHM_SRTT_US] / 1e3,
+               (unsigned long)v[SHM_QDROPS], state);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv){
+    int interval_ms = 1000, once = 0, npid = 0;
+    char* pids[64];
+    for (int i=1; i<argc; ++i){
+        if (!strcmp(argv[i], "--interval") && i+1<argc) interval_ms = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--once")) once = 1;
+        else if (npid < 64) pids[npid++] = argv[i];
+    }
+    if (interval_ms < 1) interval_ms = 1;
+    for (;;){
+        rescan();
+        show(npid, pids, !once);
+        if (once) return 0;
+        struct timespec ts = { interval_ms / 1000, (long)(interval_ms % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+}
@@ -0,0 +1,129 @@
+// cftp_trace2qlog.c
+// Converts a --trace dump (see trace.h) into qlog JSON (draft 0.3 event
+// names), so qvis and similar tools can plot sequence-vs-time and window
+// graphs. TSC stamps are mapped to milliseconds since the trace started
+// using the two TSC/CLOCK_MONOTONIC pairs in the dump header.
+// Build: gcc -O2 -std=gnu11 -Wall -Wextra -o cftp_trace2qlog cftp_trace2qlog.c
+// Usage: ./cftp_trace2qlog <trace_file> [out.qlog]   (default: stdout)
+// Notes: sequence numbers are DATA segment numbers. In-flight counts and
+//        congestion_window (the sender's fixed --win) are in segments, not
+//        bytes.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CFTP_TRACE_READER
+#include "trace.h"
+
+static const char* state_name(uint64_t s){
+    switch (s){
+        case TS_HANDSHAKE: return "handshake";
+        case TS_DATA:      return "data";
+        case TS_END:       return "closing";
+        case TS_REPAIR:    return "repair";
+        case TS_DONE:      return "closed";
+    }
+    return "unknown";
+}
+
+// [[1,cum],[..]...] from cum_ack and the SACK mask after it
+static void ack_ranges(FILE* o, uint32_t cum, uint64_t mask){
+    int first = 1;
+    fprintf(o, "[");
+    if (cum){ fprintf(o, "[1,%u]", cum); first = 0; }
+    for (int i=0; i<64; ){
+        if (!(mask >> i & 1)){ ++i; continue; }
+        int j = i;
+        while (j + 1 < 64 && (mask >> (j + 1) & 1)) ++j;
+        fprintf(o, "%s[%lu,%lu]", first ? "" : ",", (unsigned long)cum + 1 + i, (unsigned long)cum + 1 + j);
+        first = 0;
+        i = j + 1;
+    }
+    fprintf(o, "]");
+}
+
+int main(int argc, char** argv){
+    if (argc < 2){ fprintf(stderr, "Usage: %s <trace_file> [out.qlog]\n", argv[0]); return 2; }
+    FILE* in = fopen(argv[1], "rb");
+    if (!in){ perror(argv[1]); return 1; }
+    FILE* o = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if (!o){ perror(argv[2]); return 1; }
+
+    trace_file_t h;
+    if (fread(&h, sizeof(h), 1, in) != 1 || h.magic != TRACE_MAGIC || h.ev_size != sizeof(trace_ev_t)){
+        fprintf(stderr, "%s: not a cftp trace\n", argv[1]);
+        return 1;
+    }
+    double ns_per_tick = h.tsc1 > h.tsc0 ? (double)(h.ns1 - h.ns0) / (double)(h.tsc1 - h.tsc0) : 1.0;
+    int snd = h.role == 0;
+
+    fprintf(o, "{\"qlog_version\": \"0.3\", \"qlog_format\": \"JSON\", \"title\": \"cftp %s trace\",\n",
+            snd ? "sender" : "receiver");
+    fprintf(o, " \"traces\": [{\"vantage_point\": {\"type\": \"%s\", \"name\": \"cftp %s\"},\n",
+            snd ? "client" : "server", snd ? "sender" : "receiver");
+    fprintf(o, "  \"common_fields\": {\"time_format\": \"relative\", \"reference_time\": %.3f},\n", h.ns0 / 1e6);
+    fprintf(o, "  \"summary\": {\"events\": %lu, \"overwritten\": %lu},\n",
+            (unsigned long)h.count, (unsigned long)h.overwritten);
+    fprintf(o, "  \"events\": [\n");
+    int first = 1;
+#define EV(t, name) fprintf(o, "%s   {\"time\": %.3f, \"name\": \"%s\", \"data\": ", first ? "" : ",\n", (t), (name)), first = 0
+    if (snd && h.win){
+        EV(0.0, "recovery:metrics_updated");
+        fprintf(o, "{\"congestion_window\": %u}}", h.win);
+    }
+    trace_ev_t e;
+    for (uint64_t k=0; k<h.count && fread(&e, sizeof(e), 1, in) == 1; ++k){
+        double t = (double)(int64_t)(e.tsc - h.tsc0) * ns_per_tick / 1e6;
+        switch (e.type){
+        case TR_SEND:
+            EV(t, "transport:packet_sent");
+            fprintf(o, "{\"header\": {\"packet_type\": \"1RTT\", \"packet_number\": %u}}}", e.seq);
+            EV(t, "recovery:metrics_updated");
+            fprintf(o, "{\"packets_in_flight\": %lu}}", (unsigned long)e.a);
+            break;
+        case TR_RETX:
+            EV(t, "transport:packet_sent");
+            fprintf(o, "{\"header\": {\"packet_type\": \"1RTT\", \"packet_number\": %u}, \"trigger\": \"retransmit_timeout\","
+                       " \"transmission\": %lu}}", e.seq, (unsigned long)e.a);
+            break;
+        case TR_RTO:
+            EV(t, "recovery:loss_timer_updated");
+            fprintf(o, "{\"event_type\": \"expired\", \"timer_type\": \"pto\"}}");
+            EV(t, "recovery:packet_lost");
+            fprintf(o, "{\"header\": {\"packet_type\": \"1RTT\", \"packet_number\": %u}, \"trigger\": \"pto_expired\","
+                       " \"age_ms\": %.3f}}", e.seq, e.a / 1e3);
+            break;
+        case TR_ACK:
+            EV(t, "transport:packet_received");
+            fprintf(o, "{\"header\": {\"packet_type\": \"1RTT\"}, \"frames\": [{\"frame_type\": \"ack\", \"acked_ranges\": ");
+            ack_ranges(o, e.seq, e.a);
+            fprintf(o, "}]}}");
+            EV(t, "recovery:metrics_updated");
+            fprintf(o, "{\"packets_in_flight\": %lu}}", (unsigned long)e.b);
+            break;
+        case TR_ACK_TX:
+            EV(t, "transport:packet_sent");
+            fprintf(o, "{\"header\": {\"packet_type\": \"1RTT\"}, \"frames\": [{\"frame_type\": \"ack\", \"acked_ranges\": ");
+            ack_ranges(o, e.seq, e.a);
+            fprintf(o, "}]}}");
+            break;
+        case TR_DATA_RX:
+            EV(t, "transport:packet_received");
+            fprintf(o, "{\"header\": {\"packet_type\": \"1RTT\", \"packet_number\": %u}, \"raw\": {\"payload_length\": %lu}%s}}",
+                    e.seq, (unsigned long)e.a, e.b ? ", \"duplicate\": true" : "");
+            break;
+        case TR_STATE:
+            EV(t, "connectivity:connection_state_updated");
+            fprintf(o, "{\"new\": \"%s\"}}", state_name(e.a));
+            break;
+        }
+    }
+#undef EV
+    fprintf(o, "\n  ]}]}\n");
+    if (o != stdout) fclose(o);
+    fclose(in);
+    return 0;
+}
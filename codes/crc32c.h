@@ -0,0 +1,83 @@
+// crc32c.h
+// CRC32C (Castagnoli) for per-segment integrity. Uses the SSE4.2 crc32
+// instruction when the CPU has it (checked once at runtime), otherwise a
+// slicing-by-8 table. Both produce the standard CRC32C (init/xorout ~0).
+
+#ifndef CFTP_CRC32C_H
+#define CFTP_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+static uint32_t crc32c_tab[8][256];
+
+static void crc32c_init_tables(void){
+    for (uint32_t i=0; i<256; ++i){
+        uint32_t c = i;
+        for (int k=0; k<8; ++k) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+        crc32c_tab[0][i] = c;
+    }
+    for (uint32_t i=0; i<256; ++i)
+        for (int t=1; t<8; ++t)
+            crc32c_tab[t][i] = (crc32c_tab[t-1][i] >> 8) ^ crc32c_tab[0][crc32c_tab[t-1][i] & 0xff];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t n){
+    crc = ~crc;
+    while (n >= 8){
+        uint64_t v; memcpy(&v, p, 8);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        v ^= crc;
+        crc = crc32c_tab[7][ v        & 0xff] ^ crc32c_tab[6][(v >>  8) & 0xff] ^
+              crc32c_tab[5][(v >> 16) & 0xff] ^ crc32c_tab[4][(v >> 24) & 0xff] ^
+              crc32c_tab[3][(v >> 32) & 0xff] ^ crc32c_tab[2][(v >> 40) & 0xff] ^
+              crc32c_tab[1][(v >> 48) & 0xff] ^ crc32c_tab[0][ v >> 56        ];
+        p += 8; n -= 8;
+    }
+    while (n--) crc = (crc >> 8) ^ crc32c_tab[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t n){
+    crc = ~crc;
+#ifdef __x86_64__
+    uint64_t c64 = crc;
+    while (n >= 8){
+        uint64_t v; memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8; n -= 8;
+    }
+    crc = (uint32_t)c64;
+#endif
+    while (n--) crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t, const uint8_t*, size_t) = NULL;
+
+// Call once before crc32c(); picks the fastest implementation.
+static void crc32c_init(void){
+    crc32c_init_tables();
+    crc32c_fn = crc32c_sw;
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc32c_fn = crc32c_hw;
+#endif
+}
+
+static inline uint32_t crc32c(const void* p, size_t n){
+    return crc32c_fn(0, (const uint8_t*)p, n);
+}
+
+#endif // CFTP_CRC32C_H
@@ -0,0 +1,166 @@
+// dedup.h
+// Content-defined chunking and chunk fingerprints for FEAT_DEDUP.
+// Chunks are cut FastCDC-style: the gear hash of the 64 bytes ending at i,
+//   W(i) = sum_k G[p[i-k]] << k   (k = 0..63)
+// marks a cut after byte i when its top bits are zero, with a stricter mask
+// before DEDUP_AVG and a looser one after (normalized chunking). Because W
+// depends on a fixed window only, candidates can be found for many positions
+// at once: four AVX2 lanes each walk a quarter of the region, and the cuts
+// are then picked from the candidate bitmaps. Fingerprints are BLAKE3-256.
+
+#ifndef CFTP_DEDUP_H
+#define CFTP_DEDUP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blake3.h"
+#include "cftp_proto.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEDUP_HAVE_AVX2 1
+#endif
+
+#define DEDUP_MIN (16u * 1024u)
+#define DEDUP_AVG (64u * 1024u)
+#define DEDUP_MAX (256u * 1024u)
+#define DEDUP_MASK_S (((1ULL << 18) - 1) << 46)   // before DEDUP_AVG: 1 in 2^18
+#define DEDUP_MASK_L (((1ULL << 14) - 1) << 50)   // after: 1 in 2^14
+#define DEDUP_REGION (4u << 20)                   // bytes scanned per candidate pass
+
+static uint64_t dedup_gear[256];
+
+// Sets bit i-lo of s (mask S) and l (mask L) for every candidate i in [lo, hi).
+static inline void dedup_scan_sw(const uint8_t* p, uint64_t lo, uint64_t hi, uint64_t* s, uint64_t* l){
+    uint64_t h = 0;
+    for (uint64_t i = lo >= 63 ? lo - 63 : 0; i < hi; ++i){
+        h = (h << 1) + dedup_gear[p[i]];
+        if (i < lo || (h & DEDUP_MASK_L)) continue;
+        l[(i - lo) >> 6] |= 1ULL << ((i - lo) & 63);
+        if (!(h & DEDUP_MASK_S)) s[(i - lo) >> 6] |= 1ULL << ((i - lo) & 63);
+    }
+}
+
+#ifdef DEDUP_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline void dedup_scan_avx2(const uint8_t* p, uint64_t lo, uint64_t hi, uint64_t* s, uint64_t* l){
+    uint64_t q = (hi - lo) / 4;
+    if (q < 64 || lo < 63){ dedup_scan_sw(p, lo, hi, s, l); return; }
+    const __m256i ml = _mm256_set1_epi64x((long long)DEDUP_MASK_L), zero = _mm256_setzero_si256();
+    __m256i h = zero;
+    // lane j covers [lo + j*q, lo + (j+1)*q) after 63 bytes of warm-up
+    for (uint64_t t = 0; t < q + 63; ++t){
+        uint64_t i = lo - 63 + t;
+        __m256i idx = _mm256_set_epi64x(p[i + 3*q], p[i + 2*q], p[i + q], p[i]);
+        __m256i g = _mm256_i64gather_epi64((const long long*)dedup_gear, idx, 8);
+        h = _mm256_add_epi64(_mm256_slli_epi64(h, 1), g);
+        if (t < 63) continue;
+        __m256i c = _mm256_cmpeq_epi64(_mm256_and_si256(h, ml), zero);
+        int m = _mm256_movemask_pd(_mm256_castsi256_pd(c));
+        if (!m) continue;
+        uint64_t hv[4];
+        _mm256_storeu_si256((__m256i*)hv, h);
+        for (int j=0; j<4; ++j){
+            if (!((m >> j) & 1)) continue;
+            uint64_t b = i + (uint64_t)j * q - lo;
+            l[b >> 6] |= 1ULL << (b & 63);
+            if (!(hv[j] & DEDUP_MASK_S)) s[b >> 6] |= 1ULL << (b & 63);
+        }
+    }
+    dedup_scan_sw(p, lo + 4*q, hi, s, l);
+}
+#endif
+
+static void (*dedup_scan)(const uint8_t*, uint64_t, uint64_t, uint64_t*, uint64_t*) = dedup_scan_sw;
+
+static inline void dedup_init(void){
+    uint64_t x = 0;
+    for (int i=0; i<256; ++i){          // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        dedup_gear[i] = z ^ (z >> 31);
+    }
+#ifdef DEDUP_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) dedup_scan = dedup_scan_avx2;
+#endif
+}
+
+// First set bit of the region bitmap in [a, b) (region-relative), or b.
+static inline uint64_t dedup_next(const uint64_t* bm, uint64_t a, uint64_t b){
+    while (a < b){
+        uint64_t w = bm[a >> 6] >> (a & 63);
+        if (w){ a += (uint64_t)__builtin_ctzll(w); return a < b ? a : b; }
+        a = (a | 63) + 1;
+    }
+    return b;
+}
+
+typedef struct {
+    uint64_t off;
+    uint32_t len;
+    uint8_t fp[BLAKE3_OUT_LEN];
+} dedup_chunk_t;
+
+// Cuts p[0, n) into chunks and fingerprints them. Returns the count (*out is
+// malloc'd), or 0 on allocation failure.
+static inline uint32_t dedup_chunk(const uint8_t* p, uint64_t n, dedup_chunk_t** out){
+    size_t words = DEDUP_REGION / 64 + 1, cap = n / DEDUP_AVG + 16;
+    uint64_t *s = malloc(words * sizeof(uint64_t)), *l = malloc(words * sizeof(uint64_t));
+    dedup_chunk_t* c = malloc(cap * sizeof(dedup_chunk_t));
+    uint32_t nc = 0;
+    uint64_t r0 = 0, r1 = 0;                // region with valid bitmaps
+    if (!s || !l || !c){ free(s); free(l); free(c); return 0; }
+    for (uint64_t at = 0; at < n; ){
+        uint64_t len = n - at;
+        if (len > DEDUP_MIN){
+            uint64_t end = at + (len < DEDUP_MAX ? len : DEDUP_MAX);
+            if (end > r1){
+                r0 = at; r1 = at + DEDUP_REGION < n ? at + DEDUP_REGION : n;
+                memset(s, 0, words * sizeof(uint64_t)); memset(l, 0, words * sizeof(uint64_t));
+                dedup_scan(p, r0, r1, s, l);
+            }
+            // cut after byte i: len = i - at + 1
+            uint64_t a = at + DEDUP_MIN - 1, m = at + DEDUP_AVG - 1 < end ? at + DEDUP_AVG - 1 : end;
+            uint64_t i = dedup_next(s, a - r0, m - r0) + r0;
+            if (i == m) i = dedup_next(l, m - r0, end - r0) + r0;
+            len = i < end ? i - at + 1 : end - at;
+        }
+        if (nc == cap){
+            dedup_chunk_t* g = realloc(c, (cap *= 2) * sizeof(dedup_chunk_t));
+            if (!g){ free(s); free(l); free(c); return 0; }
+            c = g;
+        }
+        blake3_hasher h;
+        blake3_init(&h); blake3_update(&h, p + at, (size_t)len); blake3_final(&h, c[nc].fp);
+        c[nc].off = at; c[nc].len = (uint32_t)len;
+        nc++; at += len;
+    }
+    free(s); free(l);
+    *out = c;
+    return nc;
+}
+
+// Seqs whose bytes (whole FEAT_COMPRESS chunks if spc) lie inside [a, e):
+// [*s0, *s1], empty when *s0 > *s1. Both sides use it to agree on what a run
+// of chunks filled from the store covers.
+static inline void dedup_cover(const seg_layout_t* L, uint32_t spc, uint64_t a, uint64_t e,
+                               uint32_t* s0, uint32_t* s1){
+    *s0 = 1; *s1 = 0;
+    if (e <= a) return;
+    uint32_t s = layout_seq_at(L, a), t = layout_seq_at(L, e - 1), len;
+    if (layout_seg(L, s, &len) < a) s++;
+    if (layout_seg(L, t, &len) + len > e) t--;
+    if (spc && s <= t){
+        uint32_t c = (s - 1) / spc;
+        if (s != c * spc + 1) s = (c + 1) * spc + 1;
+        c = (t - 1) / spc;
+        if (t && t != cz_last_seq(L, c)) t = c * spc;
+    }
+    *s0 = s; *s1 = t;
+}
+
+#endif // CFTP_DEDUP_H
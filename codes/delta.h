@@ -0,0 +1,59 @@
+// delta.h
+// Block signatures for FEAT_DELTA (rsync-style). The receiver describes its
+// old copy (the basis) as fixed blocks, each with a weak rolling checksum and
+// a strong 64-bit BLAKE3 prefix; the sender rolls the weak sum over its file
+// one byte at a time and confirms hits with the strong hash.
+
+#ifndef CFTP_DELTA_H
+#define CFTP_DELTA_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "blake3.h"
+
+#define DELTA_BLOCK_MIN  8192u        // smallest basis block
+#define DELTA_MAX_BLOCKS (1u << 20)   // larger bases get larger blocks
+
+// Block size for a basis of n bytes: a power of two >= DELTA_BLOCK_MIN that
+// keeps the table at <= DELTA_MAX_BLOCKS entries.
+static inline uint32_t delta_block_len(uint64_t n){
+    uint32_t b = DELTA_BLOCK_MIN;
+    while (n / b > DELTA_MAX_BLOCKS && b < (1u << 30)) b <<= 1;
+    return b;
+}
+
+// Weak sum of a window: a = sum of bytes, b = sum of a over each prefix,
+// i.e. sum (n - i) * x[i]. Both are kept mod 2^32 and folded at the end.
+typedef struct { uint32_t a, b, n; } delta_roll_t;
+
+static inline void delta_roll_init(delta_roll_t* r, const uint8_t* p, uint32_t n){
+    uint32_t a = 0, b = 0;
+    for (uint32_t i=0; i<n; ++i){ a += p[i]; b += a; }
+    r->a = a; r->b = b; r->n = n;
+}
+
+// Slides the window one byte: drops out, appends in.
+static inline void delta_roll(delta_roll_t* r, uint8_t out, uint8_t in){
+    r->a += (uint32_t)in - out;
+    r->b += r->a - r->n * (uint32_t)out;
+}
+
+static inline uint32_t delta_roll_sum(const delta_roll_t* r){
+    return (r->a & 0xffff) | (r->b << 16);
+}
+
+static inline uint32_t delta_weak(const uint8_t* p, uint32_t n){
+    delta_roll_t r; delta_roll_init(&r, p, n);
+    return delta_roll_sum(&r);
+}
+
+static inline uint64_t delta_strong(const uint8_t* p, uint32_t n){
+    blake3_hasher h; uint8_t d[BLAKE3_OUT_LEN];
+    uint64_t v;
+    blake3_init(&h); blake3_update(&h, p, n); blake3_final(&h, d);
+    memcpy(&v, d, sizeof(v));
+    return v;
+}
+
+#endif // CFTP_DELTA_H
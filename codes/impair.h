@@ -0,0 +1,223 @@
+// impair.h
+// Optional network impairment shim for testing, built in with -DCFTP_IMPAIR.
+// Every datagram either binary sends passes through it, so between them both
+// directions are impaired. It applies, in this order:
+//   --imp_loss PCT           independent random loss
+//   --imp_burst P,R[,H]      Gilbert-Elliott burst loss: good->bad with
+//                            probability P%, bad->good R%, loss H% while bad
+//                            (default 100)
+//   --imp_rate MBPS          serialisation at this rate (a bottleneck link)
+//   --imp_delay MS           one-way delay ...
+//   --imp_jitter MS          ... plus uniform jitter in [0, MS); packets may
+//                            overtake each other, as with netem
+//   --imp_reorder PCT[,MS]   that share of packets skips the delay; with no
+//                            delay, jitter or rate to skip they are held
+//                            back MS instead (default 1) and later packets
+//                            overtake them
+//   --imp_seed N             PRNG seed (default 1), so runs are repeatable
+// Delayed packets wait in a queue ordered by due time and are sent by a
+// background thread; at most IMP_QLIMIT are held, the rest are dropped like
+// a full router queue. At exit the queue is given a moment to drain.
+// Without CFTP_IMPAIR this header only provides a no-op impair_arg(), and
+// the --imp_* options are ignored.
+
+#ifndef CFTP_IMPAIR_H
+#define CFTP_IMPAIR_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CFTP_IMPAIR
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define IMP_QLIMIT 100000
+
+typedef struct imp_pkt {
+    struct imp_pkt *prev, *next;
+    double due;
+    int fd, flags;
+    struct sockaddr_storage to;
+    socklen_t tolen;
+    size_t len;
+    uint8_t data[];
+} imp_pkt_t;
+
+static struct {
+    double loss, ge_p, ge_r, ge_h, rate_bps, delay, jitter, reorder, hold;
+    uint64_t seed, rng;
+    int on, bad, started;
+    double link_free;            // when the emulated link is next idle
+    imp_pkt_t *head, *tail;
+    uint32_t queued;
+    uint64_t sent, dropped, reordered, overflow;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    pthread_t th;
+} imp = { .ge_h = 1.0, .hold = 0.001, .seed = 1, .mu = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER };
+
+static inline double imp_now(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Uniform in [0, 1) from splitmix64.
+static inline double imp_rand(void){
+    uint64_t z = (imp.rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return (double)((z ^ (z >> 31)) >> 11) / 9007199254740992.0;
+}
+
+// Consumes an --imp_* option at argv[*i]. Returns 1 if it was one.
+static inline int impair_arg(int argc, char** argv, int* i){
+    const char* o = argv[*i];
+    if (strncmp(o, "--imp_", 6) || *i + 1 >= argc) return 0;
+    const char* v = argv[++*i];
+    double d = atof(v);
+    if (!strcmp(o, "--imp_loss")) imp.loss = d / 100.0;
+    else if (!strcmp(o, "--imp_burst")){
+        double p = 0, r = 0, h = 100;
+        if (sscanf(v, "%lf,%lf,%lf", &p, &r, &h) < 2){ fprintf(stderr, "--imp_burst P,R[,H]\n"); exit(2); }
+        imp.ge_p = p / 100.0; imp.ge_r = r / 100.0; imp.ge_h = h / 100.0;
+    }
+    else if (!strcmp(o, "--imp_rate")) imp.rate_bps = d * 1e6;
+    else if (!strcmp(o, "--imp_delay")) imp.delay = d / 1000.0;
+    else if (!strcmp(o, "--imp_jitter")) imp.jitter = d / 1000.0;
+    else if (!strcmp(o, "--imp_reorder")){
+        double ms = 1;
+        if (sscanf(v, "%lf,%lf", &d, &ms) < 1 || ms <= 0){ fprintf(stderr, "--imp_reorder PCT[,MS]\n"); exit(2); }
+        imp.reorder = d / 100.0; imp.hold = ms / 1000.0;
+    }
+    else if (!strcmp(o, "--imp_seed")) imp.seed = strtoull(v, NULL, 0);
+    else { --*i; return 0; }
+    imp.on = 1;
+    imp.rng = imp.seed;
+    return 1;
+}
+
+// At exit: lets the queue drain (the last ACK/END is often still in it),
+// then reports.
+static void imp_report(void){
+    for (double t0 = imp_now(); imp.head && imp_now() - t0 < 2.0 + imp.delay + imp.jitter; ){
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    fprintf(stderr, "Impair: %lu sent, %lu lost, %lu reordered, %lu queue overflows\n",
+            (unsigned long)imp.sent, (unsigned long)imp.dropped,
+            (unsigned long)imp.reordered, (unsigned long)imp.overflow);
+}
+
+static void* imp_worker(void* arg){
+    (void)arg;
+    pthread_mutex_lock(&imp.mu);
+    for (;;){
+        while (!imp.head) pthread_cond_wait(&imp.cv, &imp.mu);
+        double now = imp_now();
+        if (imp.head->due > now){
+            double at = imp.head->due;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            at = ts.tv_sec + ts.tv_nsec/1e9 + (at - now);
+            ts.tv_sec = (time_t)at; ts.tv_nsec = (long)((at - (double)ts.tv_sec) * 1e9);
+            pthread_cond_timedwait(&imp.cv, &imp.mu, &ts);
+            continue;
+        }
+        imp_pkt_t* p = imp.head;
+        imp.head = p->next;
+        if (imp.head) imp.head->prev = NULL; else imp.tail = NULL;
+        imp.queued--;
+        pthread_mutex_unlock(&imp.mu);
+        sendto(p->fd, p->data, p->len, p->flags, p->tolen ? (struct sockaddr*)&p->to : NULL, p->tolen);
+        free(p);
+        pthread_mutex_lock(&imp.mu);
+    }
+    return NULL;
+}
+
+// Decides the fate of one datagram; returns 1 if the caller should send it
+// now, 0 if it was dropped or queued (the copy is taken from iov).
+static int imp_pass(int fd, const struct iovec* iov, size_t iovlen, int flags,
+                    const struct sockaddr* to, socklen_t tolen){
+    size_t len = 0;
+    for (size_t k=0; k<iovlen; ++k) len += iov[k].iov_len;
+    pthread_mutex_lock(&imp.mu);
+    if (!imp.started){
+        imp.started = 1;
+        atexit(imp_report);
+        if (imp.delay > 0 || imp.jitter > 0 || imp.rate_bps > 0 || imp.reorder > 0)
+            pthread_create(&imp.th, NULL, imp_worker, NULL);
+    }
+    // Gilbert-Elliott state step, then the loss draws
+    if (imp.ge_p > 0) imp.bad = imp.bad ? imp_rand() >= imp.ge_r : imp_rand() < imp.ge_p;
+    int lost = (imp.bad && imp_rand() < imp.ge_h) | (imp.loss > 0 && imp_rand() < imp.loss);
+    if (lost){ imp.dropped++; pthread_mutex_unlock(&imp.mu); return 0; }
+    imp.sent++;
+    int shaped = imp.delay > 0 || imp.jitter > 0 || imp.rate_bps > 0;
+    int reorder = imp.reorder > 0 && imp_rand() < imp.reorder;
+    if (!shaped && !reorder){ pthread_mutex_unlock(&imp.mu); return 1; }
+    imp.reordered += reorder;
+
+    double now = imp_now(), due = now;
+    if (imp.rate_bps > 0){
+        if (imp.link_free < now) imp.link_free = now;
+        imp.link_free += (double)(len + 28) * 8.0 / imp.rate_bps;   // + IP/UDP headers
+        due = imp.link_free;
+    }
+    if (!shaped) due += imp.hold;          // nothing to skip: held back instead
+    else if (!reorder) due += imp.delay + (imp.jitter > 0 ? imp_rand() * imp.jitter : 0.0);
+
+    if (imp.queued >= IMP_QLIMIT){ imp.overflow++; pthread_mutex_unlock(&imp.mu); return 0; }
+    imp_pkt_t* p = malloc(sizeof(*p) + len);
+    if (!p){ pthread_mutex_unlock(&imp.mu); return 0; }
+    p->due = due; p->fd = fd; p->len = len; p->tolen = 0;
+    p->flags = flags & ~MSG_ZEROCOPY;                // the copy is ours
+    if (to && tolen <= sizeof(p->to)){ memcpy(&p->to, to, tolen); p->tolen = tolen; }
+    for (size_t k=0, at=0; k<iovlen; at += iov[k].iov_len, ++k) memcpy(p->data + at, iov[k].iov_base, iov[k].iov_len);
+    // insert by due time, scanning from the tail (usually the right place)
+    imp_pkt_t* q = imp.tail;
+    while (q && q->due > due) q = q->prev;
+    p->prev = q;
+    p->next = q ? q->next : imp.head;
+    if (p->next) p->next->prev = p; else imp.tail = p;
+    if (q) q->next = p; else imp.head = p;
+    imp.queued++;
+    pthread_cond_signal(&imp.cv);
+    pthread_mutex_unlock(&imp.mu);
+    return 0;
+}
+
+static inline ssize_t imp_sendmsg(int fd, const struct msghdr* m, int flags){
+    if (imp.on && !imp_pass(fd, m->msg_iov, m->msg_iovlen, flags, m->msg_name, m->msg_namelen)){
+        size_t len = 0;
+        for (size_t k=0; k<m->msg_iovlen; ++k) len += m->msg_iov[k].iov_len;
+        return (ssize_t)len;
+    }
+    return sendmsg(fd, m, flags);
+}
+
+static inline ssize_t imp_sendto(int fd, const void* b, size_t n, int flags,
+                                 const struct sockaddr* to, socklen_t tolen){
+    struct iovec v = { (void*)b, n };
+    if (imp.on && !imp_pass(fd, &v, 1, flags, to, tolen)) return (ssize_t)n;
+    return sendto(fd, b, n, flags, to, tolen);
+}
+
+static inline ssize_t imp_send(int fd, const void* b, size_t n, int flags){
+    return imp_sendto(fd, b, n, flags, NULL, 0);
+}
+
+#define sendmsg(...) imp_sendmsg(__VA_ARGS__)
+#define sendto(...)  imp_sendto(__VA_ARGS__)
+#define send(...)    imp_send(__VA_ARGS__)
+
+#else
+
+static inline int impair_arg(int argc, char** argv, int* i){ (void)argc; (void)argv; (void)i; return 0; }
+
+#endif // CFTP_IMPAIR
+
+#endif // CFTP_IMPAIR_H
@@ -0,0 +1,124 @@
+// lz4blk.h
+// LZ4 block format (no frame) for FEAT_COMPRESS. Built with -DCFTP_USE_LZ4
+// (and -llz4) the system liblz4 is used; otherwise a small greedy compressor
+// and a bounds-checked decoder below. Both emit standard LZ4 blocks, so either
+// side can use either implementation.
+
+#ifndef CFTP_LZ4BLK_H
+#define CFTP_LZ4BLK_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef CFTP_USE_LZ4
+#include <lz4.h>
+
+static inline int lz4blk_compress(const uint8_t* src, int n, uint8_t* dst, int cap){
+    return LZ4_compress_default((const char*)src, (char*)dst, n, cap);
+}
+static inline int lz4blk_decompress(const uint8_t* src, int n, uint8_t* dst, int cap){
+    return LZ4_decompress_safe((const char*)src, (char*)dst, n, cap);
+}
+
+#else
+
+#define LZ4BLK_HASH_LOG  12
+#define LZ4BLK_MINMATCH  4
+#define LZ4BLK_LASTLIT   5     // block must end with >= 5 literals
+#define LZ4BLK_MFLIMIT   12    // last match starts >= 12 bytes before the end
+
+static inline uint32_t lz4blk_read32(const uint8_t* p){ uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint32_t lz4blk_hash(uint32_t v){ return (v * 2654435761u) >> (32 - LZ4BLK_HASH_LOG); }
+
+// Writes a length continuation (the part >= 15) as 255-runs.
+static inline uint8_t* lz4blk_putlen(uint8_t* op, size_t len){
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emits literals [anchor, anchor+lit) and, if mlen, a match at distance off.
+// Returns the new output pointer or NULL if it would not fit.
+static inline uint8_t* lz4blk_emit(uint8_t* op, uint8_t* oend, const uint8_t* anchor, size_t lit,
+                                   size_t off, size_t mlen){
+    if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1 + (mlen ? 2 + 1 + mlen / 255 : 0)) return NULL;
+    uint8_t* tok = op++;
+    *tok = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = lz4blk_putlen(op, lit - 15);
+    memcpy(op, anchor, lit); op += lit;
+    if (!mlen) return op;
+    *op++ = (uint8_t)off; *op++ = (uint8_t)(off >> 8);
+    mlen -= LZ4BLK_MINMATCH;
+    *tok |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15) op = lz4blk_putlen(op, mlen - 15);
+    return op;
+}
+
+// Returns the compressed size, or 0 if it does not fit in cap bytes.
+static inline int lz4blk_compress(const uint8_t* src, int n, uint8_t* dst, int cap){
+    uint32_t ht[1u << LZ4BLK_HASH_LOG];
+    memset(ht, 0, sizeof(ht));
+    const uint8_t *ip = src, *anchor = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    if (n > LZ4BLK_MFLIMIT){
+        const uint8_t *mflimit = iend - LZ4BLK_MFLIMIT, *mlimit = iend - LZ4BLK_LASTLIT;
+        uint32_t miss = 0;
+        ip++;
+        while (ip < mflimit){
+            uint32_t v = lz4blk_read32(ip), h = lz4blk_hash(v);
+            const uint8_t* ref = src + ht[h];
+            ht[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > 65535 || lz4blk_read32(ref) != v){
+                ip += 1 + (miss++ >> 6);   // skip faster through incompressible data
+                continue;
+            }
+            miss = 0;
+            const uint8_t *m = ip + LZ4BLK_MINMATCH, *r = ref + LZ4BLK_MINMATCH;
+            while (m + 8 <= mlimit){
+                uint64_t a, b; memcpy(&a, m, 8); memcpy(&b, r, 8);
+                if (a != b){ m += __builtin_ctzll(a ^ b) >> 3; goto counted; }
+                m += 8; r += 8;
+            }
+            while (m < mlimit && *m == *r){ m++; r++; }
+        counted:
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]){ ip--; ref--; }
+            op = lz4blk_emit(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(m - ip));
+            if (!op) return 0;
+            ip = anchor = m;
+        }
+    }
+    op = lz4blk_emit(op, oend, anchor, (size_t)(iend - anchor), 0, 0);
+    return op ? (int)(op - dst) : 0;
+}
+
+// Returns the decoded size, or -1 if the block is malformed or exceeds cap.
+static inline int lz4blk_decompress(const uint8_t* src, int n, uint8_t* dst, int cap){
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    for (;;){
+        if (ip >= iend) return -1;
+        unsigned tok = *ip++;
+        size_t lit = tok >> 4, b;
+        if (lit == 15) do { if (ip >= iend) return -1; b = *ip++; lit += b; } while (b == 255);
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit); op += lit; ip += lit;
+        if (ip == iend) break;                      // last sequence has no match
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        size_t mlen = tok & 15;
+        if (mlen == 15) do { if (ip >= iend) return -1; b = *ip++; mlen += b; } while (b == 255);
+        mlen += LZ4BLK_MINMATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+        const uint8_t* ref = op - off;
+        if (off >= mlen){ memcpy(op, ref, mlen); op += mlen; }
+        else while (mlen--) *op++ = *ref++;         // overlapping copy repeats the pattern
+    }
+    return (int)(op - dst);
+}
+
+#endif // CFTP_USE_LZ4
+
+#endif // CFTP_LZ4BLK_H
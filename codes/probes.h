@@ -0,0 +1,38 @@
+// probes.h
+// USDT probes (provider "cftp") at the hot-path points, for perf and
+// bpftrace on a live transfer, e.g.
+//   bpftrace -e 'usdt:./udp_sender:cftp:rtt { @us = hist(arg1); }'
+// Each probe compiles to a single nop plus an ELF note saying where its
+// arguments live; nothing is called unless a tracer attaches. Without
+// <sys/sdt.h> (systemtap-sdt-dev), or with -DCFTP_NO_USDT, the probes
+// compile to nothing.
+//
+// udp_sender.c                          udp_receiver.c
+//   send(seq, in_flight)                  data(seq, offset, len)
+//   retransmit(seq, tx_count, age_us)     dup(seq)
+//   ack(cum_ack, sack_mask, in_flight)    cum_advance(old_cum, new_cum)
+//   sack(cum_ack, newly_sacked_mask)      ack_tx(cum_ack, sack_mask)
+//   rtt(seq, rtt_us)
+
+#ifndef CFTP_PROBES_H
+#define CFTP_PROBES_H
+
+#if !defined(CFTP_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CFTP_USDT 1
+#endif
+#endif
+
+#ifdef CFTP_USDT
+#define PROBE1(name, a)          DTRACE_PROBE1(cftp, name, a)
+#define PROBE2(name, a, b)       DTRACE_PROBE2(cftp, name, a, b)
+#define PROBE3(name, a, b, c)    DTRACE_PROBE3(cftp, name, a, b, c)
+#else
+// sizeof: arguments are not evaluated, but count as used
+#define PROBE1(name, a)          do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b)       do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c)    do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+#endif // CFTP_PROBES_H
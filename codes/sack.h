@@ -0,0 +1,66 @@
+// sack.h
+// Selective-repeat bookkeeping run per packet on both ends, shared by
+// udp_sender.c, udp_receiver.c and cftp_bench.c so the benchmark times the
+// code the binaries run:
+//   receiver: sack_advance moves cum_ack over what is now contiguous,
+//             sack_bits is the 64 have-bits right after it
+//   sender:   sack_apply marks what an ACK covers and slides base,
+//             sack_next_due finds the next timed-out gap in the window
+// Per-seq send state lives in rings indexed by seq & rmask.
+
+#ifndef CFTP_SACK_H
+#define CFTP_SACK_H
+
+#include <stdint.h>
+
+#include "segmap.h"
+
+static inline uint32_t sack_advance(const segmap_t* have, uint32_t cum, uint32_t total){
+    if (cum < total && segmap_get(have, (uint64_t)cum + 1))
+        cum = (uint32_t)segmap_next_zero(have, (uint64_t)cum + 1, total) - 1;
+    return cum;
+}
+
+static inline uint64_t sack_bits(const segmap_t* have, uint32_t cum){
+    return segmap_word(have, (uint64_t)cum + 1);
+}
+
+// Applies ACK (cum, mask): marks every seq <= cum and every masked seq past
+// it, drops those in flight from *in_flight, and moves *base to the lowest
+// unacked seq. rtt (may be NULL) gets a sample for each seq acked after a
+// single send. Returns the mask bits that were new.
+static inline uint64_t sack_apply(segmap_t* acked, uint32_t* base, uint32_t cum, uint64_t mask,
+                                  uint32_t total, uint32_t next_to_send, const int* tx_cnt,
+                                  const double* sent_ts, uint32_t rmask, int* in_flight,
+                                  double t_ack, void (*rtt)(uint32_t seq, double rtt)){
+    uint32_t top = cum < total ? cum : total;
+    for (uint32_t s = *base; (s = (uint32_t)segmap_next_zero(acked, s, top)) <= top; ++s){
+        segmap_set(acked, s);
+        *in_flight -= (s < next_to_send && tx_cnt[s & rmask] > 0);
+        if (rtt && s < next_to_send && tx_cnt[s & rmask] == 1) rtt(s, t_ack - sent_ts[s & rmask]);
+    }
+    *base = (uint32_t)segmap_next_zero(acked, *base, total);
+
+    uint64_t fresh = mask & ~segmap_word(acked, (uint64_t)cum + 1), news = fresh;
+    while (fresh){
+        uint32_t s = cum + 1 + (uint32_t)__builtin_ctzll(fresh);
+        fresh &= fresh - 1;
+        if (s > total) break;
+        segmap_set(acked, s);
+        *in_flight -= (s < next_to_send && tx_cnt[s & rmask] > 0);
+        if (rtt && s < next_to_send && tx_cnt[s & rmask] == 1) rtt(s, t_ack - sent_ts[s & rmask]);
+    }
+    *base = (uint32_t)segmap_next_zero(acked, *base, total);
+    return news;
+}
+
+// First seq in [s, end) that is unacked and was last sent rto or more before
+// now, or end if there is none.
+static inline uint32_t sack_next_due(const segmap_t* acked, uint32_t s, uint32_t end,
+                                     const double* sent_ts, uint32_t rmask, double now, double rto){
+    for (; s < end; ++s)
+        if (!segmap_get(acked, s) && now - sent_ts[s & rmask] >= rto) return s;
+    return end;
+}
+
+#endif // CFTP_SACK_H
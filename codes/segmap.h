@@ -0,0 +1,229 @@
+// segmap.h
+// Per-segment "done" bits (receiver: have, sender: acked) for files of any
+// size. Roaring-style: the seq space is cut into 65536-bit containers and
+// each container is
+//   NULL          : all clear (nothing received yet)
+//   segmap_ones   : all set (shared, never written)
+//   malloc'd bits : partially set, 8 KiB
+// Only containers around the active window are ever materialised, so memory
+// is ~12 B per 65536 segments plus 8 KiB per partial container.
+// Scans work a word at a time (ctz), 256 bits at a time with AVX2 when the
+// CPU has it; segmap_word() pulls 64 bits at any offset for SACK masks.
+
+#ifndef CFTP_SEGMAP_H
+#define CFTP_SEGMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEGMAP_HAVE_AVX2 1
+#endif
+
+#define SEGMAP_SHIFT 16
+#define SEGMAP_BITS  (1u << SEGMAP_SHIFT)     // bits per container
+#define SEGMAP_WORDS (SEGMAP_BITS / 64)
+
+static uint64_t segmap_ones[SEGMAP_WORDS];
+
+typedef struct {
+    uint64_t **blk;     // per container: NULL, segmap_ones or own bits
+    uint32_t  *cnt;     // bits set per container
+    uint32_t   nblk;
+    uint64_t   nbits;   // valid indices are [0, nbits)
+} segmap_t;
+
+// First word index >= k of w[] that is not all-equal to v (v=1: nonzero,
+// v=0: not all ones), or SEGMAP_WORDS.
+static uint32_t segmap_scan_sw(const uint64_t* w, uint32_t k, int v){
+    uint64_t flip = v ? 0 : ~0ULL;
+    while (k < SEGMAP_WORDS && !(w[k] ^ flip)) k++;
+    return k;
+}
+
+#ifdef SEGMAP_HAVE_AVX2
+__attribute__((target("avx2")))
+static uint32_t segmap_scan_avx2(const uint64_t* w, uint32_t k, int v){
+    uint64_t flip = v ? 0 : ~0ULL;
+    while ((k & 3) && k < SEGMAP_WORDS){
+        if (w[k] ^ flip) return k;
+        k++;
+    }
+    __m256i f = _mm256_set1_epi64x((long long)flip);
+    for (; k < SEGMAP_WORDS; k += 4){
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(w + k)), f);
+        if (!_mm256_testz_si256(x, x)) break;
+    }
+    while (k < SEGMAP_WORDS && !(w[k] ^ flip)) k++;
+    return k;
+}
+#endif
+
+static uint32_t (*segmap_scan)(const uint64_t*, uint32_t, int) = segmap_scan_sw;
+
+// Returns 0 on success, -1 on allocation failure.
+static inline int segmap_init(segmap_t* m, uint64_t nbits){
+    if (segmap_ones[0] != ~0ULL){
+        memset(segmap_ones, 0xff, sizeof(segmap_ones));
+#ifdef SEGMAP_HAVE_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) segmap_scan = segmap_scan_avx2;
+#endif
+    }
+    m->nbits = nbits;
+    m->nblk  = (uint32_t)((nbits + SEGMAP_BITS - 1) >> SEGMAP_SHIFT);
+    m->blk   = calloc(m->nblk ? m->nblk : 1, sizeof(*m->blk));
+    m->cnt   = calloc(m->nblk ? m->nblk : 1, sizeof(*m->cnt));
+    return (m->blk && m->cnt) ? 0 : -1;
+}
+
+static inline void segmap_free(segmap_t* m){
+    for (uint32_t b=0; m->blk && b<m->nblk; ++b)
+        if (m->blk[b] != segmap_ones) free(m->blk[b]);
+    free(m->blk); free(m->cnt);
+    memset(m, 0, sizeof(*m));
+}
+
+// Clears every bit.
+static inline void segmap_reset(segmap_t* m){
+    for (uint32_t b=0; b<m->nblk; ++b){
+        if (m->blk[b] != segmap_ones) free(m->blk[b]);
+        m->blk[b] = NULL; m->cnt[b] = 0;
+    }
+}
+
+// Number of valid bits in container b (only the last one can be short).
+static inline uint32_t segmap_span(const segmap_t* m, uint32_t b){
+    uint64_t lo = (uint64_t)b << SEGMAP_SHIFT;
+    return (uint32_t)((m->nbits - lo < SEGMAP_BITS) ? m->nbits - lo : SEGMAP_BITS);
+}
+
+static inline int segmap_get(const segmap_t* m, uint64_t i){
+    const uint64_t* w = m->blk[i >> SEGMAP_SHIFT];
+    return w && ((w[(i & (SEGMAP_BITS - 1)) >> 6] >> (i & 63)) & 1);
+}
+
+// Gives container b its own writable bits.
+static uint64_t* segmap_own(segmap_t* m, uint32_t b){
+    uint64_t* w = m->blk[b];
+    if (w && w != segmap_ones) return w;
+    uint64_t* n = malloc(SEGMAP_WORDS * sizeof(uint64_t));
+    if (!n){ perror("segmap"); exit(1); }
+    if (w){
+        // a full container: set exactly its span
+        uint32_t span = segmap_span(m, b);
+        memset(n, 0, SEGMAP_WORDS * sizeof(uint64_t));
+        memset(n, 0xff, (span / 64) * sizeof(uint64_t));
+        if (span % 64) n[span / 64] = (1ULL << (span % 64)) - 1;
+    } else {
+        memset(n, 0, SEGMAP_WORDS * sizeof(uint64_t));
+    }
+    m->blk[b] = n;
+    return n;
+}
+
+// Collapses container b to the shared full block once every bit is set.
+static inline void segmap_settle(segmap_t* m, uint32_t b){
+    if (m->cnt[b] == segmap_span(m, b) && m->blk[b] != segmap_ones){
+        free(m->blk[b]);
+        m->blk[b] = segmap_ones;
+    }
+}
+
+// Returns 1 if bit i was newly set.
+static inline int segmap_set(segmap_t* m, uint64_t i){
+    if (segmap_get(m, i)) return 0;
+    uint32_t b = (uint32_t)(i >> SEGMAP_SHIFT);
+    uint64_t* w = segmap_own(m, b);
+    w[(i & (SEGMAP_BITS - 1)) >> 6] |= 1ULL << (i & 63);
+    m->cnt[b]++;
+    segmap_settle(m, b);
+    return 1;
+}
+
+// Returns 1 if bit i was set before.
+static inline int segmap_clear(segmap_t* m, uint64_t i){
+    if (!segmap_get(m, i)) return 0;
+    uint32_t b = (uint32_t)(i >> SEGMAP_SHIFT);
+    uint64_t* w = segmap_own(m, b);
+    w[(i & (SEGMAP_BITS - 1)) >> 6] &= ~(1ULL << (i & 63));
+    if (--m->cnt[b] == 0){ free(w); m->blk[b] = NULL; }
+    return 1;
+}
+
+// Sets bits [a, e).
+static void segmap_set_range(segmap_t* m, uint64_t a, uint64_t e){
+    while (a < e){
+        uint32_t b = (uint32_t)(a >> SEGMAP_SHIFT);
+        uint64_t lo = (uint64_t)b << SEGMAP_SHIFT;
+        uint64_t hi = lo + segmap_span(m, b);
+        uint64_t stop = e < hi ? e : hi;
+        if (m->blk[b] == segmap_ones){ a = stop; continue; }
+        if (a == lo && stop == hi){
+            free(m->blk[b]);
+            m->blk[b] = segmap_ones;
+            m->cnt[b] = segmap_span(m, b);
+            a = stop; continue;
+        }
+        uint64_t* w = segmap_own(m, b);
+        for (; a < stop; ++a){
+            uint64_t bit = 1ULL << (a & 63), *p = &w[(a - lo) >> 6];
+            if (!(*p & bit)){ *p |= bit; m->cnt[b]++; }
+        }
+        segmap_settle(m, b);
+    }
+}
+
+// First index in [from, limit] whose bit equals v, or limit + 1.
+static uint64_t segmap_next(const segmap_t* m, uint64_t from, uint64_t limit, int v){
+    uint64_t i = from;
+    while (i <= limit){
+        uint32_t b = (uint32_t)(i >> SEGMAP_SHIFT);
+        uint64_t lo = (uint64_t)b << SEGMAP_SHIFT;
+        const uint64_t* w = m->blk[b];
+        if ((v && !w) || (!v && w == segmap_ones)){ i = lo + SEGMAP_BITS; continue; }
+        if (!w || w == segmap_ones) return i;
+        uint32_t k = (uint32_t)((i - lo) >> 6);
+        uint64_t x = (v ? w[k] : ~w[k]) & (~0ULL << (i & 63));
+        if (!x && (k = segmap_scan(w, k + 1, v)) < SEGMAP_WORDS) x = v ? w[k] : ~w[k];
+        if (x){
+            uint64_t r = lo + ((uint64_t)k << 6) + (uint64_t)__builtin_ctzll(x);
+            return r <= limit ? r : limit + 1;
+        }
+        i = lo + SEGMAP_BITS;
+    }
+    return limit + 1;
+}
+
+static inline uint64_t segmap_next_zero(const segmap_t* m, uint64_t from, uint64_t limit){
+    return segmap_next(m, from, limit, 0);
+}
+
+static inline uint64_t segmap_next_one(const segmap_t* m, uint64_t from, uint64_t limit){
+    return segmap_next(m, from, limit, 1);
+}
+
+// 64 bits starting at index i (bit 0 = index i); indices >= nbits read as 0.
+static inline uint64_t segmap_word(const segmap_t* m, uint64_t i){
+    if (i >= m->nbits) return 0;
+    uint64_t r = 0, left = m->nbits - i;
+    for (uint32_t got = 0; got < 64 && i < m->nbits; ){
+        // rest of the aligned word holding i: 64 - (i & 63) bits
+        const uint64_t* w = m->blk[i >> SEGMAP_SHIFT];
+        uint32_t sh = (uint32_t)(i & 63);
+        if (w) r |= (w[(i & (SEGMAP_BITS - 1)) >> 6] >> sh) << got;
+        got += 64 - sh; i += 64 - sh;
+    }
+    return left < 64 ? r & ((1ULL << left) - 1) : r;
+}
+
+static inline uint64_t segmap_count(const segmap_t* m){
+    uint64_t n = 0;
+    for (uint32_t b=0; b<m->nblk; ++b) n += m->cnt[b];
+    return n;
+}
+
+#endif // CFTP_SEGMAP_H
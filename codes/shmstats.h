@@ -0,0 +1,113 @@
+// shmstats.h
+// Live counters in a shared-memory page (--shm 1): /dev/shm/cftp-<pid>-snd
+// (or -rcv) holds one shm_page_t that the transfer updates with plain
+// stores, and cftp-top (cftp_top.c) maps read-only and polls. Multi-field
+// snapshots are made consistent with a sequence lock: the writer makes seq
+// odd, stores the fields, and makes it even again; a reader retries if seq
+// was odd or moved. Fields a side does not track stay 0. The file is
+// removed at exit.
+
+#ifndef CFTP_SHMSTATS_H
+#define CFTP_SHMSTATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define SHM_MAGIC   0x63667470736d3031ULL      // "cftpsm01"
+#define SHM_DIR     "/dev/shm"
+#define SHM_PREFIX  "cftp-"
+
+enum { SHM_SENDER, SHM_RECEIVER };
+
+enum {
+    SHM_BYTES_TOTAL,      // file size, 0 while unknown (streams)
+    SHM_BYTES_ACKED,      // sender: contiguously acked; receiver: placed
+    SHM_PKTS_SENT,
+    SHM_PKTS_RECV,
+    SHM_RETX,             // sender: retransmissions; receiver: duplicate DATA
+    SHM_IN_FLIGHT,        // segments sent and not yet acked
+    SHM_CWND,             // window limit in segments (fixed --win)
+    SHM_SRTT_US,          // smoothed RTT (sender)
+    SHM_QDROPS,           // sender: failed sends; receiver: socket queue drops
+    SHM_TIME_NS,          // CLOCK_MONOTONIC of this snapshot
+    SHM_DONE,             // 1 once the transfer has finished
+    SHM_NFIELDS = 16
+};
+
+typedef struct {
+    uint64_t magic;
+    uint32_t role, pid;
+    uint64_t start_ns;
+    uint64_t seq;                    // sequence lock, odd while being written
+    uint64_t v[SHM_NFIELDS];
+} shm_page_t;
+
+static inline uint64_t shm_now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Reader side: copies a consistent snapshot of v[] into out. Returns 0, or
+// -1 if the page is not ours or the writer keeps it busy.
+static inline int shm_snapshot(const shm_page_t* p, uint64_t* out){
+    if (p->magic != SHM_MAGIC) return -1;
+    for (int tries = 0; tries < 1000; ++tries){
+        uint64_t s1 = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+        if (s1 & 1) continue;
+        for (int i=0; i<SHM_NFIELDS; ++i) out[i] = __atomic_load_n(&p->v[i], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&p->seq, __ATOMIC_RELAXED) == s1) return 0;
+    }
+    return -1;
+}
+
+#ifndef CFTP_SHM_READER
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static shm_page_t* shm_page;
+static char shm_path[64];
+
+static void shm_remove(void){
+    if (shm_page) unlink(shm_path);
+}
+
+// Creates and maps the page; on failure the transfer runs without it. A page
+// left by an earlier process with our pid is removed first, and the new one
+// is created with O_EXCL|O_NOFOLLOW, so a file or symlink someone else
+// planted at that name is never written through.
+static void shm_open_page(int role){
+    snprintf(shm_path, sizeof(shm_path), SHM_DIR "/" SHM_PREFIX "%d-%s", (int)getpid(),
+             role == SHM_SENDER ? "snd" : "rcv");
+    unlink(shm_path);
+    int fd = open(shm_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0){ perror("shm page"); return; }
+    if (ftruncate(fd, sizeof(shm_page_t)) != 0){ perror("shm page"); close(fd); unlink(shm_path); return; }
+    void* p = mmap(NULL, sizeof(shm_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED){ perror("shm page"); unlink(shm_path); return; }
+    shm_page = p;
+    shm_page->role = (uint32_t)role;
+    shm_page->pid = (uint32_t)getpid();
+    shm_page->start_ns = shm_now_ns();
+    __atomic_store_n(&shm_page->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    atexit(shm_remove);
+    fprintf(stderr, "Live stats in %s\n", shm_path);
+}
+
+// Writer side: publishes v[] (SHM_TIME_NS is filled in here) as one snapshot.
+static inline void shm_publish(uint64_t* v){
+    shm_page_t* p = shm_page;
+    uint64_t s = p->seq;
+    v[SHM_TIME_NS] = shm_now_ns();
+    __atomic_store_n(&p->seq, s + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i=0; i<SHM_NFIELDS; ++i) __atomic_store_n(&p->v[i], v[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&p->seq, s + 2, __ATOMIC_RELEASE);
+}
+#endif // CFTP_SHM_READER
+
+#endif // CFTP_SHMSTATS_H
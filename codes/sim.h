@@ -0,0 +1,43 @@
+// sim.h
+// Hooks for cftp_sim (see cftp_sim.c). Force-included into udp_sender.c and
+// udp_receiver.c with -include, it reroutes their monotonic clock and UDP
+// socket calls to the simulator's virtual clock and modeled link. The
+// protocol code itself is compiled unchanged.
+
+#ifndef CFTP_SIM_H
+#define CFTP_SIM_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+int sim_clock_gettime(clockid_t clk, struct timespec* ts);
+int sim_socket(int domain, int type, int proto);
+int sim_setsockopt(int fd, int level, int name, const void* val, socklen_t len);
+int sim_bind(int fd, const struct sockaddr* a, socklen_t len);
+int sim_connect(int fd, const struct sockaddr* a, socklen_t len);
+ssize_t sim_send(int fd, const void* b, size_t n, int flags);
+ssize_t sim_sendto(int fd, const void* b, size_t n, int flags, const struct sockaddr* to, socklen_t tolen);
+ssize_t sim_sendmsg(int fd, const struct msghdr* m, int flags);
+ssize_t sim_recv(int fd, void* b, size_t n, int flags);
+ssize_t sim_recvfrom(int fd, void* b, size_t n, int flags, struct sockaddr* from, socklen_t* fromlen);
+
+#ifndef CFTP_SIM_IMPL
+#define clock_gettime(...) sim_clock_gettime(__VA_ARGS__)
+#define socket(...)        sim_socket(__VA_ARGS__)
+#define setsockopt(...)    sim_setsockopt(__VA_ARGS__)
+#define bind(...)          sim_bind(__VA_ARGS__)
+#define connect(...)       sim_connect(__VA_ARGS__)
+#define send(...)          sim_send(__VA_ARGS__)
+#define sendto(...)        sim_sendto(__VA_ARGS__)
+#define sendmsg(...)       sim_sendmsg(__VA_ARGS__)
+#define recv(...)          sim_recv(__VA_ARGS__)
+#define recvfrom(...)      sim_recvfrom(__VA_ARGS__)
+#endif
+
+#endif // CFTP_SIM_H
@@ -0,0 +1,175 @@
+// stats.h
+// Transfer counters for --stats-json. Like impair.h it wraps the socket
+// calls, so every datagram, PKT_DATA/PKT_ACK and syscall is counted in one
+// place; include it after impair.h. The programs add what only they know:
+// retransmissions, duplicate DATA, RTT samples and phase boundaries.
+// stats_json() writes everything as one JSON object at exit.
+
+#ifndef CFTP_STATS_H
+#define CFTP_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "cftp_proto.h"
+
+// RTT histogram: 8 buckets per power of two of microseconds, up to ~1 h
+#define STATS_RTT_SUB 3
+#define STATS_RTT_BUCKETS (32 << STATS_RTT_SUB)
+
+enum { PH_HANDSHAKE, PH_DATA, PH_TEARDOWN, PH_COUNT };
+
+typedef struct {
+    uint64_t pkts_sent, pkts_recv, bytes_sent, bytes_recv;     // bytes: UDP payload
+    uint64_t data_sent, data_recv, acks_sent, acks_recv;
+    uint64_t syscalls, send_err, recv_timeouts;
+    uint64_t retx_rto, retx_sack, dup_data;
+    uint64_t rtt_n;
+    double rtt_min, rtt_sum, srtt;                               // srtt: RFC 6298 smoothing
+    uint32_t rtt_hist[STATS_RTT_BUCKETS];
+    double phase[PH_COUNT];                                      // start times, 0 = not reached
+} xfer_stats_t;
+
+static xfer_stats_t xst;
+
+static inline double stats_now(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static inline void stats_phase(int ph){
+    if (xst.phase[ph] == 0.0) xst.phase[ph] = stats_now();
+}
+
+static inline void stats_rtt(double rtt){
+    uint64_t us = (uint64_t)(rtt * 1e6) + 1;
+    int e = 63 - __builtin_clzll(us);
+    uint32_t b = e < STATS_RTT_SUB ? (uint32_t)us
+               : ((uint32_t)(e - STATS_RTT_SUB + 1) << STATS_RTT_SUB) | (uint32_t)((us >> (e - STATS_RTT_SUB)) & ((1u << STATS_RTT_SUB) - 1));
+    if (b >= STATS_RTT_BUCKETS) b = STATS_RTT_BUCKETS - 1;
+    xst.rtt_hist[b]++;
+    if (!xst.rtt_n || rtt < xst.rtt_min) xst.rtt_min = rtt;
+    xst.srtt = xst.rtt_n ? xst.srtt + (rtt - xst.srtt) / 8.0 : rtt;
+    xst.rtt_n++; xst.rtt_sum += rtt;
+}
+
+// Upper bound (seconds) of the bucket holding quantile q.
+static inline double stats_rtt_quantile(double q){
+    uint64_t want = (uint64_t)(q * (double)xst.rtt_n + 0.5), seen = 0;
+    if (!want) want = 1;
+    for (uint32_t b=0; b<STATS_RTT_BUCKETS; ++b){
+        if ((seen += xst.rtt_hist[b]) < want) continue;
+        uint32_t e = b >> STATS_RTT_SUB, m = b & ((1u << STATS_RTT_SUB) - 1);
+        uint64_t hi = e ? ((uint64_t)((1u << STATS_RTT_SUB) | m) + 1) << (e - 1) : (uint64_t)m + 1;
+        return (double)(hi - 1) / 1e6;
+    }
+    return 0.0;
+}
+
+static inline void stats_tx(ssize_t r, uint8_t type){
+    xst.syscalls++;
+    if (r < 0){ xst.send_err++; return; }
+    xst.pkts_sent++; xst.bytes_sent += (uint64_t)r;
+    xst.data_sent += type == PKT_DATA;
+    xst.acks_sent += type == PKT_ACK;
+}
+
+static inline void stats_rx(ssize_t r, const void* b){
+    xst.syscalls++;
+    if (r < 0){ xst.recv_timeouts++; return; }
+    uint8_t type = r > 0 ? *(const uint8_t*)b : 0;
+    xst.pkts_recv++; xst.bytes_recv += (uint64_t)r;
+    xst.data_recv += type == PKT_DATA;
+    xst.acks_recv += type == PKT_ACK;
+}
+
+static inline ssize_t st_sendmsg(int fd, const struct msghdr* m, int flags){
+    ssize_t r = sendmsg(fd, m, flags);
+    stats_tx(r, m->msg_iovlen && m->msg_iov[0].iov_len ? *(const uint8_t*)m->msg_iov[0].iov_base : 0);
+    return r;
+}
+
+static inline ssize_t st_sendto(int fd, const void* b, size_t n, int flags,
+                                const struct sockaddr* to, socklen_t tolen){
+    ssize_t r = sendto(fd, b, n, flags, to, tolen);
+    stats_tx(r, n ? *(const uint8_t*)b : 0);
+    return r;
+}
+
+static inline ssize_t st_send(int fd, const void* b, size_t n, int flags){
+    ssize_t r = send(fd, b, n, flags);
+    stats_tx(r, n ? *(const uint8_t*)b : 0);
+    return r;
+}
+
+static inline ssize_t st_recvfrom(int fd, void* b, size_t n, int flags, struct sockaddr* from, socklen_t* fromlen){
+    ssize_t r = recvfrom(fd, b, n, flags, from, fromlen);
+    stats_rx(r, b);
+    return r;
+}
+
+static inline ssize_t st_recv(int fd, void* b, size_t n, int flags){
+    ssize_t r = recv(fd, b, n, flags);
+    stats_rx(r, b);
+    return r;
+}
+
+#undef sendmsg
+#undef sendto
+#undef send
+#undef recvfrom
+#undef recv
+#define sendmsg(...)  st_sendmsg(__VA_ARGS__)
+#define sendto(...)   st_sendto(__VA_ARGS__)
+#define send(...)     st_send(__VA_ARGS__)
+#define recvfrom(...) st_recvfrom(__VA_ARGS__)
+#define recv(...)     st_recv(__VA_ARGS__)
+
+// Writes the report to path ("-": to dflt). bytes is the file payload moved,
+// secs the transfer time the human line reports.
+static void stats_json(const char* path, FILE* dflt, const char* role, uint64_t bytes, double secs){
+    FILE* f = strcmp(path, "-") ? fopen(path, "w") : dflt;
+    if (!f){ perror("stats json"); return; }
+    double end = stats_now(), ph[PH_COUNT];
+    for (int p=0; p<PH_COUNT; ++p){
+        double next = end;
+        for (int q=p+1; q<PH_COUNT; ++q) if (xst.phase[q] != 0.0){ next = xst.phase[q]; break; }
+        ph[p] = xst.phase[p] != 0.0 ? next - xst.phase[p] : 0.0;
+    }
+    struct rusage ru; memset(&ru, 0, sizeof(ru));
+    getrusage(RUSAGE_SELF, &ru);
+    int tx = !strcmp(role, "sender");
+    double wire = (double)(tx ? xst.bytes_sent : xst.bytes_recv);
+    if (secs <= 0) secs = 1e-9;
+
+    fprintf(f, "{\"role\": \"%s\", \"bytes\": %lu, \"seconds\": %.6f, \"goodput_mbps\": %.3f, \"throughput_mbps\": %.3f,\n",
+            role, (unsigned long)bytes, secs, (double)bytes * 8.0 / 1e6 / secs, wire * 8.0 / 1e6 / secs);
+    fprintf(f, " \"packets\": {\"sent\": %lu, \"received\": %lu, \"data_sent\": %lu, \"data_received\": %lu,"
+               " \"acks_sent\": %lu, \"acks_received\": %lu, \"send_errors\": %lu},\n",
+            (unsigned long)xst.pkts_sent, (unsigned long)xst.pkts_recv, (unsigned long)xst.data_sent,
+            (unsigned long)xst.data_recv, (unsigned long)xst.acks_sent, (unsigned long)xst.acks_recv,
+            (unsigned long)xst.send_err);
+    fprintf(f, " \"wire_bytes\": {\"sent\": %lu, \"received\": %lu},\n",
+            (unsigned long)xst.bytes_sent, (unsigned long)xst.bytes_recv);
+    fprintf(f, " \"retransmits\": {\"rto\": %lu, \"sack\": %lu}, \"duplicate_data\": %lu,\n",
+            (unsigned long)xst.retx_rto, (unsigned long)xst.retx_sack, (unsigned long)xst.dup_data);
+    if (xst.rtt_n)
+        fprintf(f, " \"rtt_ms\": {\"samples\": %lu, \"min\": %.3f, \"avg\": %.3f, \"p99\": %.3f},\n",
+                (unsigned long)xst.rtt_n, xst.rtt_min * 1e3, xst.rtt_sum / (double)xst.rtt_n * 1e3,
+                stats_rtt_quantile(0.99) * 1e3);
+    else
+        fprintf(f, " \"rtt_ms\": null,\n");
+    fprintf(f, " \"cpu_s\": {\"user\": %.3f, \"sys\": %.3f},\n",
+            ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6, ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6);
+    fprintf(f, " \"syscalls\": {\"socket\": %lu, \"recv_timeouts\": %lu},\n",
+            (unsigned long)xst.syscalls, (unsigned long)xst.recv_timeouts);
+    fprintf(f, " \"phases_s\": {\"handshake\": %.6f, \"data\": %.6f, \"teardown\": %.6f}}\n",
+            ph[PH_HANDSHAKE], ph[PH_DATA], ph[PH_TEARDOWN]);
+    if (f != dflt) fclose(f); else fflush(f);
+}
+
+#endif // CFTP_STATS_H
@@ -0,0 +1,87 @@
+// synth.h
+// Synthetic data for measuring the protocol without storage in the way. The
+// sender's "synthetic:SIZE" input is SIZE bytes of a fixed pattern with a
+// period of SYNTH_PERIOD: one memfd of SYNTH_PERIOD (or a multiple) is filled
+// once and mapped again and again over a reserved region, so the send loop
+// reads page-cache-resident memory and every feature that works on the
+// mapped file works unchanged. The receiver's --sink verify-pattern checks
+// each payload against the same pattern at its file offset.
+
+#ifndef CFTP_SYNTH_H
+#define CFTP_SYNTH_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SYNTH_PREFIX   "synthetic:"
+#define SYNTH_PERIOD   (1u << 20)
+#define SYNTH_MAX_MAPS 4096
+
+// Little-endian 64-bit word w of the pattern (byte offset 8*w within a period).
+static inline uint64_t synth_word(uint64_t w){
+    uint64_t x = (w + 1) * 0x9e3779b97f4a7c15ULL;
+    return x ^ (x >> 29);
+}
+
+static inline uint8_t synth_byte(uint64_t off){
+    off &= SYNTH_PERIOD - 1;
+    return (uint8_t)(synth_word(off >> 3) >> ((off & 7) * 8));
+}
+
+// Returns 0 if p[0..n) is the pattern at byte offset off.
+static inline int synth_check(const uint8_t* p, uint64_t off, size_t n){
+    for (; n && (off & 7); --n) if (*p++ != synth_byte(off++)) return -1;
+    for (; n >= 8; n -= 8, p += 8, off += 8){
+        uint64_t v; memcpy(&v, p, 8);
+        if (v != htole64(synth_word((off & (SYNTH_PERIOD - 1)) >> 3))) return -1;
+    }
+    for (; n; --n) if (*p++ != synth_byte(off++)) return -1;
+    return 0;
+}
+
+// "synthetic:SIZE" with an optional K/M/G/T (binary) suffix; 0 if malformed.
+static inline uint64_t synth_size(const char* spec){
+    if (strncmp(spec, SYNTH_PREFIX, strlen(SYNTH_PREFIX))) return 0;
+    char* end;
+    uint64_t n = strtoull(spec + strlen(SYNTH_PREFIX), &end, 10);
+    switch (*end){
+        case 'K': case 'k': n <<= 10; end++; break;
+        case 'M': case 'm': n <<= 20; end++; break;
+        case 'G': case 'g': n <<= 30; end++; break;
+        case 'T': case 't': n <<= 40; end++; break;
+    }
+    return *end ? 0 : n;
+}
+
+// Read-only view of size bytes of pattern, or MAP_FAILED. The memfd grows
+// past SYNTH_PERIOD for big sizes to stay under SYNTH_MAX_MAPS mappings.
+static inline uint8_t* synth_map(uint64_t size){
+    uint64_t span = SYNTH_PERIOD;
+    while (size / span >= SYNTH_MAX_MAPS) span <<= 1;
+    int fd = memfd_create("cftp-synthetic", MFD_CLOEXEC);
+    if (fd < 0) return MAP_FAILED;
+    uint8_t* base = MAP_FAILED;
+    uint64_t* w = MAP_FAILED;
+    if (ftruncate(fd, (off_t)span) != 0) goto out;
+    w = mmap(NULL, span, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (w == MAP_FAILED) goto out;
+    for (uint64_t i=0; i<span/8; ++i) w[i] = htole64(synth_word(i & (SYNTH_PERIOD/8 - 1)));
+    munmap(w, span);
+    base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    for (uint64_t off=0; base != MAP_FAILED && off < size; off += span){
+        uint64_t n = size - off < span ? size - off : span;
+        if (mmap(base + off, n, PROT_READ, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED){
+            munmap(base, size);
+            base = MAP_FAILED;
+        }
+    }
+out:
+    close(fd);
+    return base;
+}
+
+#endif // CFTP_SYNTH_H
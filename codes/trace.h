@@ -0,0 +1,133 @@
+// trace.h
+// Optional per-event trace (--trace FILE): a ring of TRACE_RING_EVENTS
+// fixed-size records (sends, retransmits, RTO expiries, ACKs, state changes)
+// stamped with the TSC. Only the main loop thread writes it, so a record is
+// a few plain stores. When the newest events are all that fit, the oldest
+// are overwritten. The ring is written to FILE at exit, on SIGINT/SIGTERM,
+// and on SIGUSR1 (a snapshot; the transfer goes on). cftp_trace2qlog turns
+// the dump into qlog JSON.
+// With tracing off, TRACE() costs a single predicted-not-taken branch.
+
+#ifndef CFTP_TRACE_H
+#define CFTP_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef TRACE_RING_EVENTS
+#define TRACE_RING_EVENTS (1u << 20)             // 32 MiB
+#endif
+#define TRACE_MAGIC 0x3143525450544643ULL       // "CFTPTRC1"
+
+enum {
+    TR_SEND = 1,    // seq; a = in flight
+    TR_RETX,        // seq; a = transmission count
+    TR_RTO,         // seq whose timer expired; a = age in us
+    TR_ACK,         // sender: ACK in, seq = cum_ack, a = SACK mask, b = in flight
+    TR_ACK_TX,      // receiver: ACK out, seq = cum_ack, a = SACK mask
+    TR_DATA_RX,     // receiver: seq; a = length, b = 1 if duplicate
+    TR_STATE,       // a = TS_*
+};
+
+enum { TS_HANDSHAKE, TS_DATA, TS_END, TS_REPAIR, TS_DONE };
+
+typedef struct {
+    uint64_t tsc;
+    uint32_t seq;
+    uint32_t type;
+    uint64_t a, b;
+} trace_ev_t;
+
+// File: header, then count events, oldest first. tsc0/ns0 and tsc1/ns1 pin
+// the TSC to CLOCK_MONOTONIC at start and at dump time.
+typedef struct {
+    uint64_t magic;
+    uint32_t role, ev_size;                     // role: 0 sender, 1 receiver
+    uint32_t win, pad;                          // sender's window in segments
+    uint64_t tsc0, ns0, tsc1, ns1;
+    uint64_t count, overwritten;
+} trace_file_t;
+
+static inline uint64_t trace_tsc(void){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#ifndef CFTP_TRACE_READER
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static trace_ev_t* trace_ring;
+static uint64_t trace_head;                     // events written so far
+static trace_file_t trace_hdr;
+static char trace_path[4096];
+
+#define TRACE(type, seq, a, b) do { \
+        if (__builtin_expect(trace_ring != NULL, 0)) trace_put((type), (seq), (a), (b)); \
+    } while (0)
+
+static void trace_put(uint32_t type, uint32_t seq, uint64_t a, uint64_t b){
+    trace_ev_t* e = &trace_ring[trace_head & (TRACE_RING_EVENTS - 1)];
+    e->tsc = trace_tsc(); e->seq = seq; e->type = type; e->a = a; e->b = b;
+    __atomic_store_n(&trace_head, trace_head + 1, __ATOMIC_RELEASE);   // for the signal handler
+}
+
+// Async-signal-safe: only open/write/close and clock_gettime.
+static void trace_dump(void){
+    if (!trace_ring) return;
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t n = head < TRACE_RING_EVENTS ? head : TRACE_RING_EVENTS;
+    trace_file_t h = trace_hdr;
+    struct timespec ts;
+    h.tsc1 = trace_tsc();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    h.ns1 = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    h.count = n; h.overwritten = head - n;
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    ssize_t w = write(fd, &h, sizeof(h));
+    uint64_t first = (head - n) & (TRACE_RING_EVENTS - 1);
+    uint64_t part = n < TRACE_RING_EVENTS - first ? n : TRACE_RING_EVENTS - first;
+    if (w >= 0) w = write(fd, trace_ring + first, part * sizeof(trace_ev_t));
+    if (w >= 0 && n > part) w = write(fd, trace_ring, (n - part) * sizeof(trace_ev_t));
+    (void)w;
+    close(fd);
+}
+
+static void trace_signal(int sig){
+    trace_dump();
+    if (sig == SIGUSR1) return;
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void trace_open(const char* path, uint32_t role, uint32_t win){
+    snprintf(trace_path, sizeof(trace_path), "%s", path);
+    trace_ring = calloc(TRACE_RING_EVENTS, sizeof(trace_ev_t));
+    if (!trace_ring){ perror("trace ring"); return; }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace_hdr.magic = TRACE_MAGIC;
+    trace_hdr.role = role;
+    trace_hdr.win = win;
+    trace_hdr.ev_size = sizeof(trace_ev_t);
+    trace_hdr.tsc0 = trace_tsc();
+    trace_hdr.ns0 = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    atexit(trace_dump);
+    signal(SIGUSR1, trace_signal);
+    signal(SIGINT, trace_signal);
+    signal(SIGTERM, trace_signal);
+}
+#endif // CFTP_TRACE_READER
+
+#endif // CFTP_TRACE_H
@@ -1,7 +1,44 @@
 // udp_receiver_lab.c
 // Reliable-UDP receiver with Selective-Repeat + SACK and mmap()'d output.
-// Build: gcc -O2 -std=gnu11 -Wall -Wextra -o udp_receiver_sack udp_receiver_sack.c
-// Usage: ./udp_receiver_sack <output_file> [--port P] [--mtu M]
+// Build: gcc -O2 -std=gnu11 -Wall -Wextra -pthread -o udp_receiver_sack udp_receiver_sack.c
+//        (add -DCFTP_IMPAIR for the --imp_* test impairments, see impair.h)
+// Usage: ./udp_receiver_sack <output_file|-> [--port P] [--mtu M] [--resume 1|0] [--store DIR] [--stats-json FILE|-] [--shm 1|0] [--trace FILE] [--sink file|null|verify-pattern]
+// Notes: segment layout (payload size, chunk size) and features are taken from the
+//        sender's START; --mtu only applies to legacy senders that omit them.
+//        With FEAT_CRC32C each DATA payload is checked before it touches the mmap;
+//        corrupt segments are dropped (treated as lost) and counted.
+//        With FEAT_TREE_HASH each hash leaf is hashed as soon as it is complete,
+//        so the root is ready to compare the moment the last segment lands. If the
+//        roots differ we walk the sender's Merkle tree to find the bad leaves and
+//        ask for just those again.
+//        --resume 1 checkpoints the have-map to <output_file>.cftp-resume every
+//        CKPT_INTERVAL_S (after msync) and, for a matching START, reopens the
+//        output without truncation and tells the sender what is already there.
+//        With FEAT_COMPRESS stored chunk bytes are staged at the chunk's own offset
+//        and LZ4-decoded in place once all of its DATA have landed (not combined
+//        with --resume: a half-staged chunk cannot be told from decoded data).
+//        With FEAT_SPARSE the output is only ftruncate'd, not preallocated, and
+//        PKT_ZERO ranges are punched out (FALLOC_FL_PUNCH_HOLE), so holes and
+//        zero runs of the source stay unallocated here.
+//        With FEAT_DELTA an existing output is first moved to
+//        <output_file>.cftp-basis (or a basis left by an interrupted run is
+//        reused); the sender pulls its block signatures and PKT_COPY ranges are
+//        copied from it. The basis is removed once the new file is complete.
+//        --store DIR keeps a content-addressed chunk store (DIR/xx/<blake3>).
+//        With FEAT_DEDUP the sender lists its chunks first; those found in the
+//        store are filled locally and never sent, and after a complete
+//        transfer the chunks that did travel are added to it.
+//        With FEAT_MULTI (the sender was given a directory) <output_file> is
+//        created as a directory; the manifest is checked (relative paths only)
+//        and its files are created by a few threads before any DATA arrives.
+//        With FEAT_STREAM (input of unknown length) segments go through a
+//        reorder ring of STREAM_RING slots and are written out in order;
+//        <output_file> "-" writes them to stdout (the report goes to stderr).
+//        --sink null discards payloads once the protocol has taken them in (no
+//        output file, no preallocation or msync) and --sink verify-pattern
+//        also checks each against the sender's "synthetic:SIZE" pattern
+//        (synth.h); <output_file> is then unused. Only --crc and streaming
+//        are accepted from the sender in these modes.
 
 #define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
@@ -9,6 +46,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +57,21 @@
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/sock_diag.h>
+
+#include "cftp_proto.h"
+#include "sack.h"
+#include "crc32c.h"
+#include "blake3.h"
+#include "lz4blk.h"
+#include "delta.h"
+#include "dedup.h"
+#include "shmstats.h"
+#include "synth.h"
+#include "trace.h"
+#include "probes.h"
+#include "impair.h"          // may wrap send()/sendto()/sendmsg()
+#include "stats.h"           // last: counts every socket call
 
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
@@ -26,32 +79,14 @@
 
 #define DEFAULT_PORT 9000
 #define DEFAULT_MTU  1500
+#define MAX_REPAIR_ROUNDS 3
+#define REPAIR_RTO_MS 400
+#define REPAIR_TRIES  20
+#define CKPT_INTERVAL_S 2.0
+#define CKPT_SUFFIX ".cftp-resume"
+#define BASIS_SUFFIX ".cftp-basis"
 
-enum { PKT_DATA=0x01, PKT_START=0x02, PKT_END=0x03, PKT_ACK=0x10 };
-
-#pragma pack(push,1)
-typedef struct {
-    uint8_t  type;
-    uint32_t seq;    // network order on wire
-    uint16_t len;    // network order on wire
-} pkt_hdr_t;
-#pragma pack(pop)
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t cum_ack;    // highest contiguous DATA seq received
-    uint64_t sack_mask;  // bits for next 64 seqs after cum_ack
-} ack_payload_t;
-#pragma pack(pop)
-
-static inline uint64_t htonll(uint64_t v){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return (((uint64_t)htonl(v & 0xffffffffULL)) << 32) | htonl((uint32_t)(v >> 32));
-#else
-    return v;
-#endif
-}
-static inline uint64_t ntohll(uint64_t v){ return htonll(v); }
+enum { SINK_FILE, SINK_NULL, SINK_VERIFY };
 
 static double now_s(void){
     struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -67,13 +102,13 @@ typedef struct {
     int fd;
 } file_map_t;
 
-static void fmap_open_wo(const char* path, uint64_t size, file_map_t* m){
+static void fmap_open_wo(const char* path, uint64_t size, int keep, int sparse, file_map_t* m){
     memset(m,0,sizeof(*m));
-    m->fd = open(path, O_CREAT|O_TRUNC|O_RDWR, 0644);
+    m->fd = open(path, O_CREAT|O_RDWR|(keep ? 0 : O_TRUNC), 0644);
     if (m->fd < 0) die("open output");
 #ifdef __linux__
     // Pre-size file to avoid SIGBUS on mmap writes
-    if (posix_fallocate(m->fd, 0, (off_t)size) != 0){
+    if (sparse || posix_fallocate(m->fd, 0, (off_t)size) != 0){
         // fallback: ftruncate
         if (ftruncate(m->fd, (off_t)size) != 0) die("ftruncate");
     }
@@ -85,16 +120,577 @@ static void fmap_open_wo(const char* path, uint64_t size, file_map_t* m){
     if (m->base == MAP_FAILED) die("mmap output");
 }
 
+// FEAT_DELTA: maps the previous version of the output read-only as the basis,
+// moving it aside to bpath first unless an interrupted run already did.
+// Returns 0 on success, -1 if there is nothing to use.
+static int basis_open(const char* out, const char* bpath, file_map_t* m){
+    struct stat st;
+    memset(m,0,sizeof(*m)); m->fd = -1;
+    if (stat(bpath, &st) != 0 && rename(out, bpath) != 0) return -1;
+    m->fd = open(bpath, O_RDONLY);
+    if (m->fd < 0) return -1;
+    if (fstat(m->fd, &st) != 0 || st.st_size == 0){
+        close(m->fd); m->fd = -1;
+        unlink(bpath);
+        return -1;
+    }
+    m->size = (uint64_t)st.st_size;
+    m->base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->fd, 0);
+    if (m->base == MAP_FAILED) die("mmap basis");
+    return 0;
+}
+
+// Chunk store file of fingerprint fp: dir/xx/<64 hex digits>.
+static void store_path(char* out, size_t cap, const char* dir, const uint8_t fp[BLAKE3_OUT_LEN]){
+    char hex[2 * BLAKE3_OUT_LEN + 1];
+    for (int i=0; i<BLAKE3_OUT_LEN; ++i) snprintf(hex + 2*i, 3, "%02x", fp[i]);
+    snprintf(out, cap, "%s/%.2s/%s", dir, hex, hex);
+}
+
+// Copies chunk c of the store into dst. Returns 0 if it was there and still
+// hashes to its fingerprint; a damaged copy is removed so store_put can
+// replace it once the chunk has travelled.
+static int store_get(const char* dir, const dedup_chunk_t* c, uint8_t* dst){
+    char path[4096];
+    struct stat st;
+    store_path(path, sizeof(path), dir, c->fp);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    int ok = fstat(fd, &st) == 0 && (uint64_t)st.st_size == c->len &&
+             pread(fd, dst, c->len, 0) == (ssize_t)c->len;
+    close(fd);
+    if (!ok) return -1;
+    uint8_t fp[BLAKE3_OUT_LEN];
+    blake3_hasher bh;
+    blake3_init(&bh); blake3_update(&bh, dst, c->len); blake3_final(&bh, fp);
+    if (memcmp(fp, c->fp, BLAKE3_OUT_LEN) != 0){
+        fprintf(stderr, "Store chunk %s does not match its fingerprint, dropped\n", path);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Adds chunk c (bytes at src) to the store unless it is already there.
+// Returns 1 if it was written.
+static int store_put(const char* dir, const dedup_chunk_t* c, const uint8_t* src){
+    char path[4096], tmp[4096 + 8];
+    struct stat st;
+    store_path(path, sizeof(path), dir, c->fp);
+    if (stat(path, &st) == 0) return 0;
+    snprintf(tmp, sizeof(tmp), "%.*s", (int)(strrchr(path, '/') - path), path);
+    mkdir(tmp, 0755);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (fd < 0){ perror("open store chunk"); return 0; }
+    int ok = write(fd, src, c->len) == (ssize_t)c->len;
+    close(fd);
+    if (!ok || rename(tmp, path) != 0){ perror("write store chunk"); unlink(tmp); return 0; }
+    return 1;
+}
+
+// Zeroes [off, off+len) of the output, deallocating it where the filesystem can.
+static void fmap_zero(file_map_t* m, uint64_t off, uint64_t len){
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len) == 0) return;
+#endif
+    memset(m->base + off, 0, len);
+}
+
 static void fmap_close(file_map_t* m){
     if (m->base && m->base!=MAP_FAILED) msync(m->base, m->size, MS_SYNC);
     if (m->base && m->base!=MAP_FAILED) munmap(m->base, m->size);
     if (m->fd >= 0) close(m->fd);
 }
 
+// FEAT_MULTI: the output path is a directory and the stream lives in an
+// anonymous region. Once the manifest is complete every large file is created
+// and mapped over its slice, so DATA lands straight in it; small files are
+// written out of the region at the end. Both steps run MULTI_THREADS wide,
+// since file creation is mostly waiting on the filesystem.
+#define MULTI_THREADS 8
+
+typedef struct {
+    char *path;                  // relative to root
+    uint64_t off, size;
+    uint32_t mode;
+    int mapped;                  // large file mapped over its slice
+} mf_ent_t;
+
+typedef struct {
+    const char *root;
+    int rootfd;                  // every entry is opened relative to this
+    mf_ent_t *ent;
+    uint8_t *got;                // entry listed yet
+    uint32_t n, left;
+    uint8_t *base;
+    uint32_t next;               // multi_par: next entry to claim
+    int bad;
+} multi_t;
+
+static void fmap_open_stream(uint64_t size, file_map_t* m){
+    memset(m,0,sizeof(*m));
+    m->fd = -1;
+    m->size = size;
+    m->base = mmap(NULL, size, PROT_WRITE|PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (m->base == MAP_FAILED) die("mmap stream");
+}
+
+// Relative, '/'-separated, no empty, "." or ".." components.
+static int multi_path_ok(const char* p, size_t n){
+    if (n == 0 || memchr(p, 0, n)) return 0;
+    for (size_t a = 0; a <= n; ){
+        size_t b = a;
+        while (b < n && p[b] != '/') b++;
+        if (b == a || (b - a == 1 && p[a] == '.') || (b - a == 2 && p[a] == '.' && p[a+1] == '.')) return 0;
+        a = b + 1;
+    }
+    return 1;
+}
+
+static void multi_file_path(const multi_t* m, uint32_t i, char* out, size_t cap){
+    snprintf(out, cap, "%s/%s", m->root, m->ent[i].path);
+}
+
+// Opens the directory holding entry i's last component and points *leaf at
+// that component in buf. Each step is an openat() with O_NOFOLLOW from the
+// root's fd, so a symlink already under the output directory cannot carry
+// the manifest outside it.
+static int multi_parent(const multi_t* m, uint32_t i, char* buf, size_t cap, const char** leaf){
+    if ((size_t)snprintf(buf, cap, "%s", m->ent[i].path) >= cap){ errno = ENAMETOOLONG; return -1; }
+    int dfd = fcntl(m->rootfd, F_DUPFD_CLOEXEC, 0);
+    char* p = buf;
+    for (char* s; dfd >= 0 && (s = strchr(p, '/')); p = s + 1){
+        *s = 0;
+        int nfd = openat(dfd, p, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        int err = errno;
+        close(dfd);
+        dfd = nfd; errno = err;
+    }
+    *leaf = p;
+    return dfd;
+}
+
+// Creates regular file i afresh: whatever is at its name (an old file, a
+// symlink) is unlinked first and the new one made with O_EXCL.
+static int multi_open_file(const multi_t* m, uint32_t i, int flags){
+    char buf[4096 + 2];
+    const char* leaf;
+    int dfd = multi_parent(m, i, buf, sizeof(buf), &leaf);
+    if (dfd < 0) return -1;
+    if (unlinkat(dfd, leaf, 0) != 0 && errno != ENOENT){ close(dfd); return -1; }
+    int fd = openat(dfd, leaf, flags|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+    int err = errno;
+    close(dfd);
+    errno = err;
+    return fd;
+}
+
+// Creates large file i and maps it over its slice of the stream. If that
+// fails the file is written out at the end like a small one.
+static int multi_map(multi_t* m, uint32_t i){
+    mf_ent_t* e = &m->ent[i];
+    char path[4096 + 1024 + 2];
+    if (!S_ISREG(e->mode) || e->size <= MULTI_PACK_MAX) return 0;
+    multi_file_path(m, i, path, sizeof(path));
+    int fd = multi_open_file(m, i, O_RDWR);
+    if (fd < 0){ perror(path); return -1; }
+    e->mapped = ftruncate(fd, (off_t)e->size) == 0 &&
+                mmap(m->base + e->off, e->size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) != MAP_FAILED;
+    fchmod(fd, e->mode & 07777);
+    close(fd);
+    return 0;
+}
+
+// Writes file i out of the stream unless it is mapped.
+static int multi_write(multi_t* m, uint32_t i){
+    const mf_ent_t* e = &m->ent[i];
+    char path[4096 + 1024 + 2];
+    if (!S_ISREG(e->mode) || e->mapped) return 0;
+    multi_file_path(m, i, path, sizeof(path));
+    int fd = multi_open_file(m, i, O_WRONLY);
+    if (fd < 0){ perror(path); return -1; }
+    int ok = 1;
+    for (uint64_t done = 0; ok && done < e->size; ){
+        ssize_t w = write(fd, m->base + e->off + done, e->size - done);
+        if (w <= 0){ perror(path); ok = 0; }
+        else done += (uint64_t)w;
+    }
+    fchmod(fd, e->mode & 07777);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+typedef struct { multi_t* m; int (*fn)(multi_t*, uint32_t); } multi_job_t;
+
+static void* multi_worker(void* arg){
+    multi_job_t* j = arg;
+    for (;;){
+        uint32_t i = __atomic_fetch_add(&j->m->next, 1, __ATOMIC_RELAXED);
+        if (i >= j->m->n) break;
+        if (j->fn(j->m, i) != 0) __atomic_store_n(&j->m->bad, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Runs fn over every entry on up to MULTI_THREADS threads (this one included).
+static void multi_par(multi_t* m, int (*fn)(multi_t*, uint32_t)){
+    multi_job_t j = { m, fn };
+    pthread_t th[MULTI_THREADS - 1];
+    int nt = 0;
+    m->next = 0;
+    while (nt < MULTI_THREADS - 1 && (uint32_t)(nt + 1) * 64 < m->n &&
+           pthread_create(&th[nt], NULL, multi_worker, &j) == 0) nt++;
+    multi_worker(&j);
+    for (int i=0; i<nt; ++i) pthread_join(th[i], NULL);
+}
+
+// Manifest complete: directories first (in order, parents come first), then
+// the large files in parallel.
+static void multi_create(multi_t* m){
+    char path[4096 + 1024 + 2], buf[4096 + 2];
+    const char* leaf;
+    for (uint32_t i=0; i<m->n; ++i){
+        if (!S_ISDIR(m->ent[i].mode)) continue;
+        int dfd = multi_parent(m, i, buf, sizeof(buf), &leaf);
+        if (dfd < 0 || (mkdirat(dfd, leaf, 0755) != 0 && errno != EEXIST)){
+            multi_file_path(m, i, path, sizeof(path));
+            perror(path); m->bad = 1;
+        }
+        if (dfd >= 0) close(dfd);
+    }
+    multi_par(m, multi_map);
+}
+
+// Transfer over: small files out of the stream, then directory modes
+// (deepest first, so a read-only directory is filled before it is locked).
+static void multi_finish(multi_t* m){
+    char buf[4096 + 2];
+    const char* leaf;
+    multi_par(m, multi_write);
+    for (uint32_t i=m->n; i-- > 0; ){
+        if (!S_ISDIR(m->ent[i].mode)) continue;
+        int dfd = multi_parent(m, i, buf, sizeof(buf), &leaf);
+        if (dfd < 0) continue;
+        int fd = openat(dfd, leaf, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if (fd >= 0){ fchmod(fd, m->ent[i].mode & 07777); close(fd); }
+        close(dfd);
+    }
+}
+
+static void multi_free(multi_t* m){
+    for (uint32_t i=0; m->ent && i<m->n; ++i) free(m->ent[i].path);
+    free(m->ent); free(m->got);
+    if (m->rootfd >= 0) close(m->rootfd);
+}
+
+// FEAT_STREAM: segments are held in a reorder ring of STREAM_RING slots past
+// cum and written to the sink (a file, or stdout for "-") in order as soon as
+// they are contiguous, so memory stays bounded whatever the length.
+typedef struct {
+    int fd;
+    uint32_t payload;
+    uint8_t *data;
+    uint32_t *len;               // bytes held per slot, 0 = empty
+    uint32_t cum;                // highest seq written out
+    uint64_t written;
+} stream_rx_t;
+
+static void stream_open(stream_rx_t* r, const char* path, uint32_t payload){
+    memset(r, 0, sizeof(*r));
+    r->fd = strcmp(path, "-") ? open(path, O_CREAT|O_WRONLY|O_TRUNC, 0644) : STDOUT_FILENO;
+    if (r->fd < 0) die("open output");
+    r->payload = payload;
+    r->data = malloc((size_t)STREAM_RING * payload);
+    r->len = calloc(STREAM_RING, sizeof(uint32_t));
+    if (!r->data || !r->len) die("alloc stream");
+}
+
+static void stream_write(int fd, const uint8_t* p, size_t n){
+    while (n){
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) die("write output");
+        p += w; n -= (size_t)w;
+    }
+}
+
+// Takes DATA seq; returns 1 if it was new. Runs of slots that became
+// contiguous are written in one go (up to the ring's wrap).
+static int stream_put(stream_rx_t* r, uint32_t seq, const uint8_t* p, uint32_t len){
+    if (seq <= r->cum || seq - r->cum > STREAM_RING || !len || len > r->payload) return 0;
+    uint32_t k = seq % STREAM_RING;
+    if (r->len[k]) return 0;
+    memcpy(r->data + (size_t)k * r->payload, p, len);
+    r->len[k] = len;
+    while (r->len[(r->cum + 1) % STREAM_RING]){
+        uint32_t k0 = (r->cum + 1) % STREAM_RING, k1 = k0;
+        size_t n = 0;
+        // only the last segment is short, so a run is contiguous in the ring
+        while (k1 < STREAM_RING && r->len[k1]){
+            n += r->len[k1]; r->len[k1] = 0;
+            k1++;
+            if (n % r->payload) break;
+        }
+        stream_write(r->fd, r->data + (size_t)k0 * r->payload, n);
+        r->written += n;
+        r->cum += k1 - k0;
+    }
+    return 1;
+}
+
+// SACK bits for the 64 seqs after cum.
+static uint64_t stream_mask(const stream_rx_t* r){
+    uint64_t m = 0;
+    for (uint32_t i=0; i<64; ++i)
+        if (r->len[(r->cum + 1 + i) % STREAM_RING]) m |= 1ULL << i;
+    return m;
+}
+
+static void stream_close(stream_rx_t* r){
+    if (r->fd > STDERR_FILENO) close(r->fd);
+    free(r->data); free(r->len);
+}
+
+// Resume sidecar: this header followed by rle_len bytes of records, each
+// { uint32 from, uint32 n, n bytes of rle_encode() runs starting at from }.
+// Every field must match the new START for the checkpoint to be used.
+typedef struct {
+    char     magic[8];      // "CFTPRSM2"
+    uint64_t file_size;
+    uint64_t src_id;
+    uint32_t payload;
+    uint32_t chunk;
+    uint32_t total_segs;
+    uint32_t rle_len;
+} ckpt_hdr_t;
+
+#define CKPT_REC_MAX 4096   // run bytes per record
+
+// Flushes the output, then atomically replaces the sidecar, so a checkpoint
+// never claims data that is not on disk.
+static void ckpt_write(const char* path, const ckpt_hdr_t* want, const segmap_t* have,
+                       file_map_t* fm){
+    if (msync(fm->base, fm->size, MS_SYNC) != 0){ perror("msync"); return; }
+
+    char tmp[4096 + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (fd < 0){ perror("open checkpoint"); return; }
+    ckpt_hdr_t hd = *want;
+    hd.rle_len = 0;
+    int ok = write(fd, &hd, sizeof(hd)) == (ssize_t)sizeof(hd);
+    uint8_t rec[2*sizeof(uint32_t) + CKPT_REC_MAX];
+    for (uint32_t from = 1; ok && from <= want->total_segs; ){
+        uint32_t next, n = (uint32_t)rle_encode(have, from, want->total_segs, rec + 2*sizeof(uint32_t),
+                                                CKPT_REC_MAX, &next);
+        memcpy(rec, &from, sizeof(from));
+        memcpy(rec + sizeof(uint32_t), &n, sizeof(n));
+        ok = write(fd, rec, 2*sizeof(uint32_t) + n) == (ssize_t)(2*sizeof(uint32_t) + n);
+        hd.rle_len += 2*sizeof(uint32_t) + n;
+        from = next;
+    }
+    ok = ok && pwrite(fd, &hd, sizeof(hd), 0) == (ssize_t)sizeof(hd) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, path) != 0){ perror("write checkpoint"); unlink(tmp); }
+}
+
+// Loads a matching checkpoint into have. Returns 0 if one was applied.
+static int ckpt_load(const char* path, const ckpt_hdr_t* want, segmap_t* have){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ckpt_hdr_t hd;
+    int rc = -1;
+    if (read(fd, &hd, sizeof(hd)) == (ssize_t)sizeof(hd) &&
+        !memcmp(hd.magic, want->magic, sizeof(hd.magic)) &&
+        hd.file_size == want->file_size && hd.src_id == want->src_id &&
+        hd.payload == want->payload && hd.chunk == want->chunk &&
+        hd.total_segs == want->total_segs){
+        uint8_t rec[CKPT_REC_MAX];
+        uint32_t left = hd.rle_len, expect = 1, from, n;
+        while (left >= 2*sizeof(uint32_t) &&
+               read(fd, &from, sizeof(from)) == (ssize_t)sizeof(from) &&
+               read(fd, &n, sizeof(n)) == (ssize_t)sizeof(n) &&
+               from == expect && n <= CKPT_REC_MAX && n <= left - 2*sizeof(uint32_t) &&
+               read(fd, rec, n) == (ssize_t)n &&
+               (expect = rle_decode(rec, n, from, hd.total_segs, have)) != 0)
+            left -= 2*sizeof(uint32_t) + n;
+        if (left == 0) rc = 0;
+    }
+    close(fd);
+    if (rc != 0){ segmap_reset(have); segmap_set(have, 0); }
+    return rc;
+}
+
+// Credits [off, off+len) to the hash leaves it covers and hashes every leaf
+// that just became complete, straight from the output mmap.
+static void tree_note(const file_map_t* fm, uint32_t* fill, uint8_t* dig,
+                      uint64_t off, uint32_t len){
+    while (len){
+        uint32_t b = (uint32_t)(off / HASH_BLOCK);
+        uint64_t b_off = (uint64_t)b * HASH_BLOCK;
+        uint32_t b_len = (uint32_t)MIN((uint64_t)HASH_BLOCK, fm->size - b_off);
+        uint32_t take = (uint32_t)MIN((uint64_t)len, b_off + b_len - off);
+        fill[b] += take;
+        if (fill[b] == b_len) tree_leaf(fm->base + b_off, b_len, dig + (size_t)b * BLAKE3_OUT_LEN);
+        off += take; len -= take;
+    }
+}
+
+// Undoes tree_note() for a segment that is being fetched again.
+static void tree_forget(uint64_t size, uint32_t* fill, uint64_t off, uint32_t len){
+    while (len){
+        uint32_t b = (uint32_t)(off / HASH_BLOCK);
+        uint64_t b_off = (uint64_t)b * HASH_BLOCK;
+        uint32_t take = (uint32_t)MIN((uint64_t)len, MIN(b_off + HASH_BLOCK, size) - off);
+        fill[b] -= take;
+        off += take; len -= take;
+    }
+}
+
+static void set_rcv_timeout(int sock, int ms){
+    struct timeval tv = { .tv_sec = ms/1000, .tv_usec = (ms%1000)*1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static int cmp_u32(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Walks the sender's tree top-down after a root mismatch. Each round asks, for
+// every node that differs, for its descendants d levels down (as many as fit in
+// one TREE_RSP), so a handful of bad leaves costs ~log2(leaves)/d round trips.
+// Writes the differing leaf indices to bad[] and returns their count, or -1 if
+// the sender stopped answering. Needs SO_RCVTIMEO set.
+static int64_t merkle_diff(int sock, const struct sockaddr_in* peer, socklen_t peerlen,
+                           const tree_shape_t* t, uint8_t* nodes, uint32_t payload, uint32_t* bad){
+    const size_t HDR = sizeof(pkt_hdr_t);
+    uint32_t fit = (uint32_t)((payload - sizeof(tree_req_t)) / BLAKE3_OUT_LEN);
+    uint32_t d = 0;
+    while ((2u << d) <= fit) d++;
+    uint32_t *cur = malloc((size_t)t->cnt[0] * sizeof(uint32_t));
+    uint32_t *nxt = malloc((size_t)t->cnt[0] * sizeof(uint32_t));
+    uint8_t  *answered = malloc(t->cnt[0]);
+    uint8_t  *rbuf = malloc(HDR + payload + 16);
+    if (!cur || !nxt || !answered || !rbuf) die("alloc merkle");
+
+    int64_t result = -1;
+    uint32_t lev = t->nlev - 1, ncur = 1;
+    cur[0] = 0;                                // the root, known to differ
+    while (lev > 0 && ncur){
+        uint32_t to = lev > d ? lev - d : 0, sh = lev - to;
+        uint32_t nnxt = 0, left = ncur;
+        memset(answered, 0, ncur);
+        for (int idle = 0; left && idle < REPAIR_TRIES; ){
+            for (uint32_t i=0; i<ncur; ++i){
+                if (answered[i]) continue;
+                uint32_t first = cur[i] << sh;
+                tree_req_t q = { (uint8_t)to, htonl(first),
+                                 htons((uint16_t)MIN(1u << sh, t->cnt[to] - first)) };
+                pkt_hdr_t h = { .type = PKT_TREE_REQ, .seq = htonl(0), .len = htons(sizeof(q)) };
+                uint8_t out[sizeof(h) + sizeof(q)];
+                memcpy(out, &h, sizeof(h)); memcpy(out + sizeof(h), &q, sizeof(q));
+                sendto(sock, out, sizeof(out), 0, (const struct sockaddr*)peer, peerlen);
+            }
+            int progressed = 0;
+            ssize_t r;
+            while (left && (r = recv(sock, rbuf, HDR + payload + 16, 0)) >= 0){
+                pkt_hdr_t *h = (pkt_hdr_t*)rbuf;
+                if (r < (ssize_t)(HDR + sizeof(tree_req_t)) || h->type != PKT_TREE_RSP) continue;
+                tree_req_t q; memcpy(&q, rbuf + HDR, sizeof(q));
+                uint32_t first = ntohl(q.first), count = ntohs(q.count);
+                if (q.level != to || (first & ((1u << sh) - 1)) != 0) continue;
+                uint32_t node = first >> sh;
+                uint32_t *hit = bsearch(&node, cur, ncur, sizeof(uint32_t), cmp_u32);
+                if (!hit || answered[hit - cur]) continue;
+                if (count != MIN(1u << sh, t->cnt[to] - first) ||
+                    r < (ssize_t)(HDR + sizeof(q) + (size_t)count * BLAKE3_OUT_LEN)) continue;
+                answered[hit - cur] = 1; left--; progressed = 1;
+                for (uint32_t k=0; k<count; ++k)
+                    if (memcmp(rbuf + HDR + sizeof(q) + (size_t)k * BLAKE3_OUT_LEN,
+                               tree_at(nodes, t, to, first + k), BLAKE3_OUT_LEN) != 0)
+                        nxt[nnxt++] = first + k;
+            }
+            idle = progressed ? 0 : idle + 1;
+        }
+        if (left) goto out;
+        qsort(nxt, nnxt, sizeof(uint32_t), cmp_u32);
+        uint32_t *tmp = cur; cur = nxt; nxt = tmp;
+        ncur = nnxt; lev = to;
+    }
+    memcpy(bad, cur, (size_t)ncur * sizeof(uint32_t));
+    result = ncur;
+out:
+    free(cur); free(nxt); free(answered); free(rbuf);
+    return result;
+}
+
+// Sends the bad leaf list in REPAIR batches, each echoed by the sender, then an
+// empty batch that tells it to start resending. Returns 0 on success.
+static int request_repair(int sock, const struct sockaddr_in* peer, socklen_t peerlen,
+                          const uint32_t* bad, uint32_t nbad, uint32_t payload){
+    const size_t HDR = sizeof(pkt_hdr_t);
+    uint32_t per = payload / sizeof(uint32_t);
+    uint8_t *out = malloc(HDR + (size_t)per * sizeof(uint32_t));
+    if (!out) die("alloc repair");
+    int rc = -1;
+    uint32_t batch = 0;
+    for (uint32_t i=0; ; ++batch){
+        uint32_t cnt = MIN(per, nbad - i);
+        pkt_hdr_t h = { .type = PKT_REPAIR, .seq = htonl(batch), .len = htons((uint16_t)(cnt * sizeof(uint32_t))) };
+        memcpy(out, &h, HDR);
+        for (uint32_t k=0; k<cnt; ++k){
+            uint32_t v = htonl(bad[i + k]);
+            memcpy(out + HDR + k * sizeof(uint32_t), &v, sizeof(v));
+        }
+        int echoed = 0;
+        for (int t=0; t<REPAIR_TRIES && !echoed; ++t){
+            sendto(sock, out, HDR + cnt * sizeof(uint32_t), 0, (const struct sockaddr*)peer, peerlen);
+            uint8_t abuf[64];
+            ssize_t r;
+            while (!echoed && (r = recv(sock, abuf, sizeof(abuf), 0)) >= 0){
+                pkt_hdr_t *ah = (pkt_hdr_t*)abuf;
+                echoed = r >= (ssize_t)HDR && ah->type == PKT_REPAIR && ntohl(ah->seq) == batch;
+            }
+        }
+        if (!echoed) goto out;
+        if (cnt == 0) break;
+        i += cnt;
+    }
+    rc = 0;
+out:
+    free(out);
+    return rc;
+}
+
+// --shm 1: publishes progress to the live stats page. Socket queue drops
+// cost a getsockopt, so they are only refreshed every 1024 calls.
+static void shm_receiver(int sock, uint64_t total, uint64_t placed, int done){
+    static uint64_t drops, calls;
+    if ((calls++ & 1023) == 0 || done){
+        uint32_t mi[SK_MEMINFO_VARS];
+        socklen_t ml = sizeof(mi);
+        if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, mi, &ml) == 0 && ml > SK_MEMINFO_DROPS * sizeof(uint32_t))
+            drops = mi[SK_MEMINFO_DROPS];
+    }
+    uint64_t v[SHM_NFIELDS] = {0};
+    v[SHM_BYTES_TOTAL] = total;
+    v[SHM_BYTES_ACKED] = placed;
+    v[SHM_PKTS_SENT] = xst.pkts_sent;
+    v[SHM_PKTS_RECV] = xst.pkts_recv;
+    v[SHM_RETX] = xst.dup_data;
+    v[SHM_QDROPS] = drops;
+    v[SHM_DONE] = (uint64_t)done;
+    shm_publish(v);
+}
+
 static void send_ack_sack(int sock, const struct sockaddr_in* peer, socklen_t peerlen,
                           uint32_t cum_ack, uint64_t mask){
     pkt_hdr_t h; h.type = PKT_ACK; h.seq = htonl(0); h.len = htons(sizeof(ack_payload_t));
     ack_payload_t ap; ap.cum_ack = htonl(cum_ack); ap.sack_mask = htonll(mask);
+    TRACE(TR_ACK_TX, cum_ack, mask, 0);
+    PROBE2(ack_tx, cum_ack, mask);
     struct iovec iov[2] = { { &h, sizeof(h) }, { &ap, sizeof(ap) } };
     struct msghdr msg = {0};
     msg.msg_iov = iov; msg.msg_iovlen = 2;
@@ -104,21 +700,48 @@ static void send_ack_sack(int sock, const struct sockaddr_in* peer, socklen_t pe
 
 int main(int argc, char **argv){
     if (argc < 2){
-        fprintf(stderr, "Usage: %s <output_file> [--port P] [--mtu M]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <output_file|-> [--port P] [--mtu M] [--resume 1|0] [--store DIR] [--stats-json FILE|-] [--shm 1|0] [--trace FILE] [--sink file|null|verify-pattern]\n", argv[0]);
         return 2;
     }
     const char* out_path = argv[1];
 
     int port = DEFAULT_PORT, mtu = DEFAULT_MTU;
+    int want_resume = 0;
+    const char* store_dir = NULL;
+    const char* stats_path = NULL;
+    int want_shm = 0;
+    const char* trace_file = NULL;
+    int sink = SINK_FILE;
     for (int i=2; i<argc; ++i){
         if (!strcmp(argv[i], "--port") && i+1<argc) port = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--mtu") && i+1<argc)  mtu  = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--resume") && i+1<argc) want_resume = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--store") && i+1<argc) store_dir = argv[++i];
+        else if (!strcmp(argv[i], "--stats-json") && i+1<argc) stats_path = argv[++i];
+        else if (!strcmp(argv[i], "--shm") && i+1<argc) want_shm = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--trace") && i+1<argc) trace_file = argv[++i];
+        else if (!strcmp(argv[i], "--sink") && i+1<argc){
+            const char* k = argv[++i];
+            if (!strcmp(k, "file")) sink = SINK_FILE;
+            else if (!strcmp(k, "null")) sink = SINK_NULL;
+            else if (!strcmp(k, "verify-pattern")) sink = SINK_VERIFY;
+            else { fprintf(stderr, "Unknown --sink %s\n", k); return 2; }
+        }
+        else if (impair_arg(argc, argv, &i)) {}
         else if (!strcmp(argv[i], "--rtt") || !strcmp(argv[i], "--loss")) { ++i; } // accepted & ignored
     }
     if (mtu < 576) { fprintf(stderr, "MTU too small.\n"); return 2; }
 
+    char ckpt_path[4096];
+    snprintf(ckpt_path, sizeof(ckpt_path), "%s%s", out_path, CKPT_SUFFIX);
+    if (store_dir && mkdir(store_dir, 0755) != 0 && errno != EEXIST) die("store dir");
+    char basis_path[4096];
+    snprintf(basis_path, sizeof(basis_path), "%s%s", out_path, BASIS_SUFFIX);
+
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) die("socket");
+    if (want_shm) shm_open_page(SHM_RECEIVER);
+    if (trace_file) trace_open(trace_file, 1, 0);
     int buf_sz = 8*1024*1024;
     setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buf_sz, sizeof(buf_sz));
     setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buf_sz, sizeof(buf_sz));
@@ -134,23 +757,51 @@ int main(int argc, char **argv){
     int payload_max = mtu - IP_UDP - HDR;
     if (payload_max < 512) payload_max = 512;
 
-    // RX buffers
-    uint8_t *buf = malloc(HDR + payload_max + 16);
+    // RX buffers (resized to the sender's payload at START)
+    int rx_payload = payload_max;
+    if (rx_payload < (int)sizeof(start_payload_t)) rx_payload = (int)sizeof(start_payload_t);
+    uint8_t *buf = malloc(HDR + rx_payload + 16);
     if (!buf) die("malloc");
 
     struct sockaddr_in peer; socklen_t peerlen = sizeof(peer);
     uint64_t expected_total = 0, received = 0;
     uint32_t total_segs = 0;
     uint32_t cum_ack = 0;     // highest contiguous seq received
-    uint8_t *have = NULL;     // bitmap per segment
+    segmap_t have = {0};      // bit per segment (seq 0 always set)
+    seg_layout_t L = {0};
+    uint32_t features = 0;    // accepted FEAT_*
+    int data_off = HDR;       // payload offset within a DATA packet
+    uint64_t crc_bad = 0;     // DATA dropped on CRC32C mismatch
+    uint64_t pattern_bad = 0; // --sink verify-pattern: DATA not matching the pattern
+    uint8_t *cz_stage = NULL; // FEAT_COMPRESS: stored bytes of the chunk being decoded
+    uint64_t cz_bad = 0;      // chunks whose LZ4 block did not decode
+    uint64_t zeroed = 0;      // FEAT_SPARSE: bytes covered by PKT_ZERO ranges
+    uint64_t copied = 0;      // FEAT_DELTA: bytes copied from the basis (PKT_COPY)
+    file_map_t basis = { .fd = -1 };
+    dedup_chunk_t *dd = NULL;     // FEAT_DEDUP: the sender's chunk list ...
+    uint8_t *dd_state = NULL;     // ... 0 = not listed yet, 1 = listed, 2 = filled from the store
+    uint32_t dd_n = 0;
+    uint64_t dd_filled = 0;       // bytes filled from the store
+    uint32_t *leaf_fill = NULL;   // FEAT_TREE_HASH: bytes landed per hash leaf
+    uint8_t  *leaf_dig  = NULL;   // ... and the whole tree (leaves = level 0)
+    tree_shape_t tshape = {0};
+    int verified = -1;            // -1 = not hashed, 0 = mismatch, 1 = match
+    int repairs = 0;
+    ckpt_hdr_t ckpt = { .magic = "CFTPRSM2" };   // FEAT_RESUME: identity of this transfer
+    double last_ckpt = 0.0;
+    uint64_t resumed = 0;         // bytes already on disk from an earlier run
     file_map_t fm = {0};
+    multi_t mf = { .root = out_path, .rootfd = -1 };   // FEAT_MULTI: the manifest
+    stream_rx_t sr = { .fd = -1 };        // FEAT_STREAM: reorder ring and sink
+    int to_stdout = !strcmp(out_path, "-") && sink == SINK_FILE;
+    FILE* report = to_stdout ? stderr : stdout;
     double t0 = 0.0;
     int started = 0, finished = 0;
 
     fprintf(stderr, "Listening on UDP %d, MTU=%d, payload<=%d \n", port, mtu, payload_max);
 
     while (!finished){
-        ssize_t n = recvfrom(sock, buf, HDR + payload_max, 0,
+        ssize_t n = recvfrom(sock, buf, HDR + DATA_CRC_LEN + CZ_HDR_LEN + rx_payload, 0,
                              (struct sockaddr*)&peer, &peerlen);
         if (n < (ssize_t)HDR) continue;
 
@@ -161,22 +812,97 @@ int main(int argc, char **argv){
 
         if (type == PKT_START && seq == 0){
             if (!started){
-                if (len != sizeof(uint64_t)) { fprintf(stderr,"Bad START len\n"); continue; }
-                uint64_t fs_net = 0; memcpy(&fs_net, buf+HDR, sizeof(uint64_t));
-                expected_total = ntohll(fs_net);
-                total_segs = (uint32_t)((expected_total + payload_max - 1) / payload_max);
-                have = calloc((size_t)total_segs + 1, 1);
-                if (!have) die("alloc have");
-                fmap_open_wo(out_path, expected_total, &fm);
-                started = 1;
+                uint32_t seg_payload = (uint32_t)payload_max, chunk = 0;
+                uint64_t src_id = 0;
+                if (len == sizeof(start_payload_t) && n >= (ssize_t)(HDR + sizeof(start_payload_t))){
+                    start_payload_t sp; memcpy(&sp, buf+HDR, sizeof(sp));
+                    expected_total = ntohll(sp.file_size);
+                    chunk          = ntohl(sp.chunk);
+                    seg_payload    = ntohs(sp.payload);
+                    features       = ntohl(sp.features) & FEAT_ALL;
+                    src_id         = ntohll(sp.src_id);
+                    if (!want_resume) features &= ~FEAT_RESUME;
+                    if (!store_dir) features &= ~FEAT_DEDUP;
+                    if (features & FEAT_STREAM) features &= FEAT_STREAM | FEAT_CRC32C;
+                    if (sink != SINK_FILE) features &= FEAT_STREAM | FEAT_CRC32C;
+                } else if (len == sizeof(uint64_t)){
+                    uint64_t fs_net = 0; memcpy(&fs_net, buf+HDR, sizeof(uint64_t));
+                    expected_total = ntohll(fs_net);
+                } else { fprintf(stderr,"Bad START len\n"); continue; }
+                if (to_stdout && !(features & FEAT_STREAM)){
+                    fprintf(stderr, "Output to stdout needs a streaming sender\n");
+                    continue;
+                }
+                if (seg_payload > (uint32_t)PAYLOAD_LIMIT || layout_init(&L, expected_total, seg_payload, chunk) != 0){
+                    fprintf(stderr,"Bad START layout (payload=%u chunk=%u)\n", seg_payload, chunk);
+                    continue;
+                }
+                total_segs = L.total_segs;
+                if ((features & FEAT_COMPRESS) && (chunk != CZ_CHUNK || !L.seg_per_chunk)) features &= ~FEAT_COMPRESS;
+                if (features & FEAT_COMPRESS){
+                    features &= ~FEAT_RESUME;
+                    if (!(cz_stage = malloc(CZ_CHUNK))) die("alloc cz");
+                }
+                if (features & FEAT_CRC32C){ crc32c_init(); data_off = HDR + DATA_CRC_LEN; }
+                if (features & FEAT_COMPRESS) data_off += CZ_HDR_LEN;
+                if ((int)seg_payload > rx_payload){
+                    uint8_t *nb = realloc(buf, HDR + seg_payload + 16);
+                    if (!nb) die("realloc rx buf");
+                    buf = nb; h = (pkt_hdr_t*)buf;
+                    rx_payload = (int)seg_payload;
+                }
+                if (segmap_init(&have, (uint64_t)total_segs + 1) != 0) die("alloc have");
+                segmap_set(&have, 0);
+                int keep = 0;
+                if (features & FEAT_RESUME){
+                    ckpt.file_size = expected_total; ckpt.src_id = src_id;
+                    ckpt.payload = seg_payload; ckpt.chunk = chunk; ckpt.total_segs = total_segs;
+                    keep = ckpt_load(ckpt_path, &ckpt, &have) == 0;
+                }
+                if (features & FEAT_MULTI){
+                    // a directory: no single file to resume into or delta against
+                    features &= ~(FEAT_RESUME | FEAT_DELTA);
+                    keep = 0;
+                    if (mkdir(out_path, 0755) != 0 && errno != EEXIST) die("output dir");
+                    if ((mf.rootfd = open(out_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) die("output dir");
+                }
+                // a resumable partial output beats a delta against the old one
+                if ((features & FEAT_DELTA) && (keep || basis_open(out_path, basis_path, &basis) != 0))
+                    features &= ~FEAT_DELTA;
+                if (features & FEAT_STREAM){ stream_open(&sr, sink == SINK_FILE ? out_path : "/dev/null", seg_payload); fm.fd = -1; }
+                else if (sink != SINK_FILE) fm.fd = -1;
+                else if (features & FEAT_MULTI) fmap_open_stream(expected_total, &fm);
+                else fmap_open_wo(out_path, expected_total, keep, (features & FEAT_SPARSE) != 0, &fm);
+                if (features & FEAT_TREE_HASH){
+                    uint32_t nl = tree_leaves(expected_total);
+                    tree_shape(nl, &tshape);
+                    leaf_fill = calloc(nl, sizeof(uint32_t));
+                    leaf_dig  = calloc((size_t)tshape.total, BLAKE3_OUT_LEN);
+                    if (!leaf_fill || !leaf_dig) die("alloc tree");
+                }
                 cum_ack = 0;
-                t0 = now_s();
-                fprintf(stderr, "START: expecting %lu bytes in %u segments\n",
-                        (unsigned long)expected_total, total_segs);
+                for (uint32_t s=1; keep && (s = (uint32_t)segmap_next_one(&have, s, total_segs)) <= total_segs; ++s){
+                    uint32_t sl; uint64_t so = layout_seg(&L, s, &sl);
+                    resumed += sl;
+                    if (leaf_fill) tree_note(&fm, leaf_fill, leaf_dig, so, sl);
+                }
+                received = resumed;
+                cum_ack = (uint32_t)segmap_next_zero(&have, 1, total_segs) - 1;
+                if (keep) fprintf(stderr, "Resume: %lu bytes already on disk\n", (unsigned long)resumed);
+                started = 1;
+                t0 = last_ckpt = now_s();
+                stats_phase(PH_HANDSHAKE);
+                TRACE(TR_STATE, 0, TS_HANDSHAKE, 0);
+                if (features & FEAT_STREAM)
+                    fprintf(stderr, "START: streaming (payload=%u feat=0x%x)\n", seg_payload, features);
+                else
+                    fprintf(stderr, "START: expecting %lu bytes in %u segments (payload=%u chunk=%u feat=0x%x)\n",
+                            (unsigned long)expected_total, total_segs, seg_payload, chunk, features);
             }
-            // simple START-ACK (no payload)
-            pkt_hdr_t ack = { .type = PKT_ACK, .seq = htonl(0), .len = htons(sizeof(ack_payload_t)) };
-            ack_payload_t ap = { htonl(cum_ack), htonll(0) };
+            // START-ACK echoes the accepted features
+            pkt_hdr_t ack = { .type = PKT_ACK, .seq = htonl(0), .len = htons(sizeof(start_ack_payload_t)) };
+            uint32_t have_segs = (features & FEAT_RESUME) ? (uint32_t)(segmap_count(&have) - 1) : 0;
+            start_ack_payload_t ap = { { htonl(cum_ack), htonll(0) }, htonl(features), htonl(have_segs) };
             struct iovec iov[2] = { { &ack, sizeof(ack) }, { &ap, sizeof(ap) } };
             struct msghdr msg = {0};
             msg.msg_iov = iov; msg.msg_iovlen = 2;
@@ -185,60 +911,439 @@ int main(int argc, char **argv){
             continue;
         }
 
+        if (type == PKT_PROBE){
+            // echo so the sender learns this size got through; payload is padding
+            pkt_hdr_t echo = { .type = PKT_PROBE, .seq = h->seq, .len = htons(0) };
+            sendto(sock, &echo, sizeof(echo), 0, (struct sockaddr*)&peer, peerlen);
+            continue;
+        }
+
         if (!started) continue;
 
+        if (type == PKT_MANIFEST && (features & FEAT_MULTI)){
+            uint32_t cnt;
+            if (len < sizeof(cnt) || n < (ssize_t)(HDR + len)) continue;
+            memcpy(&cnt, buf + HDR, sizeof(cnt));
+            cnt = ntohl(cnt);
+            if (!mf.got){
+                if (cnt > MULTI_MAX_ENT) continue;
+                mf.ent = calloc((size_t)cnt + 1, sizeof(mf_ent_t)); mf.got = calloc((size_t)cnt + 1, 1);
+                if (!mf.ent || !mf.got) die("alloc manifest");
+                mf.n = mf.left = cnt;
+                mf.base = fm.base;
+            }
+            if (cnt != mf.n || seq > mf.n) continue;
+            // validate the whole batch before taking any of it
+            size_t at = HDR + sizeof(cnt), end = HDR + len;
+            uint32_t k = seq;
+            int ok = 1;
+            while (ok && at < end){
+                manifest_ent_t me;
+                if (end - at < sizeof(me) || k >= mf.n){ ok = 0; break; }
+                memcpy(&me, buf + at, sizeof(me));
+                uint64_t off = ntohll(me.off), size = ntohll(me.size);
+                uint32_t mode = ntohl(me.mode);
+                uint16_t pl = ntohs(me.plen);
+                at += sizeof(me);
+                ok = pl <= end - at && multi_path_ok((const char*)buf + at, pl) &&
+                     (S_ISDIR(mode) ? size == 0 : S_ISREG(mode)) &&
+                     off <= expected_total && size <= expected_total - off &&
+                     (size <= MULTI_PACK_MAX || off % MULTI_ALIGN == 0);
+                at += pl; k++;
+            }
+            if (!ok){ fprintf(stderr, "Bad manifest batch at entry %u\n", seq); continue; }
+            at = HDR + sizeof(cnt);
+            for (k = seq; at < end; ++k){
+                manifest_ent_t me; memcpy(&me, buf + at, sizeof(me));
+                uint16_t pl = ntohs(me.plen);
+                at += sizeof(me);
+                if (!mf.got[k]){
+                    mf_ent_t* e = &mf.ent[k];
+                    e->off = ntohll(me.off); e->size = ntohll(me.size); e->mode = ntohl(me.mode);
+                    if (!(e->path = strndup((const char*)buf + at, pl))) die("alloc manifest");
+                    mf.got[k] = 1; mf.left--;
+                    if (!mf.left){
+                        double tm = now_s();
+                        multi_create(&mf);
+                        fprintf(stderr, "Manifest: %u entries, files created in %.3f s%s\n",
+                                mf.n, now_s() - tm, mf.bad ? " (with errors)" : "");
+                    }
+                }
+                at += pl;
+            }
+            pkt_hdr_t echo = { .type = PKT_MANIFEST, .seq = h->seq, .len = htons(0) };
+            sendto(sock, &echo, sizeof(echo), 0, (struct sockaddr*)&peer, peerlen);
+            continue;
+        }
+
+        if (type == PKT_RESUME_REQ && (features & FEAT_RESUME)){
+            // describe have from seq onwards, as much as fits in one packet
+            if (seq == 0 || seq > total_segs) continue;
+            uint8_t *out = malloc(HDR + L.payload);
+            if (!out) die("alloc resume");
+            uint32_t next;
+            size_t rl = rle_encode(&have, seq, total_segs, out + HDR + sizeof(uint32_t),
+                                   L.payload - sizeof(uint32_t), &next);
+            pkt_hdr_t mh = { .type = PKT_RESUME_MAP, .seq = htonl(seq),
+                             .len = htons((uint16_t)(sizeof(uint32_t) + rl)) };
+            uint32_t nn = htonl(next);
+            memcpy(out, &mh, HDR);
+            memcpy(out + HDR, &nn, sizeof(nn));
+            sendto(sock, out, HDR + sizeof(uint32_t) + rl, 0, (struct sockaddr*)&peer, peerlen);
+            free(out);
+            continue;
+        }
+
+        if (type == PKT_DELTA_REQ && (features & FEAT_DELTA)){
+            // signatures of basis blocks seq, seq+1, ... as many as fit
+            delta_sig_hdr_t sh;
+            uint32_t bl = delta_block_len(basis.size), nb = (uint32_t)(basis.size / bl);
+            if (seq > nb) continue;
+            uint32_t cnt = MIN(nb - seq, (uint32_t)((L.payload - sizeof(sh)) / sizeof(delta_sig_t)));
+            uint8_t *out = malloc(HDR + sizeof(sh) + (size_t)cnt * sizeof(delta_sig_t));
+            if (!out) die("alloc delta");
+            pkt_hdr_t mh = { .type = PKT_DELTA_SIG, .seq = htonl(seq),
+                             .len = htons((uint16_t)(sizeof(sh) + (size_t)cnt * sizeof(delta_sig_t))) };
+            sh.block_len = htonl(bl); sh.nblocks = htonl(nb);
+            memcpy(out, &mh, HDR);
+            memcpy(out + HDR, &sh, sizeof(sh));
+            for (uint32_t i=0; i<cnt; ++i){
+                const uint8_t* blk = basis.base + (uint64_t)(seq + i) * bl;
+                delta_sig_t sg = { htonl(delta_weak(blk, bl)), htonll(delta_strong(blk, bl)) };
+                memcpy(out + HDR + sizeof(sh) + (size_t)i * sizeof(sg), &sg, sizeof(sg));
+            }
+            sendto(sock, out, HDR + ntohs(mh.len), 0, (struct sockaddr*)&peer, peerlen);
+            free(out);
+            continue;
+        }
+
+        if (type == PKT_DEDUP_QUERY && (features & FEAT_DEDUP)){
+            dedup_query_hdr_t qh;
+            if (len < sizeof(qh) || n < (ssize_t)(HDR + len)) continue;
+            memcpy(&qh, buf + HDR, sizeof(qh));
+            uint32_t cnt = (uint32_t)((len - sizeof(qh)) / sizeof(dedup_ent_t)), nc = ntohl(qh.nchunks);
+            uint64_t off = ntohll(qh.off);
+            if (!dd){
+                if (!nc || nc > expected_total) continue;
+                dd = calloc(nc, sizeof(dedup_chunk_t)); dd_state = calloc(nc, 1);
+                if (!dd || !dd_state) die("alloc dedup");
+                dd_n = nc;
+            }
+            if (nc != dd_n || seq >= dd_n || cnt > dd_n - seq) continue;
+            uint8_t bits[(PAYLOAD_LIMIT / sizeof(dedup_ent_t) + 7) / 8] = {0};
+            for (uint32_t i=0; i<cnt; ++i){
+                dedup_ent_t de; memcpy(&de, buf + HDR + sizeof(qh) + (size_t)i * sizeof(de), sizeof(de));
+                uint32_t k = seq + i, dl = ntohl(de.len);
+                if (!dl || off > expected_total || dl > expected_total - off) break;
+                if (!dd_state[k]){
+                    dd[k].off = off; dd[k].len = dl;
+                    memcpy(dd[k].fp, de.fp, BLAKE3_OUT_LEN);
+                    dd_state[k] = store_get(store_dir, &dd[k], fm.base + off) == 0 ? 2 : 1;
+                    if (dd_state[k] == 2){
+                        dd_filled += dl;
+                        // credit what the run of filled chunks around k now covers
+                        uint32_t lo = k, hi = k, s0, s1, sl;
+                        while (lo > 0 && dd_state[lo - 1] == 2) lo--;
+                        while (hi + 1 < dd_n && dd_state[hi + 1] == 2) hi++;
+                        uint32_t spc = (features & FEAT_COMPRESS) ? L.seg_per_chunk : 0;
+                        dedup_cover(&L, spc, dd[lo].off, dd[hi].off + dd[hi].len, &s0, &s1);
+                        for (uint32_t s = s0; s <= s1 && (s = (uint32_t)segmap_next_zero(&have, s, s1)) <= s1; ++s){
+                            uint64_t so = layout_seg(&L, s, &sl);
+                            if (spc){
+                                // whole FEAT_COMPRESS chunks, as PKT_ZERO/PKT_COPY credit them
+                                uint32_t c = (s - 1) / spc;
+                                segmap_set_range(&have, cz_first_seq(&L, c), (uint64_t)cz_last_seq(&L, c) + 1);
+                                received += cz_raw_len(&L, c);
+                                if (leaf_fill) tree_note(&fm, leaf_fill, leaf_dig, (uint64_t)c * L.chunk, cz_raw_len(&L, c));
+                                s = cz_last_seq(&L, c);
+                                continue;
+                            }
+                            segmap_set(&have, s);
+                            received += sl;
+                            if (leaf_fill) tree_note(&fm, leaf_fill, leaf_dig, so, sl);
+                        }
+                        cum_ack = sack_advance(&have, cum_ack, total_segs);
+                    }
+                }
+                if (dd_state[k] == 2) bits[i >> 3] |= (uint8_t)(1u << (i & 7));
+                off += dl;
+            }
+            uint8_t out[sizeof(pkt_hdr_t) + sizeof(bits)];
+            pkt_hdr_t mh = { .type = PKT_DEDUP_HAVE, .seq = h->seq, .len = htons((uint16_t)((cnt + 7) / 8)) };
+            memcpy(out, &mh, HDR);
+            memcpy(out + HDR, bits, (cnt + 7) / 8);
+            sendto(sock, out, HDR + (cnt + 7) / 8, 0, (struct sockaddr*)&peer, peerlen);
+            continue;
+        }
+
+        if ((type == PKT_ZERO && (features & FEAT_SPARSE)) || (type == PKT_COPY && (features & FEAT_DELTA))){
+            // whole seq ranges that are zero / already in the basis
+            uint32_t cnt = 0;
+            uint64_t src = 0;
+            if (type == PKT_COPY){
+                copy_payload_t cp;
+                if (len != sizeof(cp) || n < (ssize_t)(HDR + sizeof(cp))) continue;
+                memcpy(&cp, buf + HDR, sizeof(cp));
+                cnt = ntohl(cp.count); src = ntohll(cp.src);
+            } else {
+                if (len != sizeof(cnt) || n < (ssize_t)(HDR + sizeof(cnt))) continue;
+                memcpy(&cnt, buf + HDR, sizeof(cnt));
+                cnt = ntohl(cnt);
+            }
+            if (seq == 0 || cnt == 0 || cnt > total_segs - seq + 1) continue;
+            uint32_t last = seq + cnt - 1, sl;
+            if ((features & FEAT_COMPRESS) &&
+                ((seq - 1) % L.seg_per_chunk || (last != total_segs && last % L.seg_per_chunk))) continue;
+            uint64_t a = layout_seg(&L, seq, &sl);
+            uint64_t e = layout_seg(&L, last, &sl) + sl;
+            if (type == PKT_COPY && (src > basis.size || e - a > basis.size - src)) continue;
+            if (segmap_next_zero(&have, seq, last) <= last){
+                if (type == PKT_COPY) memcpy(fm.base + a, basis.base + src, e - a);
+                else fmap_zero(&fm, a, e - a);
+                if (features & FEAT_COMPRESS){
+                    // credit each chunk not yet decoded as a whole
+                    for (uint32_t c = (seq - 1) / L.seg_per_chunk; c <= (last - 1) / L.seg_per_chunk; ++c){
+                        uint32_t cf = cz_first_seq(&L, c), cl = cz_last_seq(&L, c);
+                        if (segmap_next_zero(&have, cf, cl) > cl) continue;
+                        segmap_set_range(&have, cf, (uint64_t)cl + 1);
+                        received += cz_raw_len(&L, c);
+                        if (leaf_fill) tree_note(&fm, leaf_fill, leaf_dig, (uint64_t)c * L.chunk, cz_raw_len(&L, c));
+                    }
+                } else {
+                    for (uint32_t s = seq; (s = (uint32_t)segmap_next_zero(&have, s, last)) <= last; ++s){
+                        uint64_t so = layout_seg(&L, s, &sl);
+                        segmap_set(&have, s);
+                        received += sl;
+                        if (leaf_fill) tree_note(&fm, leaf_fill, leaf_dig, so, sl);
+                    }
+                }
+                *(type == PKT_ZERO ? &zeroed : &copied) += e - a;
+                cum_ack = sack_advance(&have, cum_ack, total_segs);
+            }
+            pkt_hdr_t echo = { .type = type, .seq = h->seq, .len = htons(0) };
+            sendto(sock, &echo, sizeof(echo), 0, (struct sockaddr*)&peer, peerlen);
+            continue;
+        }
+
+        if (type == PKT_DATA && (features & FEAT_STREAM)){
+            if (seq == 0 || n < (ssize_t)data_off + len) continue;
+            int ok = 1;
+            if (features & FEAT_CRC32C){
+                uint32_t crc_net; memcpy(&crc_net, buf + HDR, sizeof(crc_net));
+                ok = crc32c(buf + data_off, len) == ntohl(crc_net);
+                if (!ok) crc_bad++;
+            }
+            stats_phase(PH_DATA);
+            uint32_t old_cum = sr.cum;
+            int dup = ok && !stream_put(&sr, seq, buf + data_off, len);
+            if (ok && !dup && sink == SINK_VERIFY && synth_check(buf + data_off, (uint64_t)(seq - 1) * sr.payload, len) != 0)
+                pattern_bad++;
+            if (dup) PROBE1(dup, seq);
+            else if (ok) PROBE3(data, seq, sr.written, len);
+            if (sr.cum != old_cum) PROBE2(cum_advance, old_cum, sr.cum);
+            xst.dup_data += (uint64_t)dup;
+            TRACE(TR_DATA_RX, seq, len, (uint64_t)dup);
+            send_ack_sack(sock, &peer, peerlen, sr.cum, stream_mask(&sr));
+            if (shm_page) shm_receiver(sock, 0, sr.written, 0);
+            continue;
+        }
+
+        if (type == PKT_END && (features & FEAT_STREAM)){
+            stats_phase(PH_TEARDOWN);
+            TRACE(TR_STATE, seq, TS_END, 0);
+            // seq = last seq + 1, payload = final size; ack the END itself once all is out
+            uint64_t size_net;
+            if (len != sizeof(size_net) || n < (ssize_t)(HDR + sizeof(size_net)) || seq == 0) continue;
+            memcpy(&size_net, buf + HDR, sizeof(size_net));
+            if (sr.cum + 1 == seq){
+                expected_total = ntohll(size_net);
+                received = sr.written;
+                finished = 1;
+                send_ack_sack(sock, &peer, peerlen, seq, 0);
+            } else {
+                send_ack_sack(sock, &peer, peerlen, sr.cum, stream_mask(&sr));
+            }
+            continue;
+        }
+
         if (type == PKT_DATA){
             if (seq == 0 || seq > total_segs){ /* ignore invalid */ }
             else {
-                if (!have[seq]){
-                    if (len > payload_max){ fprintf(stderr,"Bad DATA len\n"); continue; }
-                    uint64_t off = (uint64_t)(seq - 1) * (uint64_t)payload_max;
-                    // write into mmap at exact offset (works out-of-order)
-                    memcpy(fm.base + off, buf + HDR, len);
-                    received += len;
-                    have[seq] = 1;
-
-                    // advance cum_ack
-                    while (cum_ack < total_segs && have[cum_ack + 1]) cum_ack++;
-                }
+                stats_phase(PH_DATA);
+                TRACE(TR_DATA_RX, seq, len, (uint64_t)segmap_get(&have, seq));
+                if (segmap_get(&have, seq)){ xst.dup_data++; PROBE1(dup, seq); }
+                else {
+                    uint32_t seg_len;
+                    uint64_t off = layout_seg(&L, seq, &seg_len);
+                    uint32_t cz_word = 0, stored = 0, c = 0;
+                    if ((features & FEAT_COMPRESS) && n >= data_off){
+                        // this seq carries stored bytes [at, at+len) of chunk c
+                        memcpy(&cz_word, buf + data_off - CZ_HDR_LEN, sizeof(cz_word));
+                        cz_word = ntohl(cz_word);
+                        stored = cz_word & ~CZ_RAW;
+                        c = (seq - 1) / L.seg_per_chunk;
+                        uint32_t at = ((seq - 1) % L.seg_per_chunk) * L.sub_len, raw = cz_raw_len(&L, c);
+                        if (stored > raw || at >= stored || ((cz_word & CZ_RAW) && stored != raw)) seg_len = UINT32_MAX;
+                        else seg_len = MIN(L.sub_len, stored - at);
+                    }
+                    if (len != seg_len || n < (ssize_t)(data_off + len)){ fprintf(stderr,"Bad DATA len\n"); continue; }
+                    int ok = 1;
+                    if (features & FEAT_CRC32C){
+                        // covers everything after it: cz word (if any) and payload
+                        uint32_t crc_net; memcpy(&crc_net, buf + HDR, sizeof(crc_net));
+                        ok = crc32c(buf + HDR + DATA_CRC_LEN, (size_t)(data_off - HDR - DATA_CRC_LEN) + len) == ntohl(crc_net);
+                        if (!ok) crc_bad++;   // leave the gap; sender's RTO resends it
+                    }
+                    if (ok){
+                        // write into mmap at exact offset (works out-of-order)
+                        if (sink == SINK_FILE) memcpy(fm.base + off, buf + data_off, len);
+                        else if (sink == SINK_VERIFY && synth_check(buf + data_off, off, len) != 0) pattern_bad++;
+                        PROBE3(data, seq, off, len);
+                        segmap_set(&have, seq);
+                        if (!(features & FEAT_COMPRESS)){
+                            received += len;
+                            if (leaf_fill) tree_note(&fm, leaf_fill, leaf_dig, off, len);
+                        } else {
+                            uint32_t first = cz_first_seq(&L, c), last = cz_last_seq(&L, c);
+                            segmap_set_range(&have, first + cz_used_segs(&L, stored), (uint64_t)last + 1);
+                            if (segmap_next_zero(&have, first, last) > last){
+                                // whole chunk staged: decode in place, then account raw bytes
+                                uint64_t c_off = (uint64_t)c * L.chunk;
+                                uint32_t raw = cz_raw_len(&L, c);
+                                if (!(cz_word & CZ_RAW)){
+                                    memcpy(cz_stage, fm.base + c_off, stored);
+                                    if (lz4blk_decompress(cz_stage, (int)stored, fm.base + c_off, (int)raw) != (int)raw)
+                                        cz_bad++;     // left to the tree hash / END to catch
+                                }
+                                received += raw;
+                                if (leaf_fill) tree_note(&fm, leaf_fill, leaf_dig, c_off, raw);
+                            }
+                        }
 
-                // build sack mask for next 64 seqs beyond cum_ack
-                uint64_t mask = 0;
-                for (int i=0; i<64; ++i){
-                    uint32_t s = cum_ack + 1 + (uint32_t)i;
-                    if (s <= total_segs && have[s]) mask |= (1ULL << i);
+                        // advance cum_ack
+                        uint32_t old_cum = cum_ack;
+                        cum_ack = sack_advance(&have, cum_ack, total_segs);
+                        if (cum_ack != old_cum) PROBE2(cum_advance, old_cum, cum_ack);
+
+                        if ((features & FEAT_RESUME) && (seq & 255) == 0 &&
+                            now_s() - last_ckpt >= CKPT_INTERVAL_S){
+                            ckpt_write(ckpt_path, &ckpt, &have, &fm);
+                            last_ckpt = now_s();
+                        }
+                    }
                 }
+
+                // sack mask: the 64 have-bits right after cum_ack
+                uint64_t mask = sack_bits(&have, cum_ack);
                 send_ack_sack(sock, &peer, peerlen, cum_ack, mask);
+                if (shm_page) shm_receiver(sock, expected_total, received, 0);
             }
             continue;
         }
 
         if (type == PKT_END){
             // final ACK; if we already have all, well finish
-            uint64_t mask = 0;
-            for (int i=0; i<64; ++i){
-                uint32_t s = cum_ack + 1 + (uint32_t)i;
-                if (s <= total_segs && have[s]) mask |= (1ULL << i);
+            stats_phase(PH_TEARDOWN);
+            TRACE(TR_STATE, seq, TS_END, 0);
+            uint64_t mask = sack_bits(&have, cum_ack);
+            if (leaf_dig && cum_ack == total_segs){
+                // complete: compare roots and answer with ours
+                end_ack_payload_t ea = { { htonl(cum_ack), htonll(mask) }, {0} };
+                tree_build(leaf_dig, &tshape);
+                memcpy(ea.root, tree_at(leaf_dig, &tshape, tshape.nlev - 1, 0), BLAKE3_OUT_LEN);
+                verified = len == BLAKE3_OUT_LEN && n >= (ssize_t)(HDR + BLAKE3_OUT_LEN) &&
+                           memcmp(buf + HDR, ea.root, BLAKE3_OUT_LEN) == 0;
+                pkt_hdr_t ah = { .type = PKT_ACK, .seq = htonl(0), .len = htons(sizeof(ea)) };
+                struct iovec iov[2] = { { &ah, sizeof(ah) }, { &ea, sizeof(ea) } };
+                struct msghdr msg = {0};
+                msg.msg_iov = iov; msg.msg_iovlen = 2;
+                msg.msg_name = (void*)&peer; msg.msg_namelen = peerlen;
+                sendmsg(sock, &msg, 0);
+
+                if (!verified && repairs < MAX_REPAIR_ROUNDS){
+                    uint32_t *bad = malloc((size_t)tshape.cnt[0] * sizeof(uint32_t));
+                    if (!bad) die("alloc repair");
+                    repairs++;
+                    set_rcv_timeout(sock, REPAIR_RTO_MS);
+                    int64_t nbad = merkle_diff(sock, &peer, peerlen, &tshape, leaf_dig, L.payload, bad);
+                    uint32_t first = 0;
+                    for (int64_t i=0; i<nbad; ++i){
+                        // forget every segment touching the bad leaf; it will be sent again
+                        uint64_t a = (uint64_t)bad[i] * HASH_BLOCK;
+                        uint64_t b = MIN(a + HASH_BLOCK, expected_total);
+                        uint32_t s0 = layout_seq_at(&L, a), s1 = layout_seq_at(&L, b - 1);
+                        for (uint32_t s = s0; s <= s1; ++s){
+                            if (!segmap_clear(&have, s)) continue;
+                            uint32_t sl; uint64_t so = layout_seg(&L, s, &sl);
+                            received -= sl;
+                            tree_forget(expected_total, leaf_fill, so, sl);
+                        }
+                        if (!first || s0 < first) first = s0;
+                    }
+                    if (nbad > 0 && request_repair(sock, &peer, peerlen, bad, (uint32_t)nbad, L.payload) == 0){
+                        fprintf(stderr, "Repair round %d: %ld leaves differ, re-fetching from seq=%u\n",
+                                repairs, (long)nbad, first);
+                        cum_ack = MIN(cum_ack, first - 1);
+                    }
+                    set_rcv_timeout(sock, 0);
+                    free(bad);
+                }
+            } else {
+                send_ack_sack(sock, &peer, peerlen, cum_ack, mask);
             }
-            send_ack_sack(sock, &peer, peerlen, cum_ack, mask);
             if (cum_ack == total_segs) finished = 1;
             continue;
         }
     }
 
     double t1 = now_s();
+    TRACE(TR_STATE, 0, TS_DONE, 0);
     free(buf);
-    if (have) free(have);
+    segmap_free(&have);
+    free(leaf_fill); free(leaf_dig);
+    free(cz_stage);
+    uint32_t dd_put = 0;
+    if (dd && received == expected_total && verified != 0){
+        // add the chunks that travelled, checking each against its fingerprint
+        for (uint32_t k=0; k<dd_n; ++k){
+            uint8_t fp[BLAKE3_OUT_LEN];
+            blake3_hasher bh;
+            if (dd_state[k] != 1) continue;
+            blake3_init(&bh); blake3_update(&bh, fm.base + dd[k].off, dd[k].len); blake3_final(&bh, fp);
+            if (memcmp(fp, dd[k].fp, BLAKE3_OUT_LEN) == 0) dd_put += (uint32_t)store_put(store_dir, &dd[k], fm.base + dd[k].off);
+        }
+    }
+    free(dd); free(dd_state);
+    if (mf.got && !mf.left) multi_finish(&mf);
+    multi_free(&mf);
+    stream_close(&sr);
     fmap_close(&fm);
+    fmap_close(&basis);
+    if ((features & FEAT_RESUME) && received == expected_total && verified != 0) unlink(ckpt_path);
+    if ((features & FEAT_DELTA) && received == expected_total && verified != 0) unlink(basis_path);
 
+    if (shm_page) shm_receiver(sock, expected_total, received, 1);
+    if (stats_path) stats_json(stats_path, report, "receiver", received - resumed, t1 - t0);
     if (expected_total && received != expected_total){
         fprintf(stderr, "Receiver WARNING: size mismatch, expected %lu got %lu\n",
                 (unsigned long)expected_total, (unsigned long)received);
         return 1;
     }
     double secs = t1 - t0;
-    double bits = (double)received * 8.0;
-    printf("Receiver: got %lu bytes in %.3f s, avg %.3f Mb/s\n",
-           (unsigned long)received, secs, (bits/1e6)/secs);
+    double bits = (double)(received - resumed) * 8.0;
+    fprintf(report, "Receiver: got %lu bytes in %.3f s, avg %.3f Mb/s",
+            (unsigned long)(received - resumed), secs, (bits/1e6)/secs);
+    if (resumed) fprintf(report, ", resumed %lu", (unsigned long)resumed);
+    if (features & FEAT_CRC32C) fprintf(report, ", crc_bad=%lu", (unsigned long)crc_bad);
+    if (sink == SINK_NULL) fprintf(report, ", discarded");
+    if (sink == SINK_VERIFY) fprintf(report, ", pattern_bad=%lu", (unsigned long)pattern_bad);
+    if (features & FEAT_COMPRESS) fprintf(report, ", cz_bad=%lu", (unsigned long)cz_bad);
+    if (features & FEAT_SPARSE) fprintf(report, ", zeroed %lu", (unsigned long)zeroed);
+    if (features & FEAT_DELTA) fprintf(report, ", copied %lu", (unsigned long)copied);
+    if (features & FEAT_MULTI) fprintf(report, ", %u entries%s", mf.n, mf.bad ? " (some failed)" : "");
+    if (features & FEAT_DEDUP) fprintf(report, ", from store %lu, stored %u new chunks", (unsigned long)dd_filled, dd_put);
+    if (verified >= 0) fprintf(report, ", tree hash %s", verified ? "verified" : "MISMATCH");
+    fprintf(report, "\n");
+    if (verified == 0 || pattern_bad) return 1;
     return 0;
 }
@@ -1,25 +1,87 @@
 // udp_sender_lab.c
 // Reliable-UDP sender with Selective-Repeat + SACK and zero-copy-ish I/O.
-// Build: gcc -O2 -std=gnu11 -Wall -Wextra -o udp_sender_sack udp_sender_sack.c
-// Usage: ./udp_sender_sack <server_ip> <input_file> [--port P] [--mtu M] [--rto_ms MS] [--retries N] [--win W] [--zerocopy 1|0]
+// Build: gcc -O2 -std=gnu11 -Wall -Wextra -pthread -o udp_sender_sack udp_sender_sack.c
+//        (add -DCFTP_USE_LZ4 -llz4 to compress with the system liblz4)
+//        (add -DCFTP_IMPAIR for the --imp_* test impairments, see impair.h)
+// Usage: ./udp_sender_sack <server_ip> <input_file|dir|-|synthetic:SIZE> [--port P] [--mtu M|auto] [--mtu_max M] [--rto_ms MS] [--retries N] [--win W] [--zerocopy 1|0] [--chunk C] [--crc 1|0] [--hash 1|0] [--resume 1|0] [--compress 1|0] [--cz_threads N] [--sparse 1|0] [--delta 1|0] [--dedup 1|0] [--stream 1|0] [--follow MS] [--stats-json FILE|-] [--shm 1|0] [--trace FILE] [--source SPEC] [--prefetch_mb MB] [--drop_behind 1|0]
 // Notes: MSG_ZEROCOPY requires Linux >= 4.14; we fall back automatically.
+//        --chunk C (power of two, e.g. 4096/8192) keeps every chunk boundary
+//        page-aligned in both mmaps; layout is carried in START (see cftp_proto.h).
+//        --mtu auto probes the path (DF set) for the largest size <= --mtu_max.
+//        --crc 1 adds a CRC32C per DATA segment, verified by the receiver.
+//        --hash 1 hashes the file (tree hash, background thread) while sending and
+//        checks the root against the receiver's at END; on mismatch the receiver
+//        walks our Merkle tree and only the differing leaves are sent again.
+//        --resume 1 skips segments a --resume receiver still has from an earlier,
+//        interrupted run of the same file (size/inode/mtime identity in START).
+//        --compress 1 LZ4-compresses 64 KiB chunks in --cz_threads workers ahead of
+//        the send loop; chunks that would not save a segment go out raw.
+//        --sparse 1 sends holes (SEEK_HOLE) and all-zero runs as PKT_ZERO ranges
+//        instead of DATA; the receiver leaves them as holes in its output.
+//        --delta 1 matches the input against the receiver's existing copy of the
+//        file (rsync-style block signatures) and sends matching ranges as
+//        PKT_COPY references into that copy; only the rest goes out as DATA.
+//        --dedup 1 cuts the input into content-defined chunks and lists their
+//        fingerprints first; chunks a --store receiver already holds are not sent.
+//        If <input_file> is a directory its regular files and subdirectories go
+//        as one stream (FEAT_MULTI); a loader thread reads and maps the files
+//        in stream order while the first ones are already being sent.
+//        "-" (stdin), a pipe, or any file with --stream 1 is sent as a stream of
+//        unknown length (FEAT_STREAM) through a window-sized ring of buffers;
+//        END carries the final size. Only --crc applies in this mode.
+//        --follow MS (a regular file with --stream 1) sends a file that is still
+//        being written: at EOF it waits for more until MS pass without it
+//        growing or being written to (inotify); a writer closing it does not
+//        end the stream by itself, since it may reopen it to append.
+//        "synthetic:SIZE" (K/M/G/T suffixes; also as --source SPEC) sends SIZE
+//        bytes of a fixed pattern from memory instead of a file (see synth.h),
+//        to measure the protocol without the disk. A --sink verify-pattern
+//        receiver checks it.
+//        --prefetch_mb MB (default 32, 0 = off) keeps the next MB of the input
+//        past the send point on its way into the page cache (MADV_WILLNEED), so
+//        a cold file does not stall the send loop on major faults.
+//        --drop_behind 1 (also with --prefetch_mb 0) drops acked pages behind
+//        the window from the mapping and the page cache, so a huge file does
+//        not evict everything else; anything read again later (repair, the
+//        hash thread) is reread.
 
 #define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "cftp_proto.h"
+#include "sack.h"
+#include "crc32c.h"
+#include "blake3.h"
+#include "lz4blk.h"
+#include "delta.h"
+#include "dedup.h"
+#include "shmstats.h"
+#include "synth.h"
+#include "trace.h"
+#include "probes.h"
+#include "impair.h"          // may wrap send()/sendto()/sendmsg()
+#include "stats.h"           // last: counts every socket call
 
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
@@ -30,32 +92,15 @@
 #define DEFAULT_RTO_MS 400
 #define DEFAULT_RETRIES 50
 #define DEFAULT_WIN 64
-
-enum { PKT_DATA=0x01, PKT_START=0x02, PKT_END=0x03, PKT_ACK=0x10 };
-
-#pragma pack(push,1)
-typedef struct {
-    uint8_t  type;   // PKT_*
-    uint32_t seq;    // network order on wire (for DATA/END); for ACK we keep it 0
-    uint16_t len;    // payload len for DATA; sizeof(ack payload) for ACK; nw order
-} pkt_hdr_t; // 7 bytes
-#pragma pack(pop)
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t cum_ack;    // highest contiguous DATA seq received
-    uint64_t sack_mask;  // bits for next 64 seqs after cum_ack (bit0 = cum_ack+1)
-} ack_payload_t;
-#pragma pack(pop)
-
-static inline uint64_t htonll(uint64_t v){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return (((uint64_t)htonl(v & 0xffffffffULL)) << 32) | htonl((uint32_t)(v >> 32));
-#else
-    return v;
-#endif
-}
-static inline uint64_t ntohll(uint64_t v){ return htonll(v); }
+#define DEFAULT_MTU_MAX 9001
+#define PROBE_TRIES 3
+#define MAX_REPAIR_ROUNDS 3
+#define CZ_MAX_THREADS 8
+#define CZ_SKIP_AFTER 8       // incompressible chunks in a row before a worker backs off
+#define CZ_SKIP_PROBE 16      // ... and then only tries every 16th chunk
+#define RANGE_MIN_SEGS 4      // shorter zero/copy runs just go out as DATA
+#define RANGE_LOOKAHEAD 8192  // seqs classified ahead of next_to_send
+#define RANGE_INFLIGHT 32     // unconfirmed PKT_ZERO/PKT_COPY records
 
 static double now_s(void){
     struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -69,9 +114,16 @@ static void die(const char* msg){
 typedef struct {
     uint8_t *base;       // mmapped file base
     uint64_t size;       // file size
+    uint64_t id;         // identity of this file version (resume guard)
     int fd;
 } file_map_t;
 
+static uint64_t fnv1a64(uint64_t h, const void* p, size_t n){
+    const uint8_t* b = p;
+    for (size_t i=0; i<n; ++i){ h ^= b[i]; h *= 0x100000001b3ULL; }
+    return h;
+}
+
 static void fmap_open_ro(const char* path, file_map_t* m){
     struct stat st; memset(m,0,sizeof(*m));
     m->fd = open(path, O_RDONLY);
@@ -79,6 +131,12 @@ static void fmap_open_ro(const char* path, file_map_t* m){
     if (fstat(m->fd, &st) != 0) die("fstat");
     m->size = (uint64_t)st.st_size;
     if (m->size == 0){ fprintf(stderr,"Input file empty\n"); exit(1); }
+    uint64_t id = 0xcbf29ce484222325ULL;
+    id = fnv1a64(id, &st.st_dev, sizeof(st.st_dev));
+    id = fnv1a64(id, &st.st_ino, sizeof(st.st_ino));
+    id = fnv1a64(id, &st.st_size, sizeof(st.st_size));
+    id = fnv1a64(id, &st.st_mtim, sizeof(st.st_mtim));
+    m->id = id;
     m->base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->fd, 0);
     if (m->base == MAP_FAILED) die("mmap input");
 }
@@ -88,9 +146,1101 @@ static void fmap_close(file_map_t* m){
     if (m->fd >= 0) close(m->fd);
 }
 
+// Multi-file session (FEAT_MULTI). The regular files and directories under
+// the input directory are laid out in one stream (see cftp_proto.h) in an
+// anonymous region that stands in for the mapped file: small files are read
+// into it, large ones mapped over it in place. A loader thread fills it in
+// stream order, so the first files go out while later ones are still being
+// opened; readers wait for the bytes they need with multi_wait().
+typedef struct {
+    char *path;                  // relative to root
+    uint64_t off, size;
+    uint32_t mode;
+} mf_ent_t;
+
+typedef struct {
+    char *root;
+    mf_ent_t *ent;
+    uint32_t n, cap;
+    uint64_t total;
+    uint8_t *base;
+    uint64_t loaded;             // stream bytes [0, loaded) are in place
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    pthread_t th;
+} multi_t;
+
+static multi_t* mf_walk;         // nftw() has no user pointer
+
+static int mf_visit(const char* path, const struct stat* st, int flag, struct FTW* fw){
+    multi_t* m = mf_walk;
+    if (fw->level == 0 || (flag != FTW_F && flag != FTW_D)) return 0;   // root, symlinks, unreadable
+    if (flag == FTW_F && !S_ISREG(st->st_mode)) return 0;
+    const char* rel = path + strlen(m->root) + 1;
+    size_t plen = strlen(rel);
+    if (plen > 1024){ fprintf(stderr, "Skipping %s: path too long\n", path); return 0; }
+    if (m->n == MULTI_MAX_ENT){ fprintf(stderr, "Too many entries under %s\n", m->root); exit(1); }
+    if (m->n == m->cap){
+        m->cap = m->cap ? 2 * m->cap : 1024;
+        m->ent = realloc(m->ent, m->cap * sizeof(mf_ent_t));
+        if (!m->ent) die("alloc manifest");
+    }
+    mf_ent_t* e = &m->ent[m->n++];
+    e->path = strdup(rel);
+    if (!e->path) die("alloc manifest");
+    e->mode = (uint32_t)st->st_mode;
+    e->size = S_ISREG(st->st_mode) ? (uint64_t)st->st_size : 0;
+    e->off = m->total;
+    m->total = e->off + e->size;
+    if (e->size > MULTI_PACK_MAX){           // whole pages of its own
+        e->off = (e->off + MULTI_ALIGN - 1) / MULTI_ALIGN * MULTI_ALIGN;
+        m->total = (e->off + e->size + MULTI_ALIGN - 1) / MULTI_ALIGN * MULTI_ALIGN;
+    }
+    return 0;
+}
+
+static void* multi_loader(void* arg){
+    multi_t* m = arg;
+    char path[4096 + 1024 + 2];
+    for (uint32_t i=0; i<m->n; ++i){
+        mf_ent_t* e = &m->ent[i];
+        if (e->size){
+            snprintf(path, sizeof(path), "%s/%s", m->root, e->path);
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) perror(path);          // left as zeros
+            else {
+                if (e->size <= MULTI_PACK_MAX ||
+                    mmap(m->base + e->off, e->size, PROT_READ, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED){
+                    for (uint64_t got = 0; got < e->size; ){
+                        ssize_t r = pread(fd, m->base + e->off + got, e->size - got, (off_t)got);
+                        if (r <= 0) break;     // shrank since the walk: rest stays zero
+                        got += (uint64_t)r;
+                    }
+                }
+                close(fd);
+            }
+        }
+        pthread_mutex_lock(&m->mu);
+        __atomic_store_n(&m->loaded, e->off + e->size, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&m->cv);
+        pthread_mutex_unlock(&m->mu);
+    }
+    pthread_mutex_lock(&m->mu);
+    __atomic_store_n(&m->loaded, m->total, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&m->cv);
+    pthread_mutex_unlock(&m->mu);
+    return NULL;
+}
+
+// Blocks until stream bytes [0, end) are loaded; a no-op for single files.
+static void multi_wait(multi_t* m, uint64_t end){
+    if (!m || !m->base || __atomic_load_n(&m->loaded, __ATOMIC_ACQUIRE) >= end) return;
+    pthread_mutex_lock(&m->mu);
+    while (m->loaded < end) pthread_cond_wait(&m->cv, &m->mu);
+    pthread_mutex_unlock(&m->mu);
+}
+
+// Walks root, reserves the stream and starts the loader; fm then describes
+// the stream like a mapped file (no fd).
+static void multi_open(const char* root, multi_t* m, file_map_t* fm){
+    memset(m, 0, sizeof(*m));
+    char* r = strdup(root);
+    if (!r) die("alloc manifest");
+    for (size_t n = strlen(r); n > 1 && r[n-1] == '/'; ) r[--n] = 0;
+    m->root = r;
+    mf_walk = m;
+    if (nftw(root, mf_visit, 64, FTW_PHYS) != 0) die("walk input");
+    if (m->total == 0) m->total = 1;           // nothing but empty files
+    m->base = mmap(NULL, m->total, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (m->base == MAP_FAILED) die("mmap stream");
+    pthread_mutex_init(&m->mu, NULL);
+    pthread_cond_init(&m->cv, NULL);
+    if (pthread_create(&m->th, NULL, multi_loader, m) != 0) die("pthread_create");
+    memset(fm, 0, sizeof(*fm));
+    fm->base = m->base; fm->size = m->total; fm->fd = -1;
+}
+
+static void multi_close(multi_t* m){
+    if (!m->base) return;
+    pthread_join(m->th, NULL);
+    for (uint32_t i=0; i<m->n; ++i) free(m->ent[i].path);
+    free(m->ent); free(m->root);
+}
+
+// Pushes the manifest, up to win batches outstanding. Returns 0 once every
+// batch is echoed (the receiver has created every file), -1 on timeout.
+static int push_manifest(int sock, const seg_layout_t* L, const multi_t* m, int win, int retries){
+    const size_t HDR = sizeof(pkt_hdr_t);
+    uint32_t *first = malloc(((size_t)m->n + 1) * sizeof(uint32_t)), nbatch = 0;
+    uint8_t *wbuf = malloc(HDR + L->payload), *got;
+    if (!first || !wbuf) die("alloc manifest");
+    for (uint32_t i=0; i<m->n || !nbatch; ){
+        // as many entries as fit one payload (an empty manifest is one empty batch)
+        size_t used = sizeof(uint32_t);
+        first[nbatch++] = i;
+        while (i < m->n && used + sizeof(manifest_ent_t) + strlen(m->ent[i].path) <= L->payload)
+            used += sizeof(manifest_ent_t) + strlen(m->ent[i++].path);
+        if (used == sizeof(uint32_t) && i < m->n){ fprintf(stderr, "Manifest entry too large\n"); exit(1); }
+    }
+    first[nbatch] = m->n;
+    if (!(got = calloc(nbatch, 1))) die("alloc manifest");
+
+    uint32_t left = nbatch;
+    int idle = 0;
+    while (left && idle < retries){
+        int sent = 0, progress = 0;
+        for (uint32_t k=0; k<nbatch && sent<win; ++k){
+            if (got[k]) continue;
+            size_t len = sizeof(uint32_t);
+            uint32_t cnt = htonl(m->n);
+            memcpy(wbuf + HDR, &cnt, sizeof(cnt));
+            for (uint32_t i=first[k]; i<first[k+1]; ++i){
+                const mf_ent_t* e = &m->ent[i];
+                uint16_t pl = (uint16_t)strlen(e->path);
+                manifest_ent_t me = { htonll(e->off), htonll(e->size), htonl(e->mode), htons(pl) };
+                memcpy(wbuf + HDR + len, &me, sizeof(me));
+                memcpy(wbuf + HDR + len + sizeof(me), e->path, pl);
+                len += sizeof(me) + pl;
+            }
+            pkt_hdr_t h = { .type = PKT_MANIFEST, .seq = htonl(first[k]), .len = htons((uint16_t)len) };
+            memcpy(wbuf, &h, HDR);
+            if (send(sock, wbuf, HDR + len, 0) < 0) perror("send MANIFEST");
+            sent++;
+        }
+        uint8_t abuf[64];
+        ssize_t r;
+        while (left && progress < sent && (r = recv(sock, abuf, sizeof(abuf), 0)) >= 0){
+            pkt_hdr_t *h = (pkt_hdr_t*)abuf;
+            if (r < (ssize_t)HDR || h->type != PKT_MANIFEST) continue;
+            uint32_t s = ntohl(h->seq);
+            for (uint32_t k=0; k<nbatch; ++k){
+                if (first[k] != s || got[k]) continue;
+                got[k] = 1; left--; progress++;
+                break;
+            }
+        }
+        idle = progress ? 0 : idle + 1;
+    }
+    free(first); free(wbuf); free(got);
+    return left ? -1 : 0;
+}
+
+// Simplified DPLPMTUD (RFC 8899): with IP_PMTUDISC_PROBE the kernel sets DF and
+// ignores its cached path MTU, so a padded probe either reaches the receiver
+// intact or is dropped. Common plateaus are tried largest-first and the first
+// one the receiver echoes wins. Probes use the DATA send flags so local limits
+// (e.g. MSG_ZEROCOPY frag caps) show up here as EMSGSIZE rather than mid-transfer.
+// Returns the MTU, or 0 if nothing was echoed.
+static int pmtu_discover(int sock, int mtu_max, int send_flags){
+    static const int plateaus[] = { 9001, 9000, 4352, 1500, 1492, 1280, 576 };
+    const int IP_UDP = 28, HDR = (int)sizeof(pkt_hdr_t);
+    int v = IP_PMTUDISC_PROBE;
+    if (setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &v, sizeof(v)) != 0){
+        perror("IP_MTU_DISCOVER"); return 0;
+    }
+    uint8_t *pad = calloc((size_t)mtu_max, 1);
+    if (!pad) die("alloc probe");
+
+    int cands[1 + sizeof(plateaus)/sizeof(plateaus[0])], nc = 0;
+    cands[nc++] = mtu_max;
+    for (size_t i=0; i<sizeof(plateaus)/sizeof(plateaus[0]); ++i)
+        if (plateaus[i] < mtu_max) cands[nc++] = plateaus[i];
+
+    uint32_t id = 0;
+    int found = 0;
+    for (int c=0; c<nc && !found; ++c){
+        int plen = cands[c] - IP_UDP - HDR;
+        for (int t=0; t<PROBE_TRIES && !found; ++t){
+            pkt_hdr_t h; h.type = PKT_PROBE; h.seq = htonl(++id); h.len = htons((uint16_t)plen);
+            struct iovec iov[2] = { { &h, sizeof(h) }, { pad, (size_t)plen } };
+            struct msghdr msg = {0};
+            msg.msg_iov = iov; msg.msg_iovlen = 2;
+            if (sendmsg(sock, &msg, send_flags) < 0){
+                if (errno == EMSGSIZE) break;      // larger than the local link
+                perror("send PROBE"); continue;
+            }
+            // wait for this id's echo; late echoes of earlier probes are skipped
+            uint8_t abuf[64];
+            ssize_t r;
+            while ((r = recv(sock, abuf, sizeof(abuf), 0)) >= 0){
+                pkt_hdr_t *ah = (pkt_hdr_t*)abuf;
+                if (r >= (ssize_t)sizeof(pkt_hdr_t) && ah->type == PKT_PROBE && ntohl(ah->seq) == id){
+                    found = cands[c]; break;
+                }
+            }
+        }
+    }
+    free(pad);
+    if (!found){
+        v = IP_PMTUDISC_WANT;
+        setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &v, sizeof(v));
+    }
+    return found;
+}
+
+// Tree hash of the whole input, computed off the send path. The full tree is
+// kept so the receiver can walk it if the roots disagree.
+typedef struct {
+    const uint8_t *base;
+    uint64_t size;
+    multi_t *mf;
+    tree_shape_t shape;
+    uint8_t *nodes;
+    uint8_t root[BLAKE3_OUT_LEN];
+} tree_job_t;
+
+static void* tree_worker(void* arg){
+    tree_job_t* j = arg;
+    tree_shape(tree_leaves(j->size), &j->shape);
+    j->nodes = malloc((size_t)j->shape.total * BLAKE3_OUT_LEN);
+    if (!j->nodes) die("alloc tree");
+    for (uint32_t i=0; i<j->shape.cnt[0]; ++i){
+        uint64_t off = (uint64_t)i * HASH_BLOCK;
+        multi_wait(j->mf, MIN(off + HASH_BLOCK, j->size));
+        tree_leaf(j->base + off, (size_t)MIN((uint64_t)HASH_BLOCK, j->size - off),
+                  tree_at(j->nodes, &j->shape, 0, i));
+    }
+    tree_build(j->nodes, &j->shape);
+    memcpy(j->root, tree_at(j->nodes, &j->shape, j->shape.nlev - 1, 0), BLAKE3_OUT_LEN);
+    return NULL;
+}
+
+// After a root mismatch the receiver walks our tree (TREE_REQ) and then lists
+// the leaves it wants again (REPAIR batches, closed by an empty one). Marks the
+// segments of those leaves unacked and returns the lowest such seq, or 0 if
+// the receiver went quiet or asked for nothing.
+static uint32_t serve_repair(int sock, const seg_layout_t* L, const tree_job_t* tj,
+                             segmap_t* acked, int retries){
+    const size_t HDR = sizeof(pkt_hdr_t);
+    size_t cap = HDR + L->payload;
+    uint8_t *rbuf = malloc(cap), *wbuf = malloc(cap);
+    if (!rbuf || !wbuf) die("alloc repair");
+    uint32_t lowest = 0;
+    int idle = 0, done = 0;
+
+    while (!done && idle < retries){
+        ssize_t r = recv(sock, rbuf, cap, 0);
+        if (r < (ssize_t)HDR){ idle++; continue; }
+        idle = 0;
+        pkt_hdr_t *h = (pkt_hdr_t*)rbuf;
+        uint16_t len = ntohs(h->len);
+        if (r < (ssize_t)(HDR + len)) continue;
+
+        if (h->type == PKT_TREE_REQ && len == sizeof(tree_req_t)){
+            tree_req_t q; memcpy(&q, rbuf + HDR, sizeof(q));
+            uint32_t first = ntohl(q.first), count = ntohs(q.count);
+            uint32_t fit = (uint32_t)((L->payload - sizeof(q)) / BLAKE3_OUT_LEN);
+            if (q.level >= tj->shape.nlev || first >= tj->shape.cnt[q.level]) continue;
+            count = MIN(count, MIN(fit, tj->shape.cnt[q.level] - first));
+            q.count = htons((uint16_t)count);
+            pkt_hdr_t *oh = (pkt_hdr_t*)wbuf;
+            oh->type = PKT_TREE_RSP; oh->seq = htonl(0);
+            oh->len = htons((uint16_t)(sizeof(q) + (size_t)count * BLAKE3_OUT_LEN));
+            memcpy(wbuf + HDR, &q, sizeof(q));
+            memcpy(wbuf + HDR + sizeof(q), tree_at(tj->nodes, &tj->shape, q.level, first),
+                   (size_t)count * BLAKE3_OUT_LEN);
+            if (send(sock, wbuf, HDR + ntohs(oh->len), 0) < 0) perror("send TREE_RSP");
+        } else if (h->type == PKT_REPAIR){
+            for (uint16_t i=0; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)){
+                uint32_t leaf; memcpy(&leaf, rbuf + HDR + i, sizeof(leaf));
+                leaf = ntohl(leaf);
+                if (leaf >= tj->shape.cnt[0]) continue;
+                uint64_t a = (uint64_t)leaf * HASH_BLOCK;
+                uint64_t b = MIN(a + HASH_BLOCK, L->total);
+                uint32_t s0 = layout_seq_at(L, a), s1 = layout_seq_at(L, b - 1);
+                for (uint32_t s = s0; s <= s1; ++s) segmap_clear(acked, s);
+                if (!lowest || s0 < lowest) lowest = s0;
+            }
+            pkt_hdr_t echo = { .type = PKT_REPAIR, .seq = h->seq, .len = htons(0) };
+            if (send(sock, &echo, sizeof(echo), 0) < 0) perror("send REPAIR echo");
+            if (len == 0) done = 1;
+        }
+    }
+    free(rbuf); free(wbuf);
+    return done ? lowest : 0;
+}
+
+// Pulls the receiver's have-map (RESUME_REQ/RESUME_MAP) into acked.
+// Returns the number of segments it already holds, or -1 on timeout.
+static int64_t pull_resume_map(int sock, const seg_layout_t* L, segmap_t* acked, int retries){
+    const size_t HDR = sizeof(pkt_hdr_t);
+    size_t cap = HDR + L->payload;
+    uint8_t *rbuf = malloc(cap);
+    if (!rbuf) die("alloc resume");
+    uint32_t from = 1;
+    while (from <= L->total_segs){
+        pkt_hdr_t q = { .type = PKT_RESUME_REQ, .seq = htonl(from), .len = htons(0) };
+        uint32_t next = 0;
+        for (int t=0; t<retries && !next; ++t){
+            if (send(sock, &q, sizeof(q), 0) < 0) perror("send RESUME_REQ");
+            ssize_t r;
+            while (!next && (r = recv(sock, rbuf, cap, 0)) >= 0){
+                pkt_hdr_t *h = (pkt_hdr_t*)rbuf;
+                uint16_t len = ntohs(h->len);
+                if (r < (ssize_t)HDR || h->type != PKT_RESUME_MAP || ntohl(h->seq) != from) continue;
+                if (len < sizeof(uint32_t) || r < (ssize_t)(HDR + len)) continue;
+                uint32_t nn; memcpy(&nn, rbuf + HDR, sizeof(nn));
+                nn = ntohl(nn);
+                uint32_t end = rle_decode(rbuf + HDR + sizeof(nn), len - sizeof(nn), from, L->total_segs, acked);
+                if (end != nn || nn <= from) continue;   // malformed or no progress
+                next = nn;
+            }
+        }
+        if (!next){ free(rbuf); return -1; }
+        from = next;
+    }
+    free(rbuf);
+    return (int64_t)segmap_count(acked) - 1;   // seq 0 is always set
+}
+
+// Compression stage (FEAT_COMPRESS). Workers compress chunks ahead of the send
+// loop into a ring of nslot buffers; the slot of chunk c is reused once base
+// has passed all of c's seqs (c < released). Raw chunks point into the mmap.
+typedef struct {
+    uint32_t chunk;          // chunk held; valid while ready
+    uint32_t stored;         // bytes sent for it
+    int raw, ready;
+    const uint8_t *data;     // stored bytes: buf, or the mmap when raw
+    uint8_t *buf;
+} cz_slot_t;
+
+typedef struct {
+    const uint8_t *base;
+    const seg_layout_t *L;
+    multi_t *mf;
+    uint32_t nchunks, nslot;
+    cz_slot_t *slot;
+    uint32_t next;           // next chunk a worker claims
+    uint32_t released;       // chunks below this are fully acked
+    int busy, stop;
+    pthread_mutex_t mu;
+    pthread_cond_t ready, space;
+} cz_pool_t;
+
+static void cz_fill(const cz_pool_t* p, uint32_t c, int try_it, cz_slot_t* s){
+    uint32_t raw = cz_raw_len(p->L, c);
+    const uint8_t* src = p->base + (uint64_t)c * p->L->chunk;
+    multi_wait(p->mf, (uint64_t)c * p->L->chunk + raw);
+    // only worth it if at least one DATA segment is saved
+    int cap = (int)((cz_used_segs(p->L, raw) - 1) * p->L->sub_len);
+    int n = (try_it && cap > 0) ? lz4blk_compress(src, (int)raw, s->buf, cap) : 0;
+    if (n > 0){ s->stored = (uint32_t)n; s->raw = 0; s->data = s->buf; }
+    else      { s->stored = raw;         s->raw = 1; s->data = src; }
+}
+
+static void* cz_worker(void* arg){
+    cz_pool_t* p = arg;
+    uint32_t misses = 0, skipped = 0;
+    pthread_mutex_lock(&p->mu);
+    for (;;){
+        while (!p->stop && (p->next >= p->nchunks || p->next >= p->released + p->nslot))
+            pthread_cond_wait(&p->space, &p->mu);
+        if (p->stop) break;
+        uint32_t c = p->next++;
+        cz_slot_t* s = &p->slot[c % p->nslot];
+        s->chunk = c; s->ready = 0;
+        p->busy++;
+        pthread_mutex_unlock(&p->mu);
+
+        int try_it = misses < CZ_SKIP_AFTER || ++skipped % CZ_SKIP_PROBE == 0;
+        cz_fill(p, c, try_it, s);
+        if (try_it) misses = s->raw ? misses + 1 : 0;
+
+        pthread_mutex_lock(&p->mu);
+        s->ready = 1; p->busy--;
+        pthread_cond_broadcast(&p->ready);
+    }
+    pthread_mutex_unlock(&p->mu);
+    return NULL;
+}
+
+// Blocks until chunk c (c >= released) is compressed.
+static const cz_slot_t* cz_get(cz_pool_t* p, uint32_t c){
+    cz_slot_t* s = &p->slot[c % p->nslot];
+    pthread_mutex_lock(&p->mu);
+    while (!(s->ready && s->chunk == c)) pthread_cond_wait(&p->ready, &p->mu);
+    pthread_mutex_unlock(&p->mu);
+    return s;
+}
+
+static void cz_release(cz_pool_t* p, uint32_t upto){
+    pthread_mutex_lock(&p->mu);
+    if (upto > p->released){
+        p->released = upto;
+        if (p->next < upto){
+            // chunks already acked (resume, dedup, repair rounds): let the
+            // workers finish the slots they hold before handing them out again
+            while (p->busy) pthread_cond_wait(&p->ready, &p->mu);
+            p->next = upto;
+        }
+        pthread_cond_broadcast(&p->space);
+    }
+    pthread_mutex_unlock(&p->mu);
+}
+
+// Restarts the workers at chunk c (repair rounds).
+static void cz_rewind(cz_pool_t* p, uint32_t c){
+    pthread_mutex_lock(&p->mu);
+    while (p->busy) pthread_cond_wait(&p->ready, &p->mu);
+    p->next = p->released = c;
+    for (uint32_t i=0; i<p->nslot; ++i) p->slot[i].ready = 0;
+    pthread_cond_broadcast(&p->space);
+    pthread_mutex_unlock(&p->mu);
+}
+
+// Delta transfer (FEAT_DELTA). The receiver's block signatures are pulled
+// with up to win DELTA_REQs outstanding, then the whole input is matched
+// against them once, before the send loop, into runs of input bytes that the
+// receiver can copy from its basis.
+typedef struct {
+    uint64_t dst, src, len;      // input [dst, dst+len) == basis [src, src+len)
+} delta_run_t;
+
+typedef struct {
+    uint32_t block_len, nblocks;
+    uint32_t *weak;
+    uint64_t *strong;
+    delta_run_t *run;
+    size_t nrun;
+} delta_t;
+
+// Returns 0 once every signature arrived, -1 on timeout.
+static int pull_delta_sigs(int sock, const seg_layout_t* L, delta_t* d, int win, int retries){
+    const size_t HDR = sizeof(pkt_hdr_t);
+    const uint32_t fit = (uint32_t)((L->payload - sizeof(delta_sig_hdr_t)) / sizeof(delta_sig_t));
+    size_t cap = HDR + L->payload;
+    uint8_t *rbuf = malloc(cap), *got = NULL;
+    if (!rbuf) die("alloc delta");
+    uint32_t nbatch = 1, left = 1;
+    int idle = 0, empty = 0;               // empty: receiver has no basis
+    while (left && !empty && idle < retries){
+        int sent = 0;
+        for (uint32_t k=0; k<nbatch && sent<win; ++k){
+            if (got && got[k]) continue;
+            pkt_hdr_t q = { .type = PKT_DELTA_REQ, .seq = htonl(k * fit), .len = htons(0) };
+            if (send(sock, &q, sizeof(q), 0) < 0) perror("send DELTA_REQ");
+            sent++;
+        }
+        int progress = 0;
+        ssize_t r;
+        while (left && progress < sent && (r = recv(sock, rbuf, cap, 0)) >= 0){
+            pkt_hdr_t *h = (pkt_hdr_t*)rbuf;
+            uint16_t len = ntohs(h->len);
+            if (r < (ssize_t)HDR || h->type != PKT_DELTA_SIG || r < (ssize_t)(HDR + len)) continue;
+            if (len < sizeof(delta_sig_hdr_t)) continue;
+            delta_sig_hdr_t sh; memcpy(&sh, rbuf + HDR, sizeof(sh));
+            uint32_t first = ntohl(h->seq), n = (len - sizeof(sh)) / sizeof(delta_sig_t);
+            if (!got){
+                // the first answer sizes the table
+                d->block_len = ntohl(sh.block_len);
+                d->nblocks = ntohl(sh.nblocks);
+                if (!d->block_len || !d->nblocks){ empty = 1; break; }
+                nbatch = left = (d->nblocks + fit - 1) / fit;
+                got = calloc(nbatch, 1);
+                d->weak = malloc((size_t)d->nblocks * sizeof(uint32_t));
+                d->strong = malloc((size_t)d->nblocks * sizeof(uint64_t));
+                if (!got || !d->weak || !d->strong) die("alloc delta");
+            }
+            if (first % fit || first / fit >= nbatch || got[first / fit]) continue;
+            if (n != MIN(fit, d->nblocks - first)) continue;
+            for (uint32_t i=0; i<n; ++i){
+                delta_sig_t sg; memcpy(&sg, rbuf + HDR + sizeof(sh) + (size_t)i * sizeof(sg), sizeof(sg));
+                d->weak[first + i] = ntohl(sg.weak);
+                d->strong[first + i] = ntohll(sg.strong);
+            }
+            got[first / fit] = 1; left--; progress++;
+        }
+        idle = progress ? 0 : idle + 1;
+    }
+    free(rbuf); free(got);
+    return (d->nblocks && !left) ? 0 : -1;
+}
+
+// Finds input blocks that occur in the basis: at every offset the rolling
+// weak sum is looked up in a chained hash table (behind a 64 Ki-bit filter)
+// and hits are confirmed with the strong hash. A match skips a whole block;
+// matches that continue the previous run in both files extend it.
+static void delta_match(delta_t* d, const uint8_t* p, uint64_t n){
+    const uint32_t B = d->block_len, nb = d->nblocks;
+    uint32_t hbits = 1;
+    while ((1u << hbits) < 2 * nb) hbits++;
+    uint32_t hmask = (1u << hbits) - 1;
+    uint32_t *head = malloc(((size_t)hmask + 1) * sizeof(uint32_t));
+    uint32_t *next = malloc((size_t)nb * sizeof(uint32_t));
+    uint64_t *tag = calloc(1024, sizeof(uint64_t));
+    if (!head || !next || !tag) die("alloc delta");
+    memset(head, 0xff, ((size_t)hmask + 1) * sizeof(uint32_t));
+    for (uint32_t k=nb; k-- > 0; ){          // chains keep basis order
+        uint32_t w = d->weak[k], h = (w * 2654435761u) >> (32 - hbits);
+        next[k] = head[h & hmask]; head[h & hmask] = k;
+        tag[(w >> 16) >> 6] |= 1ULL << ((w >> 16) & 63);
+    }
+
+    size_t cap = 0;
+    uint64_t i = 0;
+    delta_roll_t r;
+    if (n >= B) delta_roll_init(&r, p, B);
+    while (i + B <= n){
+        uint32_t w = delta_roll_sum(&r), hit = UINT32_MAX;
+        if ((tag[(w >> 16) >> 6] >> ((w >> 16) & 63)) & 1){
+            uint32_t h = ((w * 2654435761u) >> (32 - hbits)) & hmask;
+            uint64_t st = 0, want = UINT64_MAX;
+            int have_st = 0;
+            if (d->nrun){
+                delta_run_t* lr = &d->run[d->nrun - 1];
+                if (lr->dst + lr->len == i) want = lr->src + lr->len;
+            }
+            for (uint32_t k = head[h]; k != UINT32_MAX; k = next[k]){
+                if (d->weak[k] != w) continue;
+                if (!have_st){ st = delta_strong(p + i, B); have_st = 1; }
+                if (d->strong[k] != st) continue;
+                hit = k;
+                if ((uint64_t)k * B == want) break;   // prefer extending the run
+            }
+        }
+        if (hit != UINT32_MAX){
+            uint64_t src = (uint64_t)hit * B;
+            delta_run_t* lr = d->nrun ? &d->run[d->nrun - 1] : NULL;
+            if (lr && lr->dst + lr->len == i && lr->src + lr->len == src){
+                lr->len += B;
+            } else {
+                if (d->nrun == cap){
+                    cap = cap ? 2 * cap : 1024;
+                    d->run = realloc(d->run, cap * sizeof(delta_run_t));
+                    if (!d->run) die("alloc delta");
+                }
+                d->run[d->nrun++] = (delta_run_t){ i, src, B };
+            }
+            i += B;
+            if (i + B <= n) delta_roll_init(&r, p + i, B);
+            continue;
+        }
+        if (i + B == n) break;
+        delta_roll(&r, p[i], p[i + B]);
+        i++;
+    }
+    free(head); free(next); free(tag);
+}
+
+// Chunk store dedup (FEAT_DEDUP). Lists every chunk with up to win
+// DEDUP_QUERYs outstanding, then marks acked what the runs of chunks the
+// receiver filled from its store cover. Returns the bytes it filled, or -1
+// on timeout.
+static int64_t query_dedup(int sock, const seg_layout_t* L, const dedup_chunk_t* ch, uint32_t nc,
+                           uint32_t spc, segmap_t* acked, int win, int retries){
+    const size_t HDR = sizeof(pkt_hdr_t);
+    const uint32_t fit = (uint32_t)((L->payload - sizeof(dedup_query_hdr_t)) / sizeof(dedup_ent_t));
+    const uint32_t nbatch = (nc + fit - 1) / fit;
+    size_t cap = HDR + L->payload;
+    uint8_t *rbuf = malloc(cap), *wbuf = malloc(cap), *got = calloc(nbatch, 1), *has = calloc(nc, 1);
+    if (!rbuf || !wbuf || !got || !has) die("alloc dedup");
+    uint32_t left = nbatch;
+    int idle = 0;
+    while (left && idle < retries){
+        int sent = 0, progress = 0;
+        for (uint32_t k=0; k<nbatch && sent<win; ++k){
+            if (got[k]) continue;
+            uint32_t first = k * fit, cnt = MIN(fit, nc - first);
+            dedup_query_hdr_t qh = { htonll(ch[first].off), htonl(nc) };
+            pkt_hdr_t q = { .type = PKT_DEDUP_QUERY, .seq = htonl(first),
+                            .len = htons((uint16_t)(sizeof(qh) + (size_t)cnt * sizeof(dedup_ent_t))) };
+            memcpy(wbuf, &q, HDR);
+            memcpy(wbuf + HDR, &qh, sizeof(qh));
+            for (uint32_t i=0; i<cnt; ++i){
+                dedup_ent_t de = { htonl(ch[first + i].len), {0} };
+                memcpy(de.fp, ch[first + i].fp, sizeof(de.fp));
+                memcpy(wbuf + HDR + sizeof(qh) + (size_t)i * sizeof(de), &de, sizeof(de));
+            }
+            if (send(sock, wbuf, HDR + ntohs(q.len), 0) < 0) perror("send DEDUP_QUERY");
+            sent++;
+        }
+        ssize_t r;
+        while (left && progress < sent && (r = recv(sock, rbuf, cap, 0)) >= 0){
+            pkt_hdr_t *h = (pkt_hdr_t*)rbuf;
+            uint16_t len = ntohs(h->len);
+            uint32_t first = ntohl(h->seq), k = first / fit;
+            if (r < (ssize_t)HDR || h->type != PKT_DEDUP_HAVE || r < (ssize_t)(HDR + len)) continue;
+            if (first % fit || k >= nbatch || got[k]) continue;
+            uint32_t cnt = MIN(fit, nc - first);
+            if (len != (cnt + 7) / 8) continue;
+            for (uint32_t i=0; i<cnt; ++i) has[first + i] = (rbuf[HDR + (i >> 3)] >> (i & 7)) & 1;
+            got[k] = 1; left--; progress++;
+        }
+        idle = progress ? 0 : idle + 1;
+    }
+    int64_t filled = left ? -1 : 0;
+    for (uint32_t k=0; !left && k<nc; ){
+        if (!has[k]){ k++; continue; }
+        uint32_t hi = k, s0, s1;
+        while (hi + 1 < nc && has[hi + 1]) hi++;
+        dedup_cover(L, spc, ch[k].off, ch[hi].off + ch[hi].len, &s0, &s1);
+        if (s0 <= s1) segmap_set_range(acked, s0, (uint64_t)s1 + 1);
+        for (; k <= hi; ++k) filled += ch[k].len;
+    }
+    free(rbuf); free(wbuf); free(got); free(has);
+    return filled;
+}
+
+// Zero and copy ranges (FEAT_SPARSE, FEAT_DELTA). Units (segments, or whole
+// chunks with FEAT_COMPRESS) are classified a bounded distance ahead of the
+// send loop. Holes come from SEEK_DATA/SEEK_HOLE without touching the pages,
+// other data goes through a zero scan, and with FEAT_DELTA units inside a
+// matched run become copies. Runs of like units go out as PKT_ZERO/PKT_COPY
+// records, which are resent on RTO until echoed.
+static int is_zero_sw(const uint8_t* p, size_t n){
+    for (; n >= 64; p += 64, n -= 64){
+        uint64_t w[8]; memcpy(w, p, sizeof(w));
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) return 0;
+    }
+    while (n--) if (*p++) return 0;
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int is_zero_avx2(const uint8_t* p, size_t n){
+    for (; n >= 128; p += 128, n -= 128){
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)p),
+                                    _mm256_loadu_si256((const __m256i*)(p + 32)));
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + 64)),
+                                    _mm256_loadu_si256((const __m256i*)(p + 96)));
+        a = _mm256_or_si256(a, b);
+        if (!_mm256_testz_si256(a, a)) return 0;
+    }
+    return is_zero_sw(p, n);
+}
+#endif
+
+static int (*is_zero)(const uint8_t*, size_t) = is_zero_sw;
+
+typedef struct {
+    uint8_t type;                // PKT_ZERO or PKT_COPY
+    uint32_t first, count;
+    uint64_t src;                // PKT_COPY: basis offset of first
+    double ts;
+    int tx;
+} range_rec_t;
+
+typedef struct {
+    int fd;
+    const uint8_t *base;
+    const seg_layout_t *L;
+    multi_t *mf;
+    int sparse;                  // FEAT_SPARSE: look for zeros
+    const delta_t *delta;        // FEAT_DELTA: matched runs, else NULL
+    size_t ri;                   // first run that may still cover scan
+    uint32_t unit;               // seqs per unit: 1, or seg_per_chunk
+    uint32_t scan;               // next seq to classify (start of a unit)
+    uint64_t ext_lo, ext_hi;     // cached extent [lo, hi) ...
+    int ext_hole;                // ... and whether it is a hole
+    uint8_t run_type;            // run being collected: PKT_ZERO/PKT_COPY, 0 = none
+    uint32_t run_first, run_len;
+    uint64_t run_src, run_bytes;
+    range_rec_t rec[RANGE_INFLIGHT];
+    int nrec;
+    uint64_t zero_bytes, copy_bytes;   // in records the receiver has acked
+} range_scan_t;
+
+static void range_init(range_scan_t* z, int fd, const uint8_t* base, const seg_layout_t* L,
+                       uint32_t features, const delta_t* delta){
+    memset(z, 0, sizeof(*z));
+    z->fd = fd; z->base = base; z->L = L;
+    z->sparse = (features & FEAT_SPARSE) != 0;
+    z->delta = (features & FEAT_DELTA) ? delta : NULL;
+    z->unit = (features & FEAT_COMPRESS) ? L->seg_per_chunk : 1;
+    z->scan = 1;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) is_zero = is_zero_avx2;
+#endif
+}
+
+// Looks up the data/hole extent holding off. Without SEEK_DATA support the
+// whole file reads as one data extent.
+static void range_extent(range_scan_t* z, uint64_t off){
+    if (off >= z->ext_lo && off < z->ext_hi) return;
+    uint64_t size = z->L->total;
+    off_t d = lseek(z->fd, (off_t)off, SEEK_DATA);
+    if (d < 0 && errno == ENXIO){            // hole up to EOF
+        z->ext_lo = off; z->ext_hi = size; z->ext_hole = 1;
+    } else if (d < 0){
+        z->ext_lo = 0; z->ext_hi = size; z->ext_hole = 0;
+    } else if ((uint64_t)d > off){
+        z->ext_lo = off; z->ext_hi = (uint64_t)d; z->ext_hole = 1;
+    } else {
+        off_t h = lseek(z->fd, (off_t)off, SEEK_HOLE);
+        z->ext_lo = off; z->ext_hi = h < 0 ? size : (uint64_t)h; z->ext_hole = 0;
+    }
+}
+
+// Basis offset holding input [a, e), or UINT64_MAX if no run covers all of it.
+static uint64_t range_copy_src(range_scan_t* z, uint64_t a, uint64_t e){
+    const delta_t* d = z->delta;
+    while (z->ri < d->nrun && d->run[z->ri].dst + d->run[z->ri].len <= a) z->ri++;
+    if (z->ri == d->nrun) return UINT64_MAX;
+    const delta_run_t* r = &d->run[z->ri];
+    return (r->dst <= a && e <= r->dst + r->len) ? r->src + (a - r->dst) : UINT64_MAX;
+}
+
+static void range_send(int sock, range_rec_t* r){
+    uint8_t pkt[sizeof(pkt_hdr_t) + sizeof(copy_payload_t)];
+    pkt_hdr_t h = { .type = r->type, .seq = htonl(r->first) };
+    size_t len;
+    if (r->type == PKT_COPY){
+        copy_payload_t cp = { htonl(r->count), htonll(r->src) };
+        memcpy(pkt + sizeof(h), &cp, sizeof(cp)); len = sizeof(cp);
+    } else {
+        uint32_t cnt = htonl(r->count);
+        memcpy(pkt + sizeof(h), &cnt, sizeof(cnt)); len = sizeof(cnt);
+    }
+    h.len = htons((uint16_t)len);
+    memcpy(pkt, &h, sizeof(h));
+    if (send(sock, pkt, sizeof(h) + len, 0) < 0) perror("send ZERO/COPY");
+    r->ts = now_s(); r->tx++;
+}
+
+// Announces the collected run if it is long enough, then starts a new one.
+static void range_flush(int sock, range_scan_t* z){
+    if (z->run_type && z->run_len >= RANGE_MIN_SEGS && z->nrec < RANGE_INFLIGHT){
+        range_rec_t* r = &z->rec[z->nrec++];
+        *r = (range_rec_t){ .type = z->run_type, .first = z->run_first, .count = z->run_len, .src = z->run_src };
+        range_send(sock, r);
+    }
+    z->run_type = 0; z->run_len = 0;
+}
+
+// Counts and retires every record whose whole range is acked, whether by its
+// echo or by a cumulative/selective ACK that got there first.
+static void range_settle(range_scan_t* z, const segmap_t* acked){
+    for (int i=0; i<z->nrec; ){
+        range_rec_t* r = &z->rec[i];
+        uint32_t top = r->first + r->count - 1, len;
+        if (segmap_next_zero(acked, r->first, top) <= top){ i++; continue; }
+        uint64_t a = layout_seg(z->L, r->first, &len);
+        *(r->type == PKT_ZERO ? &z->zero_bytes : &z->copy_bytes) += layout_seg(z->L, top, &len) + len - a;
+        *r = z->rec[--z->nrec];
+    }
+}
+
+// Classifies units up to RANGE_LOOKAHEAD seqs past next_to_send.
+static void range_step(int sock, range_scan_t* z, const segmap_t* acked, uint32_t next_to_send){
+    const seg_layout_t* L = z->L;
+    uint32_t total_segs = L->total_segs;
+    if (z->scan < next_to_send){           // fell behind: those went out as DATA
+        range_flush(sock, z);
+        z->scan = (next_to_send - 1 + z->unit - 1) / z->unit * z->unit + 1;
+    }
+    while (z->scan <= total_segs && z->scan - next_to_send < RANGE_LOOKAHEAD && z->nrec < RANGE_INFLIGHT){
+        uint32_t first = z->scan, last = MIN(first + z->unit - 1, total_segs), len;
+        uint64_t a = layout_seg(L, first, &len);
+        uint64_t e = layout_seg(L, last, &len) + len;
+        uint32_t step = last - first + 1;
+        uint64_t src = UINT64_MAX;
+        uint8_t type = 0;
+        if (segmap_next_zero(acked, first, last) > last){
+            // receiver already holds it (resume)
+        } else if (z->sparse){
+            range_extent(z, a);
+            if (z->ext_hole && z->ext_hi >= e){
+                // take every whole unit inside the hole at once
+                type = PKT_ZERO;
+                uint32_t s = total_segs + 1;
+                if (z->ext_hi < L->total) s = (layout_seq_at(L, z->ext_hi) - 1) / z->unit * z->unit + 1;
+                if (s > first + step) step = s - first;
+            } else if (multi_wait(z->mf, e), is_zero(z->base + a, (size_t)(e - a))){
+                type = PKT_ZERO;
+            }
+        }
+        if (!type && z->delta && (src = range_copy_src(z, a, e)) != UINT64_MAX) type = PKT_COPY;
+
+        if (type != z->run_type || (type == PKT_COPY && src != z->run_src + z->run_bytes)) range_flush(sock, z);
+        if (type){
+            if (!z->run_type){
+                z->run_type = type; z->run_first = first; z->run_src = src; z->run_bytes = 0;
+            }
+            uint64_t b = step == last - first + 1 ? e - a : layout_seg(L, first + step - 1, &len) + len - a;
+            z->run_len += step; z->run_bytes += b;
+        }
+        z->scan = first + step;
+    }
+    range_flush(sock, z);
+}
+
+// Transmit DATA seq straight from the mapped file, or with FEAT_COMPRESS from
+// its chunk's stored bytes (cz). With FEAT_CRC32C the CRC32C of everything
+// after it (cz word + payload) rides right after the header.
+static ssize_t send_seg(int sock, const seg_layout_t* L, const uint8_t* base,
+                        uint32_t seq, uint32_t features, int flags, const cz_slot_t* cz){
+    uint32_t len;
+    uint64_t offset = layout_seg(L, seq, &len);
+    const uint8_t* data = base + offset;
+    uint32_t cz_net = 0;
+    if (cz){
+        uint32_t at = ((seq - 1) % L->seg_per_chunk) * L->sub_len;
+        len = MIN(L->sub_len, cz->stored - at);
+        data = cz->data + at;
+        cz_net = htonl(cz->stored | (cz->raw ? CZ_RAW : 0));
+        if (!cz->raw) flags &= ~MSG_ZEROCOPY;   // slot buffers get reused
+    }
+    pkt_hdr_t h; h.type = PKT_DATA; h.seq = htonl(seq); h.len = htons((uint16_t)len);
+    uint32_t crc_net = 0;
+    struct iovec iov[4];
+    int n = 0;
+    iov[n++] = (struct iovec){ &h, sizeof(h) };
+    if (features & FEAT_CRC32C){
+        uint32_t crc = cz ? crc32c_fn(crc32c(&cz_net, sizeof(cz_net)), data, len) : crc32c(data, len);
+        crc_net = htonl(crc);
+        iov[n++] = (struct iovec){ &crc_net, sizeof(crc_net) };
+    }
+    if (cz) iov[n++] = (struct iovec){ &cz_net, sizeof(cz_net) };
+    iov[n++] = (struct iovec){ (void*)data, len };
+    struct msghdr msg = {0};
+    msg.msg_iov = iov; msg.msg_iovlen = (size_t)n;
+    return sendmsg(sock, &msg, flags);
+}
+
+// Read-ahead window over the mapped input (--prefetch_mb, --drop_behind).
+// Either half works alone; step is the granularity of both, 0 = neither.
+typedef struct {
+    uint8_t* base;
+    uint64_t size, dist, step;    // dist 0: no read-ahead
+    uint64_t ahead;           // WILLNEED issued up to here
+    uint64_t behind;          // dropped below here
+    uint64_t page;
+    int fd, drop;
+} prefetch_t;
+
+static void prefetch_step(prefetch_t* p, const seg_layout_t* L, uint32_t next_to_send, uint32_t base){
+    uint32_t len;
+    if (p->dist && next_to_send <= L->total_segs){
+        uint64_t at = layout_seg(L, next_to_send, &len);
+        uint64_t want = MIN(at + p->dist, p->size);
+        if (want >= p->ahead + p->step || (want == p->size && p->ahead < want)){
+            uint64_t a = (p->ahead > at ? p->ahead : at) & ~(p->page - 1);
+            if (a < want) madvise(p->base + a, want - a, MADV_WILLNEED);
+            p->ahead = want;
+        }
+    }
+    if (p->drop && base <= L->total_segs){
+        uint64_t upto = layout_seg(L, base, &len) & ~(p->page - 1);
+        if (upto >= p->behind + p->step){
+            madvise(p->base + p->behind, upto - p->behind, MADV_DONTNEED);
+            posix_fadvise(p->fd, (off_t)p->behind, (off_t)(upto - p->behind), POSIX_FADV_DONTNEED);
+            p->behind = upto;
+        }
+    }
+}
+
+// An RTT sample from a segment acked after a single transmission (Karn).
+static inline void rtt_sample(uint32_t seq, double rtt){
+    stats_rtt(rtt);
+    PROBE2(rtt, seq, (uint64_t)(rtt * 1e6));
+}
+
+// --shm 1: publishes the send loop's state to the live stats page.
+static void shm_sender(uint64_t total, uint64_t acked_bytes, uint64_t retx, int in_flight, int win, int done){
+    uint64_t v[SHM_NFIELDS] = {0};
+    v[SHM_BYTES_TOTAL] = total;
+    v[SHM_BYTES_ACKED] = acked_bytes;
+    v[SHM_PKTS_SENT] = xst.pkts_sent;
+    v[SHM_PKTS_RECV] = xst.pkts_recv;
+    v[SHM_RETX] = retx;
+    v[SHM_IN_FLIGHT] = in_flight > 0 ? (uint64_t)in_flight : 0;
+    v[SHM_CWND] = (uint64_t)win;
+    v[SHM_SRTT_US] = (uint64_t)(xst.srtt * 1e6);
+    v[SHM_QDROPS] = xst.send_err;
+    v[SHM_DONE] = (uint64_t)done;
+    shm_publish(v);
+}
+
+// Streaming mode (FEAT_STREAM): input of unknown length, read into a ring of
+// segment buffers as the window opens. A slot is reused once its seq is
+// acked, so the ring is never larger than the window and zero-copy is off.
+// EOF makes the last (short) segment; END then carries the final size.
+static ssize_t stream_seg(int sock, uint32_t seq, const uint8_t* data, uint32_t len, uint32_t features){
+    pkt_hdr_t h; h.type = PKT_DATA; h.seq = htonl(seq); h.len = htons((uint16_t)len);
+    uint32_t crc_net = 0;
+    struct iovec iov[3];
+    int n = 0;
+    iov[n++] = (struct iovec){ &h, sizeof(h) };
+    if (features & FEAT_CRC32C){
+        crc_net = htonl(crc32c(data, len));
+        iov[n++] = (struct iovec){ &crc_net, sizeof(crc_net) };
+    }
+    iov[n++] = (struct iovec){ (void*)data, len };
+    struct msghdr msg = {0};
+    msg.msg_iov = iov; msg.msg_iovlen = (size_t)n;
+    return sendmsg(sock, &msg, 0);
+}
+
+// Stream input. Pipes are polled so a stalled producer never blocks the
+// loop; a followed regular file reads on past EOF until follow_ms pass with
+// no growth and no write or close seen by inotify. A close alone does not
+// end it: writers that open, append and close again are common (loggers).
+typedef struct {
+    int fd, reg, follow_ms;
+    int ino;                      // inotify fd, -1 if none
+    double idle_since;            // at EOF without writer activity since, 0 = not at EOF
+} stream_in_t;
+
+static void stream_in_open(stream_in_t* s, int fd, int follow_ms){
+    struct stat st;
+    memset(s, 0, sizeof(*s));
+    s->fd = fd; s->ino = -1;
+    s->reg = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    s->follow_ms = s->reg ? follow_ms : 0;
+    if (!s->follow_ms) return;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    s->ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (s->ino >= 0 && inotify_add_watch(s->ino, path, IN_MODIFY | IN_CLOSE_WRITE) < 0){
+        close(s->ino); s->ino = -1;
+    }
+    if (s->ino < 0) fprintf(stderr, "inotify unavailable, --follow ends on the idle timeout only\n");
+}
+
+// Bytes read (> 0), 0 if nothing is available yet, -1 at the end of the input.
+static ssize_t stream_read(stream_in_t* s, uint8_t* p, size_t n){
+    if (!s->reg){
+        struct pollfd pf = { .fd = s->fd, .events = POLLIN };
+        if (poll(&pf, 1, 0) == 0) return 0;
+    }
+    ssize_t r;
+    while ((r = read(s->fd, p, n)) < 0 && errno == EINTR) {}
+    if (r < 0 && errno == EAGAIN) return 0;
+    if (r < 0) die("read input");
+    if (r > 0){ s->idle_since = 0; return r; }
+    if (!s->follow_ms) return -1;
+    double now = now_s();
+    if (s->idle_since == 0.0) s->idle_since = now;
+    uint8_t ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (s->ino >= 0 && read(s->ino, ev, sizeof(ev)) > 0)
+        s->idle_since = now;      // written to or closed: read again before timing out
+    return (now - s->idle_since) * 1000.0 >= s->follow_ms ? -1 : 0;
+}
+
+// Nothing in flight and no input: sleep until input may have arrived.
+static void stream_wait(const stream_in_t* s, int ms){
+    int fd = s->reg ? s->ino : s->fd;
+    struct pollfd pf = { .fd = fd, .events = POLLIN };
+    if (fd >= 0) poll(&pf, 1, ms);
+    else poll(NULL, 0, ms < 50 ? ms : 50);
+}
+
+// Sends everything up to the end of in_fd; returns the byte count and counts
+// retransmissions in *retx.
+static uint64_t stream_send(int sock, int in_fd, uint32_t payload, uint32_t features,
+                            int win, int rto_ms, int retries, int follow_ms, uint64_t* retx){
+    uint32_t ring = 1;
+    while (ring < (uint32_t)win) ring <<= 1;
+    const uint32_t rmask = ring - 1;
+    uint8_t *data   = malloc((size_t)ring * payload);
+    uint32_t *dlen  = calloc(ring, sizeof(uint32_t));
+    uint8_t *acked  = calloc(ring, 1);
+    double *sent_ts = calloc(ring, sizeof(double));
+    int *tx_cnt     = calloc(ring, sizeof(int));
+    if (!data || !dlen || !acked || !sent_ts || !tx_cnt) die("alloc stream");
+
+    stream_in_t si;
+    stream_in_open(&si, in_fd, follow_ms);
+    uint32_t base = 1, next_to_send = 1, last = 0;   // last: final seq, once eof
+    uint32_t fill = 0;                               // bytes so far in next_to_send's slot
+    uint64_t total = 0, acked_bytes = 0;
+    int eof = 0;
+    while (!eof || base <= last){
+        // 1) read and send new segments as the window opens; only full
+        //    segments go out until the input ends
+        int starved = 0;
+        while (!eof && (int)(next_to_send - base) < win){
+            uint32_t k = next_to_send & rmask;
+            uint8_t* p = data + (size_t)k * payload;
+            ssize_t r = stream_read(&si, p + fill, payload - fill);
+            if (r == 0){ starved = 1; break; }
+            if (r > 0 && (fill += (uint32_t)r) < payload) continue;
+            if (r < 0) eof = 1;
+            uint32_t got = fill;
+            fill = 0;
+            if (!got){ last = next_to_send - 1; break; }
+            if (eof) last = next_to_send;
+            dlen[k] = got; acked[k] = 0; tx_cnt[k] = 1; sent_ts[k] = now_s();
+            total += got;
+            if (stream_seg(sock, next_to_send, p, got, features) < 0) perror("sendmsg DATA");
+            TRACE(TR_SEND, next_to_send, next_to_send + 1 - base, 0);
+            PROBE2(send, next_to_send, next_to_send + 1 - base);
+            next_to_send++;
+        }
+
+        // 2) receive ACK/SACK
+        if (base == next_to_send){
+            if (starved) stream_wait(&si, rto_ms);
+            continue;
+        }
+        uint8_t abuf[128];
+        ssize_t r = recv(sock, abuf, sizeof(abuf), 0);
+        pkt_hdr_t *ah = (pkt_hdr_t*)abuf;
+        if (r >= (ssize_t)(sizeof(pkt_hdr_t) + sizeof(ack_payload_t)) && ah->type == PKT_ACK &&
+            ntohs(ah->len) == sizeof(ack_payload_t)){
+            ack_payload_t ap; memcpy(&ap, abuf + sizeof(pkt_hdr_t), sizeof(ap));
+            uint32_t cum = ntohl(ap.cum_ack);
+            uint64_t mask = ntohll(ap.sack_mask);
+            double t_ack = now_s();
+            for (uint32_t s = base; s <= cum && s < next_to_send; ++s){
+                if (!acked[s & rmask] && tx_cnt[s & rmask] == 1) rtt_sample(s, t_ack - sent_ts[s & rmask]);
+                acked[s & rmask] = 1;
+            }
+            for (; mask; mask &= mask - 1){
+                uint32_t s = cum + 1 + (uint32_t)__builtin_ctzll(mask);
+                if (s < base || s >= next_to_send || acked[s & rmask]) continue;
+                if (tx_cnt[s & rmask] == 1) rtt_sample(s, t_ack - sent_ts[s & rmask]);
+                acked[s & rmask] = 1;
+            }
+            while (base < next_to_send && acked[base & rmask]) acked_bytes += dlen[base++ & rmask];
+            TRACE(TR_ACK, cum, ntohll(ap.sack_mask), next_to_send - base);
+            PROBE3(ack, cum, ntohll(ap.sack_mask), next_to_send - base);
+        }
+
+        // 3) retransmit timed-out segments
+        double now = now_s();
+        for (uint32_t s = base; s < next_to_send; ++s){
+            uint32_t k = s & rmask;
+            if (acked[k] || now - sent_ts[k] < (double)rto_ms/1000.0) continue;
+            if (tx_cnt[k] >= retries){ fprintf(stderr, "Failed sending seq=%u after retries.\n", s); exit(1); }
+            TRACE(TR_RTO, s, (uint64_t)((now - sent_ts[k]) * 1e6), 0);
+            TRACE(TR_RETX, s, tx_cnt[k] + 1, 0);
+            PROBE3(retransmit, s, tx_cnt[k] + 1, (uint64_t)((now - sent_ts[k]) * 1e6));
+            if (stream_seg(sock, s, data + (size_t)k * payload, dlen[k], features) < 0) perror("re-sendmsg");
+            tx_cnt[k]++; sent_ts[k] = now; (*retx)++;
+        }
+        if (shm_page) shm_sender(0, acked_bytes, *retx, (int)(next_to_send - base), win, 0);
+    }
+
+    // END: seq = last + 1, carrying the final size
+    stats_phase(PH_TEARDOWN);
+    TRACE(TR_STATE, last + 1, TS_END, 0);
+    pkt_hdr_t h = { .type = PKT_END, .seq = htonl(last + 1), .len = htons(sizeof(uint64_t)) };
+    uint64_t size_net = htonll(total);
+    uint8_t ebuf[sizeof(h) + sizeof(size_net)];
+    memcpy(ebuf, &h, sizeof(h)); memcpy(ebuf + sizeof(h), &size_net, sizeof(size_net));
+    int done = 0;
+    for (int t=0; t<retries && !done; ++t){
+        if (send(sock, ebuf, sizeof(ebuf), 0) < 0) perror("send END");
+        uint8_t abuf[64];
+        ssize_t r = recv(sock, abuf, sizeof(abuf), 0);
+        pkt_hdr_t *ah = (pkt_hdr_t*)abuf;
+        ack_payload_t ap;
+        if (r < (ssize_t)(sizeof(pkt_hdr_t) + sizeof(ap)) || ah->type != PKT_ACK) continue;
+        memcpy(&ap, abuf + sizeof(pkt_hdr_t), sizeof(ap));
+        done = ntohl(ap.cum_ack) == last + 1;           // the END itself is acked
+    }
+    if (!done){ fprintf(stderr,"Failed to finalize END.\n"); exit(1); }
+    if (si.ino >= 0) close(si.ino);
+    free(data); free(dlen); free(acked); free(sent_ts); free(tx_cnt);
+    return total;
+}
+
 int main(int argc, char **argv){
     if (argc < 3){
-        fprintf(stderr, "Usage: %s <server_ip> <input_file> [--port P] [--mtu M] [--rto_ms MS] [--retries N] [--win W] [--zerocopy 1|0]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <server_ip> <input_file|dir|-|synthetic:SIZE> [--port P] [--mtu M|auto] [--mtu_max M] [--rto_ms MS] [--retries N] [--win W] [--zerocopy 1|0] [--chunk C] [--crc 1|0] [--hash 1|0] [--resume 1|0] [--compress 1|0] [--cz_threads N] [--sparse 1|0] [--delta 1|0] [--dedup 1|0] [--stream 1|0] [--follow MS] [--stats-json FILE|-] [--shm 1|0] [--trace FILE] [--source SPEC] [--prefetch_mb MB] [--drop_behind 1|0]\n", argv[0]);
         return 2;
     }
     const char* server_ip = argv[1];
@@ -100,24 +1250,102 @@ int main(int argc, char **argv){
     int rto_ms = DEFAULT_RTO_MS, retries = DEFAULT_RETRIES;
     int win = DEFAULT_WIN;
     int want_zerocopy = 1; // default ON if supported
+    uint32_t chunk = 0;    // 0 = legacy flat layout
+    int pmtud = 0, mtu_max = DEFAULT_MTU_MAX;
+    int want_crc = 0, want_hash = 0, want_resume = 0;
+    int want_compress = 0, cz_threads = 0, want_sparse = 0, want_delta = 0, want_dedup = 0;
+    int want_stream = 0, want_shm = 0;
+    int prefetch_mb = 32, drop_behind = 0, follow_ms = 0;
+    const char* stats_path = NULL;
+    const char* trace_file = NULL;
 
     for (int i=3; i<argc; ++i){
         if (!strcmp(argv[i], "--port") && i+1<argc) port = atoi(argv[++i]);
-        else if (!strcmp(argv[i], "--mtu") && i+1<argc)  mtu  = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--mtu") && i+1<argc){
+            if (!strcmp(argv[++i], "auto")) pmtud = 1;
+            else mtu = atoi(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--mtu_max") && i+1<argc) mtu_max = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--rto_ms") && i+1<argc) rto_ms = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--retries") && i+1<argc) retries = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--win") && i+1<argc) win = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--zerocopy") && i+1<argc) want_zerocopy = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--chunk") && i+1<argc) chunk = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "--crc") && i+1<argc) want_crc = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--hash") && i+1<argc) want_hash = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--resume") && i+1<argc) want_resume = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--compress") && i+1<argc) want_compress = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--cz_threads") && i+1<argc) cz_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--sparse") && i+1<argc) want_sparse = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--delta") && i+1<argc) want_delta = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--dedup") && i+1<argc) want_dedup = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stream") && i+1<argc) want_stream = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--follow") && i+1<argc) follow_ms = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stats-json") && i+1<argc) stats_path = argv[++i];
+        else if (!strcmp(argv[i], "--shm") && i+1<argc) want_shm = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--trace") && i+1<argc) trace_file = argv[++i];
+        else if (!strcmp(argv[i], "--source") && i+1<argc) in_path = argv[++i];
+        else if (!strcmp(argv[i], "--prefetch_mb") && i+1<argc) prefetch_mb = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--drop_behind") && i+1<argc) drop_behind = atoi(argv[++i]);
+        else if (impair_arg(argc, argv, &i)) {}
         else if (!strcmp(argv[i], "--rtt") || !strcmp(argv[i], "--loss")) { ++i; } // ignored legacy
     }
-    if (mtu < 576) { fprintf(stderr, "MTU too small.\n"); return 2; }
+    if (mtu < 576 || (pmtud && mtu_max < 576)) { fprintf(stderr, "MTU too small.\n"); return 2; }
+    if (mtu_max > 65535) mtu_max = 65535;
     if (win < 1 || win > 256) { fprintf(stderr, "Window 1..256 recommended\n"); win = DEFAULT_WIN; }
+    if (!chunk_valid(chunk)) { fprintf(stderr, "Chunk must be a power of two in %u..%u\n", CHUNK_MIN, CHUNK_MAX); return 2; }
+    uint64_t synth_bytes = synth_size(in_path);
+    if (!strncmp(in_path, SYNTH_PREFIX, strlen(SYNTH_PREFIX)) && !synth_bytes){
+        fprintf(stderr, "Bad synthetic size: %s\n", in_path); return 2;
+    }
+    if (synth_bytes && want_stream){ fprintf(stderr, "Synthetic input has a size, ignoring --stream\n"); want_stream = 0; }
+    // stdin, pipes and sockets have no size to announce: stream them
+    struct stat ist;
+    int have_st = strcmp(in_path, "-") != 0 && stat(in_path, &ist) == 0;
+    if (!strcmp(in_path, "-") || (have_st && !S_ISREG(ist.st_mode) && !S_ISDIR(ist.st_mode))) want_stream = 1;
+    if (want_stream){
+        if (want_hash || want_resume || want_compress || want_sparse || want_delta || want_dedup || chunk)
+            fprintf(stderr, "Streaming: only --crc applies, other options ignored\n");
+        want_hash = want_resume = want_compress = want_sparse = want_delta = want_dedup = 0;
+        chunk = 0;
+    }
+    if (want_compress && chunk != CZ_CHUNK){
+        if (chunk) fprintf(stderr, "--compress uses %u-byte chunks, ignoring --chunk %u\n", CZ_CHUNK, chunk);
+        chunk = CZ_CHUNK;
+    }
+    if (cz_threads <= 0) cz_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cz_threads < 1) cz_threads = 1;
+    if (cz_threads > CZ_MAX_THREADS) cz_threads = CZ_MAX_THREADS;
 
-    file_map_t fm; fmap_open_ro(in_path, &fm);
+    // a directory goes as one multi-file stream
+    file_map_t fm;
+    multi_t mf = {0};
+    if (want_stream){
+        memset(&fm, 0, sizeof(fm));
+        fm.fd = strcmp(in_path, "-") ? open(in_path, O_RDONLY) : STDIN_FILENO;
+        if (fm.fd < 0) die("open input");
+    } else if (synth_bytes){
+        memset(&fm, 0, sizeof(fm));
+        fm.fd = -1;
+        fm.size = synth_bytes;
+        fm.id = fnv1a64(fnv1a64(0xcbf29ce484222325ULL, SYNTH_PREFIX, strlen(SYNTH_PREFIX)), &fm.size, sizeof(fm.size));
+        fm.base = synth_map(synth_bytes);
+        if (fm.base == MAP_FAILED) die("map synthetic input");
+    } else if (have_st && S_ISDIR(ist.st_mode)){
+        multi_open(in_path, &mf, &fm);
+        fprintf(stderr, "Directory: %u entries in a %lu-byte stream\n", mf.n, (unsigned long)mf.total);
+    } else {
+        fmap_open_ro(in_path, &fm);
+    }
+    multi_t* mfp = mf.base ? &mf : NULL;
 
     // socket
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) die("socket");
+    stats_phase(PH_HANDSHAKE);
+    if (want_shm) shm_open_page(SHM_SENDER);
+    if (trace_file) trace_open(trace_file, 0, (uint32_t)win);
+    TRACE(TR_STATE, 0, TS_HANDSHAKE, 0);
 
     // optional zerocopy
 #ifdef SO_ZEROCOPY
@@ -145,28 +1373,60 @@ int main(int argc, char **argv){
     if (inet_pton(AF_INET, server_ip, &dst.sin_addr) != 1){ fprintf(stderr,"bad server ip\n"); return 2; }
     if (connect(sock, (struct sockaddr*)&dst, sizeof(dst)) != 0) die("connect");
 
+    if (pmtud){
+        int found = pmtu_discover(sock, mtu_max, want_zerocopy ? MSG_ZEROCOPY : 0);
+        if (found){
+            mtu = found;
+            fprintf(stderr, "PMTUD: path carries MTU %d\n", mtu);
+        } else {
+            fprintf(stderr, "PMTUD: no probe echoed, using MTU %d\n", mtu);
+        }
+    }
+
     const int IP_UDP = 28;
     const int HDR = (int)sizeof(pkt_hdr_t);
-    int payload_max = mtu - IP_UDP - HDR;
+    int payload_max = mtu - IP_UDP - HDR - (want_crc ? DATA_CRC_LEN : 0) - (want_compress ? CZ_HDR_LEN : 0);
     if (payload_max < 512) payload_max = 512;
+    if (payload_max > PAYLOAD_LIMIT) payload_max = PAYLOAD_LIMIT;
 
     // segmentation
     uint64_t total_bytes = fm.size;
-    uint32_t total_segs = (uint32_t)((total_bytes + payload_max - 1) / payload_max);
+    seg_layout_t L;
+    if (layout_init(&L, total_bytes, (uint32_t)payload_max, chunk) != 0){ fprintf(stderr,"bad layout\n"); return 2; }
+    uint32_t total_segs = L.total_segs;
 
-    // per-seg state
-    uint8_t *acked = calloc((size_t)total_segs + 1, 1);
-    double  *sent_ts = calloc((size_t)total_segs + 1, sizeof(double));
-    int     *tx_cnt  = calloc((size_t)total_segs + 1, sizeof(int));
-    if (!acked || !sent_ts || !tx_cnt) die("alloc state");
+    // per-seg state: acked bits for the whole file (compressed), send time and
+    // count only for the window. Unacked seqs below next_to_send all lie in
+    // [base, base+win), so a ring of >= win slots never aliases.
+    segmap_t acked;
+    if (segmap_init(&acked, (uint64_t)total_segs + 1) != 0) die("alloc acked");
+    segmap_set(&acked, 0);                // seq 0 is never sent
+    uint32_t ring = 1;
+    while (ring < (uint32_t)win) ring <<= 1;
+    double  *sent_ts = calloc(ring, sizeof(double));
+    int     *tx_cnt  = calloc(ring, sizeof(int));
+    if (!sent_ts || !tx_cnt) die("alloc state");
+    const uint32_t rmask = ring - 1;
 
-    // START handshake: send filesize
+    // START handshake: send filesize + layout + requested features
+    uint32_t features = (want_crc ? FEAT_CRC32C : 0) | (want_hash ? FEAT_TREE_HASH : 0) |
+                        (want_resume ? FEAT_RESUME : 0) | (want_compress ? FEAT_COMPRESS : 0) |
+                        (want_sparse ? FEAT_SPARSE : 0) | (want_delta ? FEAT_DELTA : 0) |
+                        (want_dedup ? FEAT_DEDUP : 0) | (mfp ? FEAT_MULTI : 0) |
+                        (want_stream ? FEAT_STREAM : 0);
+    uint32_t have_segs = 0;   // FEAT_RESUME: segments the receiver already holds
+    if (want_crc) crc32c_init();
     {
-        pkt_hdr_t h; h.type = PKT_START; h.seq = htonl(0); h.len = htons(sizeof(uint64_t));
-        uint64_t fs_net = htonll(total_bytes);
+        pkt_hdr_t h; h.type = PKT_START; h.seq = htonl(0); h.len = htons(sizeof(start_payload_t));
+        start_payload_t sp;
+        sp.file_size = htonll(total_bytes);
+        sp.chunk     = htonl(chunk);
+        sp.payload   = htons((uint16_t)payload_max);
+        sp.features  = htonl(features);
+        sp.src_id    = htonll(fm.id);
         struct iovec iov[2] = {
             { &h, sizeof(h) },
-            { &fs_net, sizeof(fs_net) }
+            { &sp, sizeof(sp) }
         };
         struct msghdr msg = {0};
         msg.msg_iov = iov; msg.msg_iovlen = 2;
@@ -177,127 +1437,313 @@ int main(int argc, char **argv){
             ssize_t r = recv(sock, abuf, sizeof(abuf), 0);
             if (r >= (ssize_t)sizeof(pkt_hdr_t)){
                 pkt_hdr_t *ah = (pkt_hdr_t*)abuf;
-                if (ah->type == PKT_ACK) break;
+                if (ah->type == PKT_ACK){
+                    start_ack_payload_t sa = {0};
+                    if (ntohs(ah->len) == sizeof(sa) && r >= (ssize_t)(sizeof(pkt_hdr_t) + sizeof(sa)))
+                        memcpy(&sa, abuf + sizeof(pkt_hdr_t), sizeof(sa));
+                    features &= ntohl(sa.features);
+                    have_segs = ntohl(sa.have_segs);
+                    break;
+                }
             }
             if (t == retries-1){ fprintf(stderr,"Failed to handshake START.\n"); exit(1); }
         }
     }
 
-    fprintf(stderr, "MTU=%d payload=%d, RTO=%dms, RETRIES=%d, Port=%d, WIN=%d, ZC=%d, total_segs=%u\n",
-            mtu, payload_max, rto_ms, retries, port, win, want_zerocopy, total_segs);
+    if (want_stream && !(features & FEAT_STREAM)){ fprintf(stderr, "Receiver does not take streams.\n"); exit(1); }
+    if (mfp && !(features & FEAT_MULTI)){ fprintf(stderr, "Receiver does not take directories.\n"); exit(1); }
+    if (mfp && push_manifest(sock, &L, mfp, win, retries) != 0){ fprintf(stderr, "Failed to push manifest.\n"); exit(1); }
+
+    fprintf(stderr, "MTU=%d payload=%d, CHUNK=%u, FEAT=0x%x, RTO=%dms, RETRIES=%d, Port=%d, WIN=%d, ZC=%d, total_segs=%u\n",
+            mtu, payload_max, chunk, features, rto_ms, retries, port, win, want_zerocopy, total_segs);
 
     double t0 = now_s();
+    uint64_t retx = 0;                    // DATA retransmissions (all on RTO)
+    stats_phase(PH_DATA);
+    TRACE(TR_STATE, 0, TS_DATA, 0);
+
+    if (features & FEAT_STREAM){
+        total_bytes = stream_send(sock, fm.fd, (uint32_t)payload_max, features, win, rto_ms, retries, follow_ms, &retx);
+        double secs = now_s() - t0;
+        if (fm.fd != STDIN_FILENO) close(fm.fd);
+        printf("Sender: streamed %lu bytes in %.3f s, avg %.3f Mb/s, %lu retransmits\n",
+               (unsigned long)total_bytes, secs, ((double)total_bytes * 8.0 / 1e6) / secs, (unsigned long)retx);
+        xst.retx_rto = retx;
+        if (shm_page) shm_sender(total_bytes, total_bytes, retx, 0, win, 1);
+        if (stats_path) stats_json(stats_path, stdout, "sender", total_bytes, secs);
+        return 0;
+    }
+
+    tree_job_t tj = { .base = fm.base, .size = total_bytes, .mf = mfp };
+    pthread_t tree_th;
+    if ((features & FEAT_TREE_HASH) && pthread_create(&tree_th, NULL, tree_worker, &tj) != 0)
+        die("pthread_create");
+
+    // compression workers: enough slots for the window plus some read-ahead
+    cz_pool_t cz = { .base = fm.base, .L = &L, .mf = mfp };
+    pthread_t cz_th[CZ_MAX_THREADS];
+    uint32_t cz_seen = 0;                 // chunks handed to the send loop so far
+    uint64_t cz_in = 0, cz_wire = 0;      // ... their raw and stored bytes
+    if (features & FEAT_COMPRESS){
+        cz.nchunks = cz_chunks(&L);
+        cz.nslot = (uint32_t)win / L.seg_per_chunk + 2 + 2 * (uint32_t)cz_threads;
+        cz.slot = calloc(cz.nslot, sizeof(cz_slot_t));
+        if (!cz.slot) die("alloc cz");
+        for (uint32_t i=0; i<cz.nslot; ++i)
+            if (!(cz.slot[i].buf = malloc(CZ_CHUNK))) die("alloc cz");
+        pthread_mutex_init(&cz.mu, NULL);
+        pthread_cond_init(&cz.ready, NULL);
+        pthread_cond_init(&cz.space, NULL);
+        for (int i=0; i<cz_threads; ++i)
+            if (pthread_create(&cz_th[i], NULL, cz_worker, &cz) != 0) die("pthread_create");
+    }
+    const int zc_flags = want_zerocopy ? MSG_ZEROCOPY : 0;
 
     uint32_t base = 1;                    // first unacked seq
     uint32_t next_to_send = 1;            // next seq to transmit
     int in_flight = 0;
 
-    // main loop
-    while (base <= total_segs){
-        // 1) send new within window
-        while (next_to_send <= total_segs && (int)(next_to_send - base) < win){
-            uint64_t offset = (uint64_t)(next_to_send - 1) * (uint64_t)payload_max;
-            uint16_t len = (uint16_t)MIN((uint64_t)payload_max, total_bytes - offset);
-
-            pkt_hdr_t h; h.type = PKT_DATA; h.seq = htonl(next_to_send); h.len = htons(len);
-            struct iovec iov[2] = {
-                { &h, sizeof(h) },
-                { fm.base + offset, len }
-            };
-            struct msghdr msg = {0};
-            msg.msg_iov = iov; msg.msg_iovlen = 2;
+    if ((features & FEAT_RESUME) && have_segs){
+        int64_t held = pull_resume_map(sock, &L, &acked, retries);
+        if (held < 0){ fprintf(stderr, "Failed to fetch resume map.\n"); exit(1); }
+        base = (uint32_t)segmap_next_zero(&acked, base, total_segs);
+        next_to_send = base;
+        if (cz.slot) cz_release(&cz, (base - 1) / L.seg_per_chunk);
+        fprintf(stderr, "Resume: receiver already holds %ld of %u segments\n", (long)held, total_segs);
+    }
 
-            if (sendmsg(sock, &msg, want_zerocopy ? MSG_ZEROCOPY : 0) < 0){
-                perror("sendmsg DATA");
-            } else {
-                if (tx_cnt[next_to_send] == 0) in_flight++;
-                tx_cnt[next_to_send]++;
-                sent_ts[next_to_send] = now_s();
-            }
-            next_to_send++;
+    delta_t delta = {0};
+    if (features & FEAT_DELTA){
+        double td = now_s();
+        if (pull_delta_sigs(sock, &L, &delta, win, retries) != 0){
+            fprintf(stderr, "Delta: no usable signatures from receiver, sending in full\n");
+            features &= ~FEAT_DELTA;
+        } else {
+            multi_wait(mfp, total_bytes);
+            delta_match(&delta, fm.base, total_bytes);
+            uint64_t matched = 0;
+            for (size_t i=0; i<delta.nrun; ++i) matched += delta.run[i].len;
+            fprintf(stderr, "Delta: %lu of %lu bytes found in the receiver's %u x %u-byte blocks (%.3f s)\n",
+                    (unsigned long)matched, (unsigned long)total_bytes, delta.nblocks, delta.block_len, now_s() - td);
         }
+    }
+    if (features & FEAT_DEDUP){
+        double td = now_s();
+        dedup_chunk_t* ch = NULL;
+        dedup_init();
+        multi_wait(mfp, total_bytes);
+        uint32_t nc = dedup_chunk(fm.base, total_bytes, &ch);
+        if (!nc) die("dedup chunking");
+        double tc = now_s();
+        int64_t filled = query_dedup(sock, &L, ch, nc, (features & FEAT_COMPRESS) ? L.seg_per_chunk : 0,
+                                     &acked, win, retries);
+        free(ch);
+        if (filled < 0){ fprintf(stderr, "Dedup: chunk query timed out.\n"); exit(1); }
+        base = (uint32_t)segmap_next_zero(&acked, base, total_segs);
+        next_to_send = base;
+        if (cz.slot) cz_release(&cz, (base - 1) / L.seg_per_chunk);
+        fprintf(stderr, "Dedup: %u chunks (%.3f s), receiver store had %lu of %lu bytes (%.3f s)\n",
+                nc, tc - td, (unsigned long)filled, (unsigned long)total_bytes, now_s() - tc);
+    }
+    range_scan_t zs;
+    range_init(&zs, fm.fd, fm.base, &L, features, &delta);
+    zs.mf = mfp;
 
-        // 2) receive ACK/SACK (non-blocking due to SO_RCVTIMEO)
-        uint8_t abuf[128];
-        ssize_t r = recv(sock, abuf, sizeof(abuf), 0);
-        if (r >= (ssize_t)sizeof(pkt_hdr_t)){
-            pkt_hdr_t *ah = (pkt_hdr_t*)abuf;
-            if (ah->type == PKT_ACK && ntohs(ah->len) == sizeof(ack_payload_t)){
-                ack_payload_t ap = {0};
-                memcpy(&ap, abuf + sizeof(pkt_hdr_t), sizeof(ap));
-                uint32_t cum = ntohl(ap.cum_ack);
-                uint64_t mask = ntohll(ap.sack_mask);
-
-                // ack all <= cum
-                for (uint32_t s = base; s <= cum && s <= total_segs; ++s){
-                    if (!acked[s]) { acked[s] = 1; in_flight -= (tx_cnt[s] > 0); }
+    // read-ahead only pays for a real file (not a directory stream or synthetic input)
+    prefetch_t pf = { .base = fm.base, .size = total_bytes, .fd = fm.fd, .drop = drop_behind,
+                      .page = (uint64_t)sysconf(_SC_PAGESIZE) };
+    if (fm.fd >= 0 && prefetch_mb > 0){
+        pf.dist = (uint64_t)prefetch_mb << 20;
+        pf.step = pf.dist / 4;
+    }
+    if (fm.fd >= 0 && drop_behind && !pf.step) pf.step = 8 << 20;   // drop-behind without read-ahead
+
+    // main loop; a tree-hash mismatch at END re-opens it for the leaves the
+    // receiver asks to have repaired
+    int hashed = (features & FEAT_TREE_HASH) != 0, joined = 0;
+    int verified = 1, repairs = 0;
+    for (;;){
+        while (base <= total_segs){
+            // 0) announce zero/copy ranges ahead of the send loop
+            if (features & (FEAT_SPARSE | FEAT_DELTA)) range_step(sock, &zs, &acked, next_to_send);
+            if (pf.step) prefetch_step(&pf, &L, next_to_send, base);
+
+            // 1) send new within window
+            while (next_to_send <= total_segs && (int)(next_to_send - base) < win){
+                if (segmap_get(&acked, next_to_send)){ next_to_send++; continue; }   // intact during repair
+                const cz_slot_t* cs = NULL;
+                if (cz.slot){
+                    uint32_t c = (next_to_send - 1) / L.seg_per_chunk;
+                    cs = cz_get(&cz, c);
+                    // seqs past the stored bytes are never sent
+                    segmap_set_range(&acked, cz_first_seq(&L, c) + cz_used_segs(&L, cs->stored),
+                                     (uint64_t)cz_last_seq(&L, c) + 1);
+                    if (c >= cz_seen){ cz_seen = c + 1; cz_in += cz_raw_len(&L, c); cz_wire += cs->stored; }
+                }
+                if (!cs){
+                    uint32_t len;
+                    uint64_t off = layout_seg(&L, next_to_send, &len);
+                    multi_wait(mfp, off + len);
+                }
+                tx_cnt[next_to_send & rmask] = 0; sent_ts[next_to_send & rmask] = 0.0;
+                if (send_seg(sock, &L, fm.base, next_to_send, features, zc_flags, cs) < 0){
+                    perror("sendmsg DATA");
+                } else {
+                    in_flight++;
+                    tx_cnt[next_to_send & rmask] = 1;
+                    sent_ts[next_to_send & rmask] = now_s();
+                    TRACE(TR_SEND, next_to_send, (uint64_t)in_flight, 0);
+                    PROBE2(send, next_to_send, in_flight);
                 }
-                // advance base
-                while (base <= total_segs && acked[base]) base++;
-
-                // ack masked beyond cum
-                for (int i=0; i<64; ++i){
-                    if (mask & (1ULL << i)){
-                        uint32_t s = cum + 1 + (uint32_t)i;
-                        if (s <= total_segs && !acked[s]){
-                            acked[s] = 1;
-                            if (tx_cnt[s] > 0) in_flight--;
+                next_to_send++;
+            }
+
+            // 2) receive ACK/SACK (non-blocking due to SO_RCVTIMEO)
+            uint8_t abuf[128];
+            ssize_t r = recv(sock, abuf, sizeof(abuf), 0);
+            if (r >= (ssize_t)sizeof(pkt_hdr_t)){
+                pkt_hdr_t *ah = (pkt_hdr_t*)abuf;
+                if (ah->type == PKT_ACK && ntohs(ah->len) == sizeof(ack_payload_t)){
+                    ack_payload_t ap = {0};
+                    memcpy(&ap, abuf + sizeof(pkt_hdr_t), sizeof(ap));
+                    uint32_t cum = ntohl(ap.cum_ack);
+                    uint64_t mask = ntohll(ap.sack_mask);
+                    double t_ack = now_s();
+
+                    // ack all <= cum and the masked seqs past it, slide base
+                    uint64_t fresh = sack_apply(&acked, &base, cum, mask, total_segs, next_to_send,
+                                                tx_cnt, sent_ts, rmask, &in_flight, t_ack, rtt_sample);
+                    if (fresh) PROBE2(sack, cum, fresh);
+                    if (cz.slot) cz_release(&cz, (base - 1) / L.seg_per_chunk);
+                    if (zs.nrec) range_settle(&zs, &acked);
+                    TRACE(TR_ACK, cum, mask, (uint64_t)in_flight);
+                    PROBE3(ack, cum, mask, in_flight);
+                } else if (ah->type == PKT_ZERO || ah->type == PKT_COPY){
+                    uint32_t first = ntohl(ah->seq);
+                    for (int i=0; i<zs.nrec; ++i){
+                        if (zs.rec[i].first != first || zs.rec[i].type != ah->type) continue;
+                        uint32_t top = first + zs.rec[i].count - 1;
+                        for (uint32_t s = first; (s = (uint32_t)segmap_next_zero(&acked, s, top)) <= top; ++s){
+                            segmap_set(&acked, s);
+                            in_flight -= (s < next_to_send && tx_cnt[s & rmask] > 0);
                         }
+                        range_settle(&zs, &acked);
+                        break;
                     }
+                    base = (uint32_t)segmap_next_zero(&acked, base, total_segs);
+                    if (cz.slot) cz_release(&cz, (base - 1) / L.seg_per_chunk);
                 }
-                // slide base again
-                while (base <= total_segs && acked[base]) base++;
             }
-        }
 
-        // 3) retransmit timed-out gaps inside window
-        double now = now_s();
-        for (uint32_t s = base; s < next_to_send; ++s){
-            if (s==0 || s>total_segs) continue;
-            if (acked[s]) continue;
-            if (tx_cnt[s] >= retries){
-                fprintf(stderr,"Failed sending seq=%u after retries.\n", s);
-                exit(1);
+            // 3) retransmit timed-out gaps inside window
+            double now = now_s();
+            for (uint32_t s = base; (s = sack_next_due(&acked, s, next_to_send, sent_ts, rmask, now,
+                                                       (double)rto_ms/1000.0)) < next_to_send; ++s){
+                if (tx_cnt[s & rmask] >= retries){
+                    fprintf(stderr,"Failed sending seq=%u after retries.\n", s);
+                    exit(1);
+                }
+                TRACE(TR_RTO, s, (uint64_t)((now - sent_ts[s & rmask]) * 1e6), 0);
+                TRACE(TR_RETX, s, (uint64_t)tx_cnt[s & rmask] + 1, 0);
+                PROBE3(retransmit, s, tx_cnt[s & rmask] + 1, (uint64_t)((now - sent_ts[s & rmask]) * 1e6));
+                const cz_slot_t* cs = cz.slot ? cz_get(&cz, (s - 1) / L.seg_per_chunk) : NULL;
+                if (send_seg(sock, &L, fm.base, s, features, zc_flags, cs) < 0) perror("re-sendmsg");
+                tx_cnt[s & rmask]++; sent_ts[s & rmask] = now; retx++;
+            }
+            for (int i=0; i<zs.nrec; ++i){
+                if (now - zs.rec[i].ts < (double)rto_ms/1000.0) continue;
+                if (zs.rec[i].tx >= retries){
+                    fprintf(stderr,"Failed sending %s range seq=%u after retries.\n",
+                            zs.rec[i].type == PKT_ZERO ? "zero" : "copy", zs.rec[i].first);
+                    exit(1);
+                }
+                range_send(sock, &zs.rec[i]);
             }
-            if (now - sent_ts[s] >= (double)rto_ms/1000.0){
-                uint64_t offset = (uint64_t)(s - 1) * (uint64_t)payload_max;
-                uint16_t len = (uint16_t)MIN((uint64_t)payload_max, total_bytes - offset);
-                pkt_hdr_t h; h.type = PKT_DATA; h.seq = htonl(s); h.len = htons(len);
-                struct iovec iov[2] = {
-                    { &h, sizeof(h) },
-                    { fm.base + offset, len }
-                };
-                struct msghdr msg = {0};
-                msg.msg_iov = iov; msg.msg_iovlen = 2;
-                if (sendmsg(sock, &msg, want_zerocopy ? MSG_ZEROCOPY : 0) < 0) perror("re-sendmsg");
-                tx_cnt[s]++; sent_ts[s] = now;
+            if (shm_page){
+                uint32_t len;
+                shm_sender(total_bytes, base <= total_segs ? layout_seg(&L, base, &len) : total_bytes,
+                           retx, in_flight, win, 0);
             }
         }
-    }
+        range_settle(&zs, &acked);        // everything is acked; late echoes are moot
 
-    // END: seq = total_segs + 1
-    {
-        uint32_t end_seq = total_segs + 1;
-        pkt_hdr_t h; h.type = PKT_END; h.seq = htonl(end_seq); h.len = htons(0);
-        for (int t=0; t<retries; ++t){
-            if (send(sock, &h, sizeof(h), want_zerocopy ? MSG_ZEROCOPY : 0) < 0) perror("send END");
-            uint8_t abuf2[64];
-            ssize_t r2 = recv(sock, abuf2, sizeof(abuf2), 0);
-            if (r2 >= (ssize_t)sizeof(pkt_hdr_t)){
-                pkt_hdr_t *ah = (pkt_hdr_t*)abuf2;
-                if (ah->type == PKT_ACK) break;
+        // END: seq = total_segs + 1, carrying our tree root with FEAT_TREE_HASH
+        {
+            stats_phase(PH_TEARDOWN);
+            TRACE(TR_STATE, total_segs + 1, TS_END, 0);
+            if (hashed && !joined){
+                if (pthread_join(tree_th, NULL) != 0) die("pthread_join");
+                joined = 1;
+            }
+            uint32_t end_seq = total_segs + 1;
+            pkt_hdr_t h; h.type = PKT_END; h.seq = htonl(end_seq); h.len = htons(hashed ? BLAKE3_OUT_LEN : 0);
+            struct iovec iov[2] = { { &h, sizeof(h) }, { tj.root, BLAKE3_OUT_LEN } };
+            struct msghdr msg = {0};
+            msg.msg_iov = iov; msg.msg_iovlen = hashed ? 2 : 1;
+            for (int t=0; t<retries; ++t){
+                if (sendmsg(sock, &msg, want_zerocopy ? MSG_ZEROCOPY : 0) < 0) perror("send END");
+                uint8_t abuf2[64];
+                ssize_t r2 = recv(sock, abuf2, sizeof(abuf2), 0);
+                if (r2 >= (ssize_t)sizeof(pkt_hdr_t)){
+                    pkt_hdr_t *ah = (pkt_hdr_t*)abuf2;
+                    if (ah->type == PKT_ACK && !hashed) break;
+                    if (ah->type == PKT_TREE_REQ && hashed){ verified = 0; break; } // END-ACK lost, repair began
+                    if (ah->type == PKT_ACK && ntohs(ah->len) == sizeof(end_ack_payload_t) &&
+                        r2 >= (ssize_t)(sizeof(pkt_hdr_t) + sizeof(end_ack_payload_t))){
+                        end_ack_payload_t ea; memcpy(&ea, abuf2 + sizeof(pkt_hdr_t), sizeof(ea));
+                        verified = memcmp(ea.root, tj.root, BLAKE3_OUT_LEN) == 0;
+                        break;
+                    }
+                }
+                if (t == retries-1){ fprintf(stderr,"Failed to finalize END.\n"); exit(1); }
+            }
+            if (hashed){
+                fprintf(stderr, "Tree hash ");
+                for (int i=0; i<BLAKE3_OUT_LEN; ++i) fprintf(stderr, "%02x", tj.root[i]);
+                fprintf(stderr, verified ? " verified by receiver\n" : " MISMATCH at receiver\n");
             }
-            if (t == retries-1){ fprintf(stderr,"Failed to finalize END.\n"); exit(1); }
         }
+
+        if (verified || repairs == MAX_REPAIR_ROUNDS) break;
+        repairs++;
+        TRACE(TR_STATE, 0, TS_REPAIR, (uint64_t)repairs);
+        uint32_t first = serve_repair(sock, &L, &tj, &acked, retries);
+        if (!first) break;
+        fprintf(stderr, "Repair round %d: resending from seq=%u\n", repairs, first);
+        base = next_to_send = first;
+        if (cz.slot) cz_rewind(&cz, (first - 1) / L.seg_per_chunk);
     }
 
     double t1 = now_s();
+    TRACE(TR_STATE, 0, TS_DONE, 0);
+    multi_close(&mf);
     fmap_close(&fm);
-    free(acked); free(sent_ts); free(tx_cnt);
+    segmap_free(&acked); free(sent_ts); free(tx_cnt);
+    free(tj.nodes);
+    free(delta.weak); free(delta.strong); free(delta.run);
+    if (cz.slot){
+        pthread_mutex_lock(&cz.mu);
+        cz.stop = 1;
+        pthread_cond_broadcast(&cz.space);
+        pthread_mutex_unlock(&cz.mu);
+        for (int i=0; i<cz_threads; ++i) pthread_join(cz_th[i], NULL);
+        for (uint32_t i=0; i<cz.nslot; ++i) free(cz.slot[i].buf);
+        free(cz.slot);
+        fprintf(stderr, "Compression: %lu bytes sent as %lu (%.2fx)\n", (unsigned long)cz_in,
+                (unsigned long)cz_wire, cz_wire ? (double)cz_in / (double)cz_wire : 0.0);
+    }
+
+    if (features & FEAT_SPARSE)
+        fprintf(stderr, "Sparse: %lu bytes sent as zero ranges\n", (unsigned long)zs.zero_bytes);
+    if (features & FEAT_DELTA)
+        fprintf(stderr, "Delta: %lu bytes sent as copy ranges\n", (unsigned long)zs.copy_bytes);
 
     double secs = t1 - t0;
     double bits = (double)total_bytes * 8.0;
-    printf("Sender: sent %lu bytes in %.3f s, avg %.3f Mb/s\n",
-           (unsigned long)total_bytes, secs, (bits/1e6)/secs);
-    return 0;
+    printf("Sender: sent %lu bytes in %.3f s, avg %.3f Mb/s, %lu retransmits\n",
+           (unsigned long)total_bytes, secs, (bits/1e6)/secs, (unsigned long)retx);
+    xst.retx_rto = retx;
+    if (shm_page) shm_sender(total_bytes, total_bytes, retx, 0, win, 1);
+    if (stats_path) stats_json(stats_path, stdout, "sender", total_bytes, secs);
+    return verified ? 0 : 1;
 }